@@ -0,0 +1,212 @@
+/**
+ * @file aesd-byte-ring.c
+ * @brief Contiguous, optionally double mapped, payload storage for aesd_circular_buffer entries
+ *
+ * Entries are carved out of the ring in FIFO order, so adding one never allocates and evicting
+ * the oldest only moves an offset.
+ */
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#else
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "aesd-byte-ring.h"
+
+#define ENTRIES AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+#ifndef __KERNEL__
+/**
+ * Map one memfd twice, back to back, so reads and writes past ring[capacity - 1] land at ring[0]
+ * @return the mapping, or NULL if any step is unsupported
+ */
+static char *map_twice(size_t capacity)
+{
+    int fd = memfd_create("aesd-byte-ring", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        return NULL;
+    }
+    char *base = NULL;
+    if (ftruncate(fd, capacity) == 0)
+    {
+        // reserve both halves first so nothing else can land in the second one
+        base = mmap(NULL, 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            base = NULL;
+        }
+        else if (mmap(base, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+                 mmap(base + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+        {
+            munmap(base, 2 * capacity);
+            base = NULL;
+        }
+    }
+    close(fd);
+    return base;
+}
+#endif
+
+/**
+* Initializes @param ring with @param capacity bytes of payload storage.
+* @param double_map requests the double mapping; it is only available in user space, where the
+*   capacity is rounded up to a whole number of pages.  When it cannot be set up the ring falls
+*   back to plain storage and ring->double_mapped stays false.
+* @return 0, or -ENOMEM / -EINVAL
+*/
+int aesd_byte_ring_init(struct aesd_byte_ring *ring, size_t capacity, bool double_map)
+{
+    memset(ring, 0, sizeof(struct aesd_byte_ring));
+    aesd_circular_buffer_init(&ring->index);
+    if (capacity == 0)
+    {
+        return -EINVAL;
+    }
+
+#ifndef __KERNEL__
+    if (double_map)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t rounded = (capacity + page - 1) / page * page;
+        ring->ring = map_twice(rounded);
+        if (ring->ring != NULL)
+        {
+            ring->capacity = rounded;
+            ring->double_mapped = true;
+            return 0;
+        }
+    }
+    ring->ring = malloc(capacity);
+#else
+    ring->ring = vmalloc(capacity);
+#endif
+    if (ring->ring == NULL)
+    {
+        return -ENOMEM;
+    }
+    ring->capacity = capacity;
+    return 0;
+}
+
+/**
+* Releases the storage of @param ring.  Entry descriptors must not be used afterwards.
+*/
+void aesd_byte_ring_free(struct aesd_byte_ring *ring)
+{
+#ifndef __KERNEL__
+    if (ring->double_mapped)
+    {
+        munmap(ring->ring, 2 * ring->capacity);
+    }
+    else
+    {
+        free(ring->ring);
+    }
+#else
+    vfree(ring->ring);
+#endif
+    memset(ring, 0, sizeof(struct aesd_byte_ring));
+}
+
+static size_t entry_count(const struct aesd_circular_buffer *index)
+{
+    if (index->full)
+    {
+        return ENTRIES;
+    }
+    return (index->in_offs + ENTRIES - index->out_offs) % ENTRIES;
+}
+
+/**
+ * Drop the oldest entry.  Its bytes, and any padding after it, become free simply by shrinking
+ * ring->used to the distance from the next entry's start to the tail.
+ */
+static void evict_oldest(struct aesd_byte_ring *ring)
+{
+    struct aesd_circular_buffer *index = &ring->index;
+    struct aesd_buffer_entry *oldest = &index->entry[index->out_offs];
+    uint8_t next = (index->out_offs + 1) % ENTRIES;
+
+    ring->size -= oldest->size;
+    if (entry_count(index) == 1)
+    {
+        ring->used = 0;
+        ring->tail = 0;
+    }
+    else
+    {
+        size_t start = index->entry[next].buffptr - ring->ring;
+        ring->used = (ring->tail + ring->capacity - start) % ring->capacity;
+        if (ring->used == 0)
+        {
+            // the remaining entries fill the ring exactly
+            ring->used = ring->capacity;
+        }
+    }
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    index->out_offs = next;
+    index->full = false;
+}
+
+/**
+* Adds an entry of @param size bytes to @param ring, evicting the oldest entries until both an
+* entry slot and the bytes are free, and returns where the caller must store the payload
+* (with memcpy() or copy_from_user()).  In a double mapped ring the payload may run past the
+* end of the ring; otherwise it always starts again at offset 0 when it does not fit before
+* the end.
+* Any necessary locking must be handled by the caller.
+* @return the payload location, or NULL if size is 0 or larger than the ring
+*/
+char *aesd_byte_ring_alloc_entry(struct aesd_byte_ring *ring, size_t size)
+{
+    if (size == 0 || size > ring->capacity)
+    {
+        return NULL;
+    }
+
+    size_t offset;
+    while (1)
+    {
+        size_t count = entry_count(&ring->index);
+        if (count == 0)
+        {
+            ring->tail = 0;
+            ring->used = 0;
+        }
+        size_t free_bytes = ring->capacity - ring->used;
+        size_t before_end = ring->capacity - ring->tail;
+        if (count < ENTRIES)
+        {
+            if (size <= free_bytes && (ring->double_mapped || size <= before_end))
+            {
+                offset = ring->tail;
+                break;
+            }
+            if (!ring->double_mapped && size > before_end && before_end + size <= free_bytes)
+            {
+                // skip the unusable end of the ring
+                ring->used += before_end;
+                offset = 0;
+                break;
+            }
+        }
+        evict_oldest(ring);
+    }
+
+    struct aesd_buffer_entry entry = { ring->ring + offset, size };
+    aesd_circular_buffer_add_entry(&ring->index, &entry);
+    ring->tail = (offset + size) % ring->capacity;
+    ring->used += size;
+    ring->size += size;
+    return ring->ring + offset;
+}
@@ -0,0 +1,47 @@
+/*
+ * aesd-byte-ring.h
+ *
+ * Owning storage for aesd_circular_buffer entries: payloads live in one
+ * contiguous ring of bytes and the entry descriptors point into it.
+ */
+
+#ifndef AESD_BYTE_RING_H
+#define AESD_BYTE_RING_H
+
+#include "aesd-circular-buffer.h"
+
+struct aesd_byte_ring
+{
+    /**
+     * Entry descriptors, usable with every aesd_circular_buffer read function
+     */
+    struct aesd_circular_buffer index;
+    /**
+     * The ring storage.  When double_mapped, ring[capacity .. 2 * capacity) maps the same
+     * memory again, so an entry that runs past the end of the ring is still contiguous.
+     */
+    char *ring;
+    size_t capacity;
+    /**
+     * Ring offset where the next entry starts
+     */
+    size_t tail;
+    /**
+     * Bytes from the oldest entry's start to tail, including any padding skipped at the end
+     * of a ring that is not double mapped
+     */
+    size_t used;
+    /**
+     * Sum of the live entries' sizes
+     */
+    size_t size;
+    bool double_mapped;
+};
+
+extern int aesd_byte_ring_init(struct aesd_byte_ring *ring, size_t capacity, bool double_map);
+
+extern void aesd_byte_ring_free(struct aesd_byte_ring *ring);
+
+extern char *aesd_byte_ring_alloc_entry(struct aesd_byte_ring *ring, size_t size);
+
+#endif /* AESD_BYTE_RING_H */
@@ -52,6 +52,52 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
     return &buffer->entry[entry_idx];
 }
 
+/**
+ * @param buffer the buffer to read from.  Any necessary locking must be performed by caller.
+ * @param char_offset the zero referenced character index of the first byte to describe, as for
+ *      aesd_circular_buffer_find_entry_offset_for_fpos()
+ * @param length the number of bytes to describe, starting at char_offset
+ * @param iov the array to fill with one slice per spanned entry, oldest first, following the
+ *      entries across the end of the entry array.  The slices point at the entries' buffptr memory,
+ *      so they can be passed straight to writev()/sendmsg() with no intermediate copy.
+ * @param iov_max the number of elements available in iov
+ * @param iov_count_rtn is a pointer specifying a location to store the number of iov elements filled
+ * @return the number of bytes described by iov, which is less than length when the buffer holds
+ *      fewer bytes past char_offset or iov_max slices were not enough
+ */
+size_t aesd_circular_buffer_fill_iovec(struct aesd_circular_buffer *buffer, size_t char_offset,
+            size_t length, struct iovec *iov, size_t iov_max, size_t *iov_count_rtn)
+{
+    size_t entry_offset = 0;
+    size_t count = 0;
+    size_t total = 0;
+    struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset,
+            &entry_offset);
+    uint8_t entry_idx = entry == NULL ? 0 : entry - buffer->entry;
+
+    while (entry != NULL && total < length && count < iov_max)
+    {
+        size_t chunk = entry->size - entry_offset;
+        if (chunk > length - total)
+        {
+            chunk = length - total;
+        }
+        if (chunk > 0)
+        {
+            iov[count].iov_base = (void *)(entry->buffptr + entry_offset);
+            iov[count].iov_len = chunk;
+            count++;
+            total += chunk;
+        }
+
+        entry_offset = 0;
+        advance(&entry_idx, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+        entry = entry_idx == buffer->in_offs ? NULL : &buffer->entry[entry_idx];
+    }
+    *iov_count_rtn = count;
+    return total;
+}
+
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
@@ -65,16 +111,13 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     * TODO: implement per description
     */
     memcpy(&buffer->entry[buffer->in_offs], add_entry, sizeof(struct aesd_buffer_entry));
-    if (buffer->in_offs == buffer->out_offs)
+    if (buffer->full)
     {
+        // the oldest entry was just overwritten
         advance(&buffer->out_offs, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
     }
     advance(&buffer->in_offs, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
-
-    if (buffer->in_offs == buffer->out_offs)
-    {
-        buffer->full = true;
-    }
+    buffer->full = buffer->in_offs == buffer->out_offs;
 }
 
 /**
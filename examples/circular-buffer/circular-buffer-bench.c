@@ -0,0 +1,151 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "aesd-circular-buffer.h"
+
+/*
+    Reads the whole of a full aesd_circular_buffer, starting at every offset
+    in turn, two ways: one entry at a time through
+    aesd_circular_buffer_find_entry_offset_for_fpos() as a read() handler
+    does today, and with one aesd_circular_buffer_fill_iovec() call.
+
+    input:
+        1: entry_size: bytes per entry (default 64)
+        2: rounds: passes over all start offsets (default 2000)
+
+    output:
+        ns per full read for each method, copying to memory and writing
+        to /dev/null
+*/
+
+static double _now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// the current approach: look the position up again for every entry
+static size_t _read_by_entry(struct aesd_circular_buffer *buffer, size_t fpos, size_t length,
+                             char *out, int fd)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        size_t entry_offset;
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer,
+                fpos + done, &entry_offset);
+        if (entry == NULL)
+        {
+            break;
+        }
+        size_t chunk = entry->size - entry_offset;
+        if (chunk > length - done)
+        {
+            chunk = length - done;
+        }
+        if (fd == -1)
+        {
+            memcpy(out + done, entry->buffptr + entry_offset, chunk);
+        }
+        else if (write(fd, entry->buffptr + entry_offset, chunk) != (ssize_t)chunk)
+        {
+            break;
+        }
+        done += chunk;
+    }
+    return done;
+}
+
+static size_t _read_by_iovec(struct aesd_circular_buffer *buffer, size_t fpos, size_t length,
+                             char *out, int fd)
+{
+    struct iovec iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t count;
+    size_t total = aesd_circular_buffer_fill_iovec(buffer, fpos, length, iov,
+            AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, &count);
+    if (fd != -1)
+    {
+        return writev(fd, iov, count) == (ssize_t)total ? total : 0;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(out, iov[i].iov_base, iov[i].iov_len);
+        out += iov[i].iov_len;
+    }
+    return total;
+}
+
+typedef size_t (*ReadFn)(struct aesd_circular_buffer *, size_t, size_t, char *, int);
+
+static double _measure(ReadFn read_fn, struct aesd_circular_buffer *buffer, size_t total,
+                       char *out, int fd, int rounds)
+{
+    size_t checksum = 0;
+    double start = _now_ns();
+    for (int round = 0; round < rounds; round++)
+    {
+        for (size_t fpos = 0; fpos < total; fpos += 7)
+        {
+            checksum += read_fn(buffer, fpos, total - fpos, out, fd);
+        }
+    }
+    double elapsed = _now_ns() - start;
+    // keep the reads observable
+    if (checksum == 0)
+    {
+        printf("nothing read\n");
+    }
+    return elapsed / (rounds * ((total + 6) / 7));
+}
+
+int main(int argc, char **argv)
+{
+    size_t entry_size = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+    int rounds = argc > 2 ? atoi(argv[2]) : 2000;
+    if (entry_size == 0 || rounds < 1)
+    {
+        fprintf(stderr, "usage: %s [entry_size] [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    size_t total = entry_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    char *storage = malloc(total);
+    char *out = malloc(total);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (storage == NULL || out == NULL || null_fd == -1)
+    {
+        perror("setup");
+        return 1;
+    }
+    memset(storage, 'a', total);
+
+    // overfill so the live entries wrap around the end of the entry array
+    struct aesd_circular_buffer buffer;
+    aesd_circular_buffer_init(&buffer);
+    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++)
+    {
+        struct aesd_buffer_entry entry = {
+            storage + (i % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) * entry_size, entry_size
+        };
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+
+    printf("%d entries of %zu bytes\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, entry_size);
+    printf("%-10s %14s %14s\n", "", "by_entry_ns", "iovec_ns");
+    printf("%-10s %14.1f %14.1f\n", "memcpy",
+           _measure(_read_by_entry, &buffer, total, out, -1, rounds),
+           _measure(_read_by_iovec, &buffer, total, out, -1, rounds));
+    printf("%-10s %14.1f %14.1f\n", "/dev/null",
+           _measure(_read_by_entry, &buffer, total, out, null_fd, rounds / 10 + 1),
+           _measure(_read_by_iovec, &buffer, total, out, null_fd, rounds / 10 + 1));
+
+    close(null_fd);
+    free(out);
+    free(storage);
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "systemcalls.h"
+
+/*
+    Launch latency of fork()+execv() against do_exec()'s posix_spawn() as
+    the parent's resident set grows.
+
+    input:
+        1: max_rss_mb: largest parent RSS to measure (default 1024)
+        2: iterations: launches per measurement (default 200)
+
+    output:
+        one row per RSS step: rss_mb fork_us spawn_us
+*/
+
+#define HELPER "/bin/true"
+
+static double _now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void _fork_exec(void)
+{
+    pid_t child_pid = fork();
+    if (child_pid == 0)
+    {
+        char *const argv[] = { HELPER, NULL };
+        execv(HELPER, argv);
+        _exit(127);
+    }
+    if (child_pid > 0)
+    {
+        waitpid(child_pid, NULL, 0);
+    }
+}
+
+static void _spawn_exec(void)
+{
+    do_exec(1, HELPER);
+}
+
+static double _measure(void (*launch)(void), int iterations)
+{
+    double start = _now_us();
+    for (int i = 0; i < iterations; i++)
+    {
+        launch();
+    }
+    return (_now_us() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    size_t max_rss_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+    int iterations = argc > 2 ? atoi(argv[2]) : 200;
+    if (iterations < 1)
+    {
+        iterations = 1;
+    }
+
+    char *ballast = NULL;
+    size_t touched = 0;
+    printf("%10s %12s %12s\n", "rss_mb", "fork_us", "spawn_us");
+    for (size_t rss_mb = 0; rss_mb <= max_rss_mb; rss_mb = rss_mb ? 2 * rss_mb : 64)
+    {
+        // grow the parent and touch every page so it is really resident
+        size_t size = rss_mb << 20;
+        if (size > touched)
+        {
+            char *temp = realloc(ballast, size);
+            if (temp == NULL)
+            {
+                perror("realloc()");
+                break;
+            }
+            ballast = temp;
+            memset(ballast + touched, 1, size - touched);
+            touched = size;
+        }
+
+        double fork_us = _measure(_fork_exec, iterations);
+        double spawn_us = _measure(_spawn_exec, iterations);
+        printf("%10zu %12.1f %12.1f\n", rss_mb, fork_us, spawn_us);
+    }
+
+    free(ballast);
+    return 0;
+}
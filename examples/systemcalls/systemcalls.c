@@ -1,10 +1,17 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <fcntl.h>
+#include <spawn.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <errno.h>
 
+extern char **environ;
+
 bool input_sanitizer(const char *path) {
     if (path == NULL) return false;
     if (path[0] == '$') return false;
@@ -12,6 +19,36 @@ bool input_sanitizer(const char *path) {
     return path[0] == '/';
 }
 
+/**
+ * Launch argv[0] with posix_spawn() and wait for it. glibc implements
+ * posix_spawn() with clone(CLONE_VM | CLONE_VFORK), so unlike fork() the
+ * parent's page tables are never copied and launch cost does not grow with
+ * the parent's resident size.
+ * @return true if the command ran and exited with status 0
+ */
+static bool spawn_and_wait(char *const argv[], const posix_spawn_file_actions_t *actions)
+{
+    pid_t child_pid;
+    int error = posix_spawn(&child_pid, argv[0], actions, NULL, argv, environ);
+    if (error != 0)
+    {
+        errno = error;
+        perror("posix_spawn()");
+        return false;
+    }
+
+    int status;
+    while (waitpid(child_pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            perror("waitpid()");
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -23,16 +60,16 @@ bool do_system(const char *cmd)
 {
 
 /*
- *  Call the system() function with the command set in the cmd
- *   and return a boolean true if the system() call completed with success
+ *  Run cmd through /bin/sh -c as system() would, but spawned rather than
+ *   forked, and return a boolean true if the command completed with success
  *   or false() if it returned a failure
 */
-    if (system(cmd) == -1)
+    if (cmd == NULL)
     {
-        perror("system()");
         return false;
     }
-    return true;
+    char *const argv[] = { "/bin/sh", "-c", (char *)cmd, NULL };
+    return spawn_and_wait(argv, NULL);
 }
 
 /**
@@ -72,6 +109,7 @@ bool do_exec(int count, ...)
  *   as second argument to the execv() command.
  *
 */
+    va_end(args);
     for (i = 0; i < count; i++)
     {
         if (!input_sanitizer(command[i]))
@@ -80,33 +118,7 @@ bool do_exec(int count, ...)
         }
     }
 
-    int child_pid = fork();
-    switch (child_pid)
-    {
-    case -1:
-        perror("fork()");
-        break;
-        
-    case 0:
-        // child process
-        if (execv(command[0], &command[1]))
-        {
-            perror("execv()");
-        }
-        break;
-
-    default:
-        // parent process
-        if (waitpid(child_pid, NULL, 0) == -1)
-        {
-            perror("waitpid()");
-        }
-        break;
-    }
-
-    va_end(args);
-
-    return true;
+    return spawn_and_wait(command, NULL);
 }
 
 /**
@@ -136,42 +148,314 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
  *   The rest of the behaviour is same as do_exec()
  *
 */
-    int child_pid = fork();
-    switch (child_pid)
+    // the child opens outputfile onto its stdout between clone and exec
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0)
     {
-    case -1:
-        perror("fork()");
         return false;
-        
-    case 0:
-        // child process
-        int fd = open(outputfile, O_WRONLY | O_TRUNC | O_CREAT, 0644);
-        if (fd == -1)
+    }
+    bool result = false;
+    if (posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                         O_WRONLY | O_TRUNC | O_CREAT, 0644) == 0)
+    {
+        result = spawn_and_wait(command, &actions);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return result;
+}
+
+#define RUNNER_READ_SIZE (64 * 1024)
+#define RUNNER_MAX_EVENTS 64
+// how often children without a pidfd are polled for exit
+#define RUNNER_POLL_MS 10
+
+enum { RUNNER_EVENT_STDOUT, RUNNER_EVENT_STDERR, RUNNER_EVENT_EXIT };
+
+typedef struct runner_proc {
+    pid_t pid;
+    int pidfd;
+    int out_fd;
+    int err_fd;
+    bool running;
+} runner_proc;
+
+void runner_capture(void *buffers, int stream, const char *data, size_t size)
+{
+    runner_buffer *buffer = &((runner_buffer *)buffers)[stream == RUNNER_STDERR];
+    if (buffer->size + size + 1 > buffer->capacity)
+    {
+        size_t capacity = 2 * (buffer->size + size + 1);
+        char *temp = realloc(buffer->data, capacity);
+        if (temp == NULL)
         {
-            perror("open()");
-            return false;
+            return;
+        }
+        buffer->data = temp;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    buffer->data[buffer->size] = '\0';
+}
+
+static int runner_watch(int epoll_fd, int fd, size_t index, int kind)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = (uint64_t)index << 2 | kind;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void runner_close(int *fd)
+{
+    if (*fd != -1)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static void runner_reaped(runner_command *command, runner_proc *proc, int status)
+{
+    command->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    proc->running = false;
+    runner_close(&proc->pidfd);
+}
+
+/**
+ * Spawn the pipeline that starts at @param head. Each member's stdout is
+ * either a pipe to the next member's stdin or a pipe back to the runner;
+ * stderr always comes back to the runner. Every descriptor is created
+ * close-on-exec, so children only keep what the file actions dup2().
+ * @return number of processes started
+ */
+static size_t runner_launch(runner_command *commands, runner_proc *procs, size_t head, int epoll_fd)
+{
+    size_t started = 0;
+    int stdin_fd = -1;
+    for (size_t i = head; ; i = commands[i].pipe_to)
+    {
+        int out[2] = { -1, -1 };
+        int err[2] = { -1, -1 };
+        bool piped = commands[i].pipe_to >= 0;
+        posix_spawn_file_actions_t actions;
+        bool ok = pipe2(out, O_CLOEXEC) == 0 && pipe2(err, O_CLOEXEC) == 0 &&
+                  posix_spawn_file_actions_init(&actions) == 0;
+        if (ok)
+        {
+            if (stdin_fd != -1)
+            {
+                posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+            }
+            posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+            posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+            int error = posix_spawn(&procs[i].pid, commands[i].argv[0], &actions, NULL,
+                                    commands[i].argv, environ);
+            posix_spawn_file_actions_destroy(&actions);
+            if (error != 0)
+            {
+                errno = error;
+                perror("posix_spawn()");
+                ok = false;
+            }
         }
-        if (dup2(fd, STDOUT_FILENO) == -1)
+        runner_close(&stdin_fd);
+        runner_close(&out[1]);
+        runner_close(&err[1]);
+        if (!ok)
         {
-            close(fd);
-            perror("dup2()");
-            abort();
+            runner_close(&out[0]);
+            runner_close(&err[0]);
+            break;
         }
-        close(fd);
-        execv(command[0], command);
-        perror("execv()");
-        abort();
-        break;
 
-    default:
-        // parent process
-        if (waitpid(child_pid, NULL, 0) == -1)
+        started++;
+        procs[i].running = true;
+        procs[i].pidfd = syscall(SYS_pidfd_open, procs[i].pid, 0);
+        if (procs[i].pidfd != -1 && runner_watch(epoll_fd, procs[i].pidfd, i, RUNNER_EVENT_EXIT) != 0)
         {
-            perror("waitpid()");
-            return false;
+            runner_close(&procs[i].pidfd);
         }
-        break;
+        procs[i].err_fd = err[0];
+        runner_watch(epoll_fd, err[0], i, RUNNER_EVENT_STDERR);
+        if (piped)
+        {
+            stdin_fd = out[0];
+        }
+        else
+        {
+            procs[i].out_fd = out[0];
+            runner_watch(epoll_fd, out[0], i, RUNNER_EVENT_STDOUT);
+            break;
+        }
+    }
+    // a pipeline cut short leaves its read end for nobody
+    runner_close(&stdin_fd);
+    return started;
+}
+
+static size_t runner_pipeline_length(const runner_command *commands, size_t head)
+{
+    size_t length = 1;
+    for (int next = commands[head].pipe_to; next >= 0; next = commands[next].pipe_to)
+    {
+        length++;
+    }
+    return length;
+}
+
+static size_t runner_next_head(const bool *has_upstream, size_t count, size_t from)
+{
+    while (from < count && has_upstream[from])
+    {
+        from++;
+    }
+    return from;
+}
+
+static void runner_drain(runner_command *command, int stream, int *fd, char *buffer)
+{
+    ssize_t bytes = read(*fd, buffer, RUNNER_READ_SIZE);
+    if (bytes > 0)
+    {
+        if (command->on_output != NULL)
+        {
+            command->on_output(command->context, stream, buffer, bytes);
+        }
+    }
+    else if (bytes == 0 || errno != EINTR)
+    {
+        runner_close(fd);
     }
+}
 
-    return true;
+bool run_commands(runner_command *commands, size_t count, size_t max_parallel)
+{
+    if (max_parallel == 0)
+    {
+        max_parallel = 1;
+    }
+
+    // every pipe_to must point forward at a command with no other upstream
+    bool *has_upstream = calloc(count ? count : 1, sizeof(bool));
+    runner_proc *procs = calloc(count ? count : 1, sizeof(runner_proc));
+    char *buffer = malloc(RUNNER_READ_SIZE);
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    bool valid = has_upstream != NULL && procs != NULL && buffer != NULL && epoll_fd != -1;
+    for (size_t i = 0; valid && i < count; i++)
+    {
+        commands[i].exit_status = -1;
+        procs[i].pidfd = procs[i].out_fd = procs[i].err_fd = -1;
+        int next = commands[i].pipe_to;
+        if (commands[i].argv == NULL || commands[i].argv[0] == NULL ||
+            (next >= 0 && ((size_t)next <= i || (size_t)next >= count || has_upstream[next])))
+        {
+            valid = false;
+        }
+        else if (next >= 0)
+        {
+            has_upstream[next] = true;
+        }
+    }
+
+    size_t head = runner_next_head(has_upstream, count, 0);
+    size_t running = 0;
+    bool launched_all = true;
+    while (valid)
+    {
+        // start pipelines in order while they fit; one too long to ever
+        // fit starts alone
+        while (head < count)
+        {
+            size_t length = runner_pipeline_length(commands, head);
+            if (running > 0 && running + length > max_parallel)
+            {
+                break;
+            }
+            size_t started = runner_launch(commands, procs, head, epoll_fd);
+            launched_all &= started == length;
+            running += started;
+            head = runner_next_head(has_upstream, count, head + 1);
+        }
+
+        bool open_fds = false;
+        bool need_poll = false;
+        for (size_t i = 0; i < count; i++)
+        {
+            open_fds |= procs[i].out_fd != -1 || procs[i].err_fd != -1;
+            need_poll |= procs[i].running && procs[i].pidfd == -1;
+        }
+        if (running == 0 && !open_fds && head == count)
+        {
+            break;
+        }
+
+        struct epoll_event events[RUNNER_MAX_EVENTS];
+        int ready = epoll_wait(epoll_fd, events, RUNNER_MAX_EVENTS, need_poll ? RUNNER_POLL_MS : -1);
+        if (ready == -1 && errno != EINTR)
+        {
+            perror("epoll_wait()");
+            break;
+        }
+        for (int e = 0; e < ready; e++)
+        {
+            size_t i = events[e].data.u64 >> 2;
+            int kind = events[e].data.u64 & 3;
+            if (kind == RUNNER_EVENT_STDOUT)
+            {
+                runner_drain(&commands[i], RUNNER_STDOUT, &procs[i].out_fd, buffer);
+            }
+            else if (kind == RUNNER_EVENT_STDERR)
+            {
+                runner_drain(&commands[i], RUNNER_STDERR, &procs[i].err_fd, buffer);
+            }
+            else
+            {
+                int status;
+                if (waitpid(procs[i].pid, &status, WNOHANG) == procs[i].pid)
+                {
+                    runner_reaped(&commands[i], &procs[i], status);
+                    running--;
+                }
+            }
+        }
+        // kernels without pidfd_open(): reap by polling
+        for (size_t i = 0; need_poll && i < count; i++)
+        {
+            int status;
+            if (procs[i].running && procs[i].pidfd == -1 &&
+                waitpid(procs[i].pid, &status, WNOHANG) == procs[i].pid)
+            {
+                runner_reaped(&commands[i], &procs[i], status);
+                running--;
+            }
+        }
+    }
+
+    // on an error exit, close the pipes first so no child blocks writing
+    // to them, then reap everything that was started
+    bool success = valid && launched_all;
+    for (size_t i = 0; procs != NULL && i < count; i++)
+    {
+        runner_close(&procs[i].out_fd);
+        runner_close(&procs[i].err_fd);
+    }
+    for (size_t i = 0; procs != NULL && i < count; i++)
+    {
+        int status;
+        if (procs[i].running && waitpid(procs[i].pid, &status, 0) == procs[i].pid)
+        {
+            runner_reaped(&commands[i], &procs[i], status);
+        }
+        runner_close(&procs[i].pidfd);
+        success &= commands[i].exit_status == 0;
+    }
+    if (epoll_fd != -1)
+    {
+        close(epoll_fd);
+    }
+    free(buffer);
+    free(procs);
+    free(has_upstream);
+    return success;
 }
@@ -7,3 +7,52 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+#include <stddef.h>
+
+#define RUNNER_STDOUT 1
+#define RUNNER_STDERR 2
+
+/**
+ * Receives output from a running command as it arrives.
+ * @param stream RUNNER_STDOUT or RUNNER_STDERR
+ */
+typedef void (*runner_output_fn)(void *context, int stream, const char *data, size_t size);
+
+/**
+ * One command for run_commands().
+ * argv: NULL terminated, argv[0] is the full path to the command
+ * pipe_to: index of a later command whose stdin receives this command's
+ *   stdout, or -1 to capture stdout through on_output
+ * on_output: receives captured stdout and stderr, NULL discards them
+ * exit_status: filled in with the command's exit status, or -1 if it was
+ *   not run or was killed by a signal
+ */
+typedef struct runner_command {
+    char *const *argv;
+    int pipe_to;
+    runner_output_fn on_output;
+    void *context;
+    int exit_status;
+} runner_command;
+
+/**
+ * Growable buffer pair for runner_capture(): [0] is stdout, [1] is stderr.
+ * Release with free() on each data pointer.
+ */
+typedef struct runner_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+} runner_buffer;
+
+void runner_capture(void *buffers, int stream, const char *data, size_t size);
+
+/**
+ * Run @param count commands with at most @param max_parallel processes
+ * alive at once. Commands joined by pipe_to form a pipeline that starts as
+ * a unit. Output of every process is read from a single epoll loop, and
+ * children are reaped as they exit.
+ * @return true if every command ran and exited with status 0
+ */
+bool run_commands(runner_command *commands, size_t count, size_t max_parallel);
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lock_profile.h"
+
+/*
+    Contention benchmark: every thread repeatedly takes one shared lock,
+    holds it for hold_ns, releases it and works outside it for work_ns.
+    Each lock kind is measured with the same LockSite accounting.
+
+    input:
+        1: threads (default 4)
+        2: hold_ns: time spent inside the lock (default 100)
+        3: work_ns: time spent outside the lock (default 1000)
+        4: iterations per thread (default 100000)
+
+    output:
+        throughput and LockSite statistics per lock kind
+*/
+
+typedef struct LockKind {
+    const char* m_name;
+    void (*m_init)(void* lock);
+    void (*m_lock)(void* lock);
+    int (*m_trylock)(void* lock);
+    void (*m_unlock)(void* lock);
+} LockKind;
+
+typedef struct BenchShared {
+    const LockKind* m_kind;
+    void* m_lock;
+    LockSite m_site;
+    uint64_t m_hold_ns;
+    uint64_t m_work_ns;
+    long m_iterations;
+    pthread_barrier_t m_start;
+} BenchShared;
+
+static void _pthread_init(void* lock)
+{
+    pthread_mutex_init(lock, NULL);
+}
+
+static void _adaptive_init(void* lock)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void _pthread_lock(void* lock)
+{
+    pthread_mutex_lock(lock);
+}
+
+static int _pthread_trylock(void* lock)
+{
+    return pthread_mutex_trylock(lock);
+}
+
+static void _pthread_unlock(void* lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+static void _ticket_init(void* lock)
+{
+    ticket_lock_init(lock);
+}
+
+static void _ticket_lock(void* lock)
+{
+    ticket_lock_lock(lock);
+}
+
+static int _ticket_trylock(void* lock)
+{
+    return ticket_lock_trylock(lock);
+}
+
+static void _ticket_unlock(void* lock)
+{
+    ticket_lock_unlock(lock);
+}
+
+static void _futex_init(void* lock)
+{
+    futex_lock_init(lock);
+}
+
+static void _futex_lock(void* lock)
+{
+    futex_lock_lock(lock);
+}
+
+static int _futex_trylock(void* lock)
+{
+    return futex_lock_trylock(lock);
+}
+
+static void _futex_unlock(void* lock)
+{
+    futex_lock_unlock(lock);
+}
+
+static const LockKind kinds[] = {
+    { "pthread", _pthread_init, _pthread_lock, _pthread_trylock, _pthread_unlock },
+    { "adaptive", _adaptive_init, _pthread_lock, _pthread_trylock, _pthread_unlock },
+    { "ticket", _ticket_init, _ticket_lock, _ticket_trylock, _ticket_unlock },
+    { "futex", _futex_init, _futex_lock, _futex_trylock, _futex_unlock },
+};
+
+static void _spin_for(uint64_t ns)
+{
+    uint64_t end = lock_profile_now_ns() + ns;
+    while (ns > 0 && lock_profile_now_ns() < end)
+    {
+    }
+}
+
+static void* _bench_thread(void* arg)
+{
+    BenchShared* shared = (BenchShared*)arg;
+    const LockKind* kind = shared->m_kind;
+    pthread_barrier_wait(&shared->m_start);
+
+    for (long i = 0; i < shared->m_iterations; i++)
+    {
+        int contended = 0;
+        uint64_t start = 0;
+        if (kind->m_trylock(shared->m_lock) != 0)
+        {
+            contended = 1;
+            start = lock_profile_now_ns();
+            kind->m_lock(shared->m_lock);
+        }
+        uint64_t acquired = lock_profile_now_ns();
+        lock_site_acquired(&shared->m_site, contended ? acquired - start : 0, contended);
+
+        _spin_for(shared->m_hold_ns);
+
+        lock_site_released(&shared->m_site, lock_profile_now_ns() - acquired);
+        kind->m_unlock(shared->m_lock);
+
+        _spin_for(shared->m_work_ns);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv)
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    uint64_t hold_ns = argc > 2 ? strtoull(argv[2], NULL, 10) : 100;
+    uint64_t work_ns = argc > 3 ? strtoull(argv[3], NULL, 10) : 1000;
+    long iterations = argc > 4 ? atol(argv[4]) : 100000;
+    if (threads < 1 || iterations < 1)
+    {
+        fprintf(stderr, "usage: %s [threads] [hold_ns] [work_ns] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    // large enough for any of the lock kinds, on its own cache line
+    void* lock = aligned_alloc(64, 64);
+    if (ids == NULL || lock == NULL)
+    {
+        perror("malloc()");
+        return 1;
+    }
+
+    printf("%d threads, hold %llu ns, work %llu ns, %ld iterations each\n",
+           threads, (unsigned long long)hold_ns, (unsigned long long)work_ns, iterations);
+    for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+    {
+        BenchShared shared;
+        memset(lock, 0, 64);
+        shared.m_kind = &kinds[k];
+        shared.m_lock = lock;
+        shared.m_hold_ns = hold_ns;
+        shared.m_work_ns = work_ns;
+        shared.m_iterations = iterations;
+        lock_site_init(&shared.m_site, kinds[k].m_name);
+        pthread_barrier_init(&shared.m_start, NULL, threads + 1);
+        kinds[k].m_init(lock);
+
+        int started = 0;
+        for (; started < threads; started++)
+        {
+            if (pthread_create(&ids[started], NULL, _bench_thread, &shared) != 0)
+            {
+                perror("pthread_create()");
+                return 1;
+            }
+        }
+        uint64_t start = lock_profile_now_ns();
+        pthread_barrier_wait(&shared.m_start);
+        for (int i = 0; i < started; i++)
+        {
+            pthread_join(ids[i], NULL);
+        }
+        double seconds = (lock_profile_now_ns() - start) / 1e9;
+        pthread_barrier_destroy(&shared.m_start);
+
+        printf("\n%s: %.0f acquisitions/s\n", kinds[k].m_name, threads * iterations / seconds);
+        lock_site_report(&shared.m_site, stdout);
+    }
+
+    free(lock);
+    free(ids);
+    return 0;
+}
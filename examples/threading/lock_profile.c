@@ -0,0 +1,203 @@
+#define _GNU_SOURCE
+#include "lock_profile.h"
+#include <linux/futex.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TICKET_SPIN_LIMIT 1024
+
+uint64_t lock_profile_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void lock_site_init(LockSite* site, const char* name)
+{
+    memset(site, 0, sizeof(LockSite));
+    site->m_name = name;
+}
+
+static int _bucket(uint64_t ns)
+{
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    return bucket < LOCK_HISTOGRAM_BUCKETS ? bucket : LOCK_HISTOGRAM_BUCKETS - 1;
+}
+
+void lock_site_acquired(LockSite* site, uint64_t wait_ns, int contended)
+{
+    atomic_fetch_add_explicit(&site->m_acquisitions, 1, memory_order_relaxed);
+    if (contended)
+    {
+        atomic_fetch_add_explicit(&site->m_contended, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&site->m_wait_ns, wait_ns, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&site->m_wait_histogram[_bucket(wait_ns)], 1, memory_order_relaxed);
+}
+
+void lock_site_released(LockSite* site, uint64_t hold_ns)
+{
+    atomic_fetch_add_explicit(&site->m_hold_ns, hold_ns, memory_order_relaxed);
+    unsigned long max = atomic_load_explicit(&site->m_hold_max_ns, memory_order_relaxed);
+    while (hold_ns > max &&
+           !atomic_compare_exchange_weak_explicit(&site->m_hold_max_ns, &max, hold_ns,
+                                                  memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+/* lock_site_report()
+ *   One summary line, then the non-empty wait histogram buckets
+ */
+void lock_site_report(const LockSite* site, FILE* stream)
+{
+    unsigned long acquisitions = atomic_load(&site->m_acquisitions);
+    unsigned long contended = atomic_load(&site->m_contended);
+    unsigned long wait_ns = atomic_load(&site->m_wait_ns);
+    unsigned long hold_ns = atomic_load(&site->m_hold_ns);
+    fprintf(stream, "lock %s: %lu acquisitions, %lu contended (%.1f%%), "
+            "wait avg %.0f ns, hold avg %.0f ns max %lu ns\n",
+            site->m_name, acquisitions, contended,
+            acquisitions ? 100.0 * contended / acquisitions : 0.0,
+            contended ? (double)wait_ns / contended : 0.0,
+            acquisitions ? (double)hold_ns / acquisitions : 0.0,
+            atomic_load(&site->m_hold_max_ns));
+    for (int i = 0; i < LOCK_HISTOGRAM_BUCKETS; i++)
+    {
+        unsigned long count = atomic_load(&site->m_wait_histogram[i]);
+        if (count != 0)
+        {
+            fprintf(stream, "    wait < %llu ns: %lu\n", 1ull << i, count);
+        }
+    }
+}
+
+/* profiled_mutex_init()
+ *   adaptive selects PTHREAD_MUTEX_ADAPTIVE_NP, which spins briefly before
+ *   sleeping
+ * out: 0 success, pthread error otherwise
+ */
+int profiled_mutex_init(ProfiledMutex* lock, const char* name, int adaptive)
+{
+#ifdef LOCK_PROFILE
+    lock_site_init(&lock->m_site, name);
+    lock->m_acquired_ns = 0;
+#else
+    (void)name;
+#endif
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (adaptive)
+    {
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    }
+    int status = pthread_mutex_init(&lock->m_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return status;
+}
+
+/* profiled_mutex_report()
+ *   Print the lock's statistics; does nothing without LOCK_PROFILE
+ */
+void profiled_mutex_report(const ProfiledMutex* lock, FILE* stream)
+{
+#ifdef LOCK_PROFILE
+    lock_site_report(&lock->m_site, stream);
+#else
+    (void)lock;
+    (void)stream;
+#endif
+}
+
+/* profiled_mutex_destroy()
+ *   Profiled builds print the lock's statistics to stderr first
+ */
+void profiled_mutex_destroy(ProfiledMutex* lock)
+{
+    profiled_mutex_report(lock, stderr);
+    pthread_mutex_destroy(&lock->m_mutex);
+}
+
+void ticket_lock_init(TicketLock* lock)
+{
+    atomic_init(&lock->m_next, 0);
+    atomic_init(&lock->m_serving, 0);
+}
+
+void ticket_lock_lock(TicketLock* lock)
+{
+    unsigned int ticket = atomic_fetch_add_explicit(&lock->m_next, 1, memory_order_relaxed);
+    for (int spins = 0; atomic_load_explicit(&lock->m_serving, memory_order_acquire) != ticket; spins++)
+    {
+        // with more threads than CPUs the next ticket holder may be
+        // preempted, so stop burning the timeslice it needs
+        if (spins == TICKET_SPIN_LIMIT)
+        {
+            sched_yield();
+            spins = 0;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+int ticket_lock_trylock(TicketLock* lock)
+{
+    unsigned int serving = atomic_load_explicit(&lock->m_serving, memory_order_relaxed);
+    unsigned int expected = serving;
+    return atomic_compare_exchange_strong_explicit(&lock->m_next, &expected, serving + 1,
+                                                   memory_order_acquire, memory_order_relaxed) ? 0 : -1;
+}
+
+void ticket_lock_unlock(TicketLock* lock)
+{
+    atomic_fetch_add_explicit(&lock->m_serving, 1, memory_order_release);
+}
+
+static void _futex(atomic_int* addr, int op, int value)
+{
+    syscall(SYS_futex, addr, op | FUTEX_PRIVATE_FLAG, value, NULL, NULL, 0);
+}
+
+void futex_lock_init(FutexLock* lock)
+{
+    atomic_init(&lock->m_state, 0);
+}
+
+void futex_lock_lock(FutexLock* lock)
+{
+    int state = 0;
+    if (atomic_compare_exchange_strong(&lock->m_state, &state, 1))
+    {
+        return;
+    }
+    if (state != 2)
+    {
+        state = atomic_exchange(&lock->m_state, 2);
+    }
+    while (state != 0)
+    {
+        _futex(&lock->m_state, FUTEX_WAIT, 2);
+        state = atomic_exchange(&lock->m_state, 2);
+    }
+}
+
+int futex_lock_trylock(FutexLock* lock)
+{
+    int state = 0;
+    return atomic_compare_exchange_strong(&lock->m_state, &state, 1) ? 0 : -1;
+}
+
+void futex_lock_unlock(FutexLock* lock)
+{
+    if (atomic_fetch_sub(&lock->m_state, 1) != 1)
+    {
+        atomic_store(&lock->m_state, 0);
+        _futex(&lock->m_state, FUTEX_WAKE, 1);
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef LOCK_PROFILE_H
+#define LOCK_PROFILE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+    Mutex wrappers with optional contention profiling. Built without
+    LOCK_PROFILE, ProfiledMutex is a plain pthread mutex and the wrappers
+    compile down to pthread_mutex_lock()/unlock(). With LOCK_PROFILE every
+    lock keeps a LockSite: acquisitions, contended acquisitions, a log2
+    histogram of wait times and total/max hold time.
+*/
+
+// bucket i counts waits of [2^(i-1), 2^i) ns; the last bucket is open ended
+#define LOCK_HISTOGRAM_BUCKETS 32
+
+typedef struct LockSite {
+    const char* m_name;
+    atomic_ulong m_acquisitions;
+    atomic_ulong m_contended;
+    atomic_ulong m_wait_ns;
+    atomic_ulong m_hold_ns;
+    atomic_ulong m_hold_max_ns;
+    atomic_ulong m_wait_histogram[LOCK_HISTOGRAM_BUCKETS];
+} LockSite;
+
+typedef struct ProfiledMutex {
+    pthread_mutex_t m_mutex;
+#ifdef LOCK_PROFILE
+    LockSite m_site;
+    uint64_t m_acquired_ns;
+#endif
+} ProfiledMutex;
+
+/*
+ * Ticket spinlock: FIFO handoff, no syscalls, burns CPU while waiting.
+ */
+typedef struct TicketLock {
+    atomic_uint m_next;
+    atomic_uint m_serving;
+} TicketLock;
+
+/*
+ * Three state futex mutex (0 free, 1 locked, 2 locked with waiters), so an
+ * uncontended unlock never enters the kernel.
+ */
+typedef struct FutexLock {
+    atomic_int m_state;
+} FutexLock;
+
+uint64_t lock_profile_now_ns(void);
+void lock_site_init(LockSite* site, const char* name);
+void lock_site_acquired(LockSite* site, uint64_t wait_ns, int contended);
+void lock_site_released(LockSite* site, uint64_t hold_ns);
+void lock_site_report(const LockSite* site, FILE* stream);
+
+int profiled_mutex_init(ProfiledMutex* lock, const char* name, int adaptive);
+void profiled_mutex_destroy(ProfiledMutex* lock);
+void profiled_mutex_report(const ProfiledMutex* lock, FILE* stream);
+
+void ticket_lock_init(TicketLock* lock);
+void ticket_lock_lock(TicketLock* lock);
+int ticket_lock_trylock(TicketLock* lock);
+void ticket_lock_unlock(TicketLock* lock);
+
+void futex_lock_init(FutexLock* lock);
+void futex_lock_lock(FutexLock* lock);
+int futex_lock_trylock(FutexLock* lock);
+void futex_lock_unlock(FutexLock* lock);
+
+static inline int profiled_mutex_lock(ProfiledMutex* lock)
+{
+#ifdef LOCK_PROFILE
+    int contended = 0;
+    uint64_t start = 0;
+    if (pthread_mutex_trylock(&lock->m_mutex) != 0)
+    {
+        contended = 1;
+        start = lock_profile_now_ns();
+        int status = pthread_mutex_lock(&lock->m_mutex);
+        if (status != 0)
+        {
+            return status;
+        }
+    }
+    lock->m_acquired_ns = lock_profile_now_ns();
+    lock_site_acquired(&lock->m_site, contended ? lock->m_acquired_ns - start : 0, contended);
+    return 0;
+#else
+    return pthread_mutex_lock(&lock->m_mutex);
+#endif
+}
+
+static inline int profiled_mutex_unlock(ProfiledMutex* lock)
+{
+#ifdef LOCK_PROFILE
+    lock_site_released(&lock->m_site, lock_profile_now_ns() - lock->m_acquired_ns);
+#endif
+    return pthread_mutex_unlock(&lock->m_mutex);
+}
+
+#endif // LOCK_PROFILE_H
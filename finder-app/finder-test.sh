@@ -53,10 +53,11 @@ fi
 # make clean
 # make
 
+# one writer process for all files: each record is "<path><TAB><payload>"
 for i in $( seq 1 "$NUMFILES")
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | writer -b
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 
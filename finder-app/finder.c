@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "search.h"
+#include "trigram_index.h"
+
+/*
+    Native replacement for finder.sh: walks the tree once, counting regular
+    files and the lines containing searchstr in the same pass.
+
+    input:
+        -i indexfile: optional trigram index, reused and refreshed across runs
+        1: filesdir: directory to search
+        2: searchstr: text string to search for
+
+    output:
+        "The number of files are X and the number of matching lines are Y"
+        1 = error
+*/
+
+#define MAX_THREADS 16
+#define DIRENT_BUFFER_SIZE (64 * 1024)
+#define READ_SIZE (256 * 1024)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * Directories waiting to be scanned. The owner pushes and pops at the tail,
+ * idle workers steal the oldest (usually shallowest) entries from the head.
+ */
+typedef struct WorkDeque {
+    char** m_items;
+    size_t m_head;
+    size_t m_tail;
+    size_t m_capacity;
+    pthread_mutex_t m_lock;
+} WorkDeque;
+
+typedef struct Worker {
+    pthread_t m_thread;
+    int m_index;
+    WorkDeque m_deque;
+    size_t m_files;
+    size_t m_lines;
+    char* m_read_buffer;
+    char* m_carry;
+    size_t m_carry_capacity;
+    TrigramSet m_trigrams;
+    IndexEntry** m_entries;
+    size_t m_entry_count;
+    size_t m_entry_capacity;
+    size_t m_changed;
+} Worker;
+
+static Worker workers[MAX_THREADS];
+static int num_workers = 1;
+
+// directories queued or being scanned; the walk is done when this reaches 0
+static atomic_long pending_dirs = 0;
+
+// set by -i; files whose index entry lacks a needle trigram are never opened
+static const char* index_path = NULL;
+static TrigramIndex trigram_index;
+static uint32_t* needle_trigrams = NULL;
+static size_t needle_trigram_count = 0;
+
+static int _push(WorkDeque* deque, char* path)
+{
+    pthread_mutex_lock(&deque->m_lock);
+    if (deque->m_head > 0 && deque->m_head == deque->m_tail)
+    {
+        deque->m_head = 0;
+        deque->m_tail = 0;
+    }
+    if (deque->m_tail == deque->m_capacity)
+    {
+        size_t capacity = deque->m_capacity ? 2 * deque->m_capacity : 64;
+        char** temp = realloc(deque->m_items, capacity * sizeof(char*));
+        if (temp == NULL)
+        {
+            pthread_mutex_unlock(&deque->m_lock);
+            return -1;
+        }
+        deque->m_items = temp;
+        deque->m_capacity = capacity;
+    }
+    deque->m_items[deque->m_tail++] = path;
+    pthread_mutex_unlock(&deque->m_lock);
+    return 0;
+}
+
+static char* _pop(WorkDeque* deque)
+{
+    char* path = NULL;
+    pthread_mutex_lock(&deque->m_lock);
+    if (deque->m_tail > deque->m_head)
+    {
+        path = deque->m_items[--deque->m_tail];
+    }
+    pthread_mutex_unlock(&deque->m_lock);
+    return path;
+}
+
+static char* _steal(WorkDeque* deque)
+{
+    char* path = NULL;
+    if (pthread_mutex_trylock(&deque->m_lock) != 0)
+    {
+        return NULL;
+    }
+    if (deque->m_tail > deque->m_head)
+    {
+        path = deque->m_items[deque->m_head++];
+    }
+    pthread_mutex_unlock(&deque->m_lock);
+    return path;
+}
+
+static void _queue_dir(Worker* worker, char* path)
+{
+    atomic_fetch_add(&pending_dirs, 1);
+    if (_push(&worker->m_deque, path) != 0)
+    {
+        fprintf(stderr, "failed to queue %s\n", path);
+        free(path);
+        atomic_fetch_sub(&pending_dirs, 1);
+    }
+}
+
+static char* _join(const char* dir, const char* name)
+{
+    size_t length = strlen(dir) + strlen(name) + 2;
+    char* path = malloc(length);
+    if (path != NULL)
+    {
+        snprintf(path, length, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+static int _carry_append(Worker* worker, size_t* carry_size, const char* data, size_t size)
+{
+    if (*carry_size + size > worker->m_carry_capacity)
+    {
+        size_t capacity = 2 * (*carry_size + size);
+        char* temp = realloc(worker->m_carry, capacity);
+        if (temp == NULL)
+        {
+            return -1;
+        }
+        worker->m_carry = temp;
+        worker->m_carry_capacity = capacity;
+    }
+    memcpy(worker->m_carry + *carry_size, data, size);
+    *carry_size += size;
+    return 0;
+}
+
+/* _scan_stream()
+ *   Count matching lines with read(), carrying a partial line between reads.
+ *   Used when a file cannot be mapped.
+ */
+static void _scan_stream(Worker* worker, int fd, TrigramSet* set)
+{
+    size_t carry_size = 0;
+    ssize_t bytes;
+    while ((bytes = read(fd, worker->m_read_buffer, READ_SIZE)) > 0)
+    {
+        const char* data = worker->m_read_buffer;
+        const char* end = data + bytes;
+        if (set != NULL)
+        {
+            trigram_set_add(set, data, bytes);
+        }
+
+        if (carry_size > 0)
+        {
+            // complete the line left over from the previous read
+            const char* newline = memchr(data, '\n', bytes);
+            const char* line_end = newline ? newline + 1 : end;
+            if (_carry_append(worker, &carry_size, data, line_end - data) != 0)
+            {
+                break;
+            }
+            data = line_end;
+            if (newline == NULL)
+            {
+                continue;
+            }
+            worker->m_lines += search_count_lines(worker->m_carry, carry_size);
+            carry_size = 0;
+        }
+
+        const char* last_newline = data < end ? memrchr(data, '\n', end - data) : NULL;
+        if (last_newline != NULL)
+        {
+            worker->m_lines += search_count_lines(data, last_newline + 1 - data);
+            data = last_newline + 1;
+        }
+        if (data < end && _carry_append(worker, &carry_size, data, end - data) != 0)
+        {
+            break;
+        }
+    }
+    if (carry_size > 0)
+    {
+        worker->m_lines += search_count_lines(worker->m_carry, carry_size);
+    }
+}
+
+static void _scan_buffer(Worker* worker, const char* data, size_t size, TrigramSet* set)
+{
+    if (set != NULL)
+    {
+        trigram_set_add(set, data, size);
+    }
+    worker->m_lines += search_count_lines(data, size);
+}
+
+/* _scan_fd()
+ *   Count matching lines in one open file. Small files are read in one call,
+ *   larger ones are mapped so the search kernel runs over the page cache.
+ *   When set is given the file's trigrams are collected in the same pass.
+ */
+static void _scan_fd(Worker* worker, int fd, const struct stat* st, TrigramSet* set)
+{
+    if (st->st_size <= READ_SIZE)
+    {
+        ssize_t bytes = read(fd, worker->m_read_buffer, READ_SIZE);
+        if (bytes >= 0 && bytes < READ_SIZE)
+        {
+            _scan_buffer(worker, worker->m_read_buffer, bytes, set);
+            return;
+        }
+        // the file grew since fstat(), so fall through to the general paths
+        lseek(fd, 0, SEEK_SET);
+    }
+
+    if (st->st_size > 0)
+    {
+        void* data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            madvise(data, st->st_size, MADV_SEQUENTIAL);
+            _scan_buffer(worker, data, st->st_size, set);
+            munmap(data, st->st_size);
+            return;
+        }
+    }
+
+    _scan_stream(worker, fd, set);
+}
+
+static int _keep_entry(Worker* worker, IndexEntry* entry)
+{
+    if (worker->m_entry_count == worker->m_entry_capacity)
+    {
+        size_t capacity = worker->m_entry_capacity ? 2 * worker->m_entry_capacity : 256;
+        IndexEntry** temp = realloc(worker->m_entries, capacity * sizeof(IndexEntry*));
+        if (temp == NULL)
+        {
+            return -1;
+        }
+        worker->m_entries = temp;
+        worker->m_entry_capacity = capacity;
+    }
+    worker->m_entries[worker->m_entry_count++] = entry;
+    return 0;
+}
+
+static void _free_entry(IndexEntry* entry)
+{
+    free(entry->m_path);
+    free(entry->m_trigrams);
+    free(entry);
+}
+
+/* _scan_indexed()
+ *   Index mode: a file whose mtime and size match its entry is only opened
+ *   if the entry holds every needle trigram. New or changed files are
+ *   scanned in full and get a fresh entry built from the same pass.
+ */
+static void _scan_indexed(Worker* worker, int dir_fd, const char* name, const char* path)
+{
+    char* full = _join(path, name);
+    if (full == NULL)
+    {
+        return;
+    }
+
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, 0) != 0)
+    {
+        free(full);
+        return;
+    }
+
+    IndexEntry* entry = (IndexEntry*)trigram_index_find(&trigram_index, full);
+    if (entry != NULL && entry->m_mtime_sec == st.st_mtim.tv_sec &&
+        entry->m_mtime_nsec == st.st_mtim.tv_nsec && entry->m_size == (uint64_t)st.st_size)
+    {
+        free(full);
+        _keep_entry(worker, entry);
+        if (!trigram_entry_may_match(entry, needle_trigrams, needle_trigram_count))
+        {
+            return;
+        }
+        int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+        if (fd != -1)
+        {
+            _scan_fd(worker, fd, &st, NULL);
+            close(fd);
+        }
+        return;
+    }
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    entry = calloc(1, sizeof(IndexEntry));
+    if (fd == -1 || entry == NULL)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        free(entry);
+        free(full);
+        return;
+    }
+    _scan_fd(worker, fd, &st, &worker->m_trigrams);
+    close(fd);
+
+    entry->m_path = full;
+    entry->m_mtime_sec = st.st_mtim.tv_sec;
+    entry->m_mtime_nsec = st.st_mtim.tv_nsec;
+    entry->m_size = st.st_size;
+    entry->m_owned = 1;
+    if (trigram_set_entry(&worker->m_trigrams, entry) != 0 || _keep_entry(worker, entry) != 0)
+    {
+        _free_entry(entry);
+        return;
+    }
+    worker->m_changed++;
+}
+
+static void _scan_file(Worker* worker, int dir_fd, const char* name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        _scan_fd(worker, fd, &st, NULL);
+    }
+    close(fd);
+}
+
+/* _scan_dir()
+ *   Read one directory with getdents64, scanning files in place and queueing
+ *   subdirectories for this or other workers
+ */
+static void _scan_dir(Worker* worker, const char* path)
+{
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        perror(path);
+        return;
+    }
+
+    char buffer[DIRENT_BUFFER_SIZE];
+    long bytes;
+    while ((bytes = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (long offset = 0; offset < bytes;)
+        {
+            struct linux_dirent64* entry = (struct linux_dirent64*)(buffer + offset);
+            offset += entry->d_reclen;
+
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            {
+                continue;
+            }
+
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                {
+                    continue;
+                }
+                type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+            }
+
+            if (type == DT_REG)
+            {
+                worker->m_files++;
+                if (index_path != NULL)
+                {
+                    _scan_indexed(worker, dir_fd, name, path);
+                }
+                else
+                {
+                    _scan_file(worker, dir_fd, name);
+                }
+            }
+            else if (type == DT_DIR)
+            {
+                char* child = _join(path, name);
+                if (child != NULL)
+                {
+                    _queue_dir(worker, child);
+                }
+            }
+        }
+    }
+    close(dir_fd);
+}
+
+static void* _worker_main(void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    unsigned int seed = worker->m_index + 1;
+
+    while (1)
+    {
+        char* path = _pop(&worker->m_deque);
+        for (int attempt = 0; path == NULL && attempt < num_workers; attempt++)
+        {
+            int victim = rand_r(&seed) % num_workers;
+            if (victim != worker->m_index)
+            {
+                path = _steal(&workers[victim].m_deque);
+            }
+        }
+
+        if (path != NULL)
+        {
+            _scan_dir(worker, path);
+            free(path);
+            atomic_fetch_sub(&pending_dirs, 1);
+        }
+        else if (atomic_load(&pending_dirs) == 0)
+        {
+            break;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/* _write_index()
+ *   Gather every worker's entries and rewrite the index if any file was new,
+ *   changed or removed since it was loaded
+ */
+static int _write_index(void)
+{
+    size_t total = 0;
+    size_t changed = 0;
+    for (int i = 0; i < num_workers; i++)
+    {
+        total += workers[i].m_entry_count;
+        changed += workers[i].m_changed;
+    }
+    if (changed == 0 && total == trigram_index.m_count)
+    {
+        return 0;
+    }
+
+    IndexEntry** entries = malloc((total ? total : 1) * sizeof(IndexEntry*));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+    size_t count = 0;
+    for (int i = 0; i < num_workers; i++)
+    {
+        memcpy(entries + count, workers[i].m_entries, workers[i].m_entry_count * sizeof(IndexEntry*));
+        count += workers[i].m_entry_count;
+    }
+    int status = trigram_index_write(index_path, entries, count);
+    free(entries);
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2 && strcmp(argv[1], "-i") == 0)
+    {
+        index_path = argv[2];
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc < 2 || argv[1][0] == '\0')
+    {
+        printf("must specify filepath arg\n");
+        return 1;
+    }
+    if (argc < 3 || argv[2][0] == '\0')
+    {
+        printf("must specify search string arg\n");
+        return 1;
+    }
+
+    const char* filesdir = argv[1];
+    search_init(argv[2], strlen(argv[2]));
+
+    struct stat st;
+    if (stat(filesdir, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("invalid filepath arg\n");
+        return 1;
+    }
+
+    if (index_path != NULL &&
+        (trigram_index_load(&trigram_index, index_path) != 0 ||
+         trigram_needle(argv[2], strlen(argv[2]), &needle_trigrams, &needle_trigram_count) != 0))
+    {
+        perror("trigram index");
+        return 1;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_workers = cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        workers[i].m_index = i;
+        pthread_mutex_init(&workers[i].m_deque.m_lock, NULL);
+        workers[i].m_read_buffer = malloc(READ_SIZE);
+        if (workers[i].m_read_buffer == NULL ||
+            (index_path != NULL && trigram_set_init(&workers[i].m_trigrams) != 0))
+        {
+            perror("malloc()");
+            return 1;
+        }
+    }
+
+    char* root = strdup(filesdir);
+    if (root == NULL)
+    {
+        perror("strdup()");
+        return 1;
+    }
+    _queue_dir(&workers[0], root);
+
+    for (int i = 1; i < num_workers; i++)
+    {
+        if (pthread_create(&workers[i].m_thread, NULL, _worker_main, &workers[i]) != 0)
+        {
+            perror("pthread_create()");
+            return 1;
+        }
+    }
+    _worker_main(&workers[0]);
+
+    size_t files = workers[0].m_files;
+    size_t lines = workers[0].m_lines;
+    for (int i = 1; i < num_workers; i++)
+    {
+        pthread_join(workers[i].m_thread, NULL);
+        files += workers[i].m_files;
+        lines += workers[i].m_lines;
+    }
+
+    if (index_path != NULL && _write_index() != 0)
+    {
+        fprintf(stderr, "failed to update index %s\n", index_path);
+    }
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        for (size_t j = 0; j < workers[i].m_entry_count; j++)
+        {
+            if (workers[i].m_entries[j]->m_owned)
+            {
+                _free_entry(workers[i].m_entries[j]);
+            }
+        }
+        free(workers[i].m_entries);
+        trigram_set_free(&workers[i].m_trigrams);
+        free(workers[i].m_deque.m_items);
+        free(workers[i].m_read_buffer);
+        free(workers[i].m_carry);
+        pthread_mutex_destroy(&workers[i].m_deque.m_lock);
+    }
+    if (index_path != NULL)
+    {
+        trigram_index_free(&trigram_index);
+        free(needle_trigrams);
+    }
+
+    printf("The number of files are %zu and the number of matching lines are %zu\n", files, lines);
+    return 0;
+}
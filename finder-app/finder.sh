@@ -24,6 +24,12 @@ if ! [ -d $FILESDIR ]; then
     exit 1
 fi
 
+# prefer the native finder, which walks the tree once instead of twice
+FINDER_BIN="$(dirname "$0")/finder"
+if [ -x "$FINDER_BIN" ]; then
+    exec "$FINDER_BIN" "$FILESDIR" "$SEARCHSTR"
+fi
+
 FILE_COUNT=$(find $FILESDIR -type f | wc -l)
 WORD_COUNT=$(grep -rn $SEARCHSTR $FILESDIR | wc -l)
 
@@ -131,6 +131,7 @@ make -C "${FINDER_APP_DIR}" CROSS_COMPILE=${CROSS_COMPILE} all
 # Copy the finder related scripts and executables to the /home directory
 # on the target rootfs
 cp "${FINDER_APP_DIR}/writer" "${OUTDIR}/rootfs/home/"
+cp "${FINDER_APP_DIR}/finder" "${OUTDIR}/rootfs/home/"
 cp "${FINDER_APP_DIR}/finder.sh" "${OUTDIR}/rootfs/home/"
 cp "${FINDER_APP_DIR}/finder-test.sh" "${OUTDIR}/rootfs/home/"
 mkdir -p ${OUTDIR}/rootfs/home/conf/
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include "search.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86 1
+#endif
+
+// pattern behind the process-wide search_init() interface
+static SearchPattern global_pattern;
+
+static const char* _find_scalar(const SearchPattern* pattern, const char* data, size_t size)
+{
+    return memmem(data, size, pattern->m_needle, pattern->m_len);
+}
+
+#ifdef SEARCH_X86
+/*
+ * Compare the first and last needle bytes against 16 or 32 candidate
+ * positions at once and only verify positions where both match.
+ */
+__attribute__((target("sse2")))
+static const char* _find_sse2(const SearchPattern* pattern, const char* data, size_t size)
+{
+    const char* needle = pattern->m_needle;
+    size_t needle_len = pattern->m_len;
+    if (size < needle_len)
+    {
+        return NULL;
+    }
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+
+    size_t i = 0;
+    for (; i + needle_len - 1 + 16 <= size; i += 16)
+    {
+        __m128i block_first = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i*)(data + i + needle_len - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                        _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(data + i + bit, needle, needle_len) == 0)
+            {
+                return data + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return _find_scalar(pattern, data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static const char* _find_avx2(const SearchPattern* pattern, const char* data, size_t size)
+{
+    const char* needle = pattern->m_needle;
+    size_t needle_len = pattern->m_len;
+    if (size < needle_len)
+    {
+        return NULL;
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+
+    size_t i = 0;
+    for (; i + needle_len - 1 + 32 <= size; i += 32)
+    {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(data + i + needle_len - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                              _mm256_cmpeq_epi8(block_last, last)));
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(data + i + bit, needle, needle_len) == 0)
+            {
+                return data + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return _find_sse2(pattern, data + i, size - i);
+}
+#endif
+
+/* search_compile()
+ *   Prepare a pattern for search_pattern_find(); the needle is not copied
+ *   and must outlive the pattern
+ */
+void search_compile(SearchPattern* pattern, const char* needle, size_t needle_len)
+{
+    pattern->m_needle = needle;
+    pattern->m_len = needle_len;
+    pattern->m_find = _find_scalar;
+
+#ifdef SEARCH_X86
+    // a single byte needle is already a vectorised memchr in the scalar path
+    if (needle_len > 1)
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            pattern->m_find = _find_avx2;
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            pattern->m_find = _find_sse2;
+        }
+    }
+#endif
+}
+
+const char* search_pattern_find(const SearchPattern* pattern, const char* data, size_t size)
+{
+    return pattern->m_find(pattern, data, size);
+}
+
+void search_init(const char* needle, size_t needle_len)
+{
+    search_compile(&global_pattern, needle, needle_len);
+}
+
+const char* search_find(const char* data, size_t size)
+{
+    return search_pattern_find(&global_pattern, data, size);
+}
+/* search_count_lines()
+ *   Count the lines in [data, data + size) containing the needle. Lines are
+ *   never walked one by one: each match jumps straight to the end of its line,
+ *   so non-matching lines are only touched by the search kernel.
+ */
+size_t search_count_lines(const char* data, size_t size)
+{
+    size_t count = 0;
+    const char* end = data + size;
+    while (data < end)
+    {
+        const char* match = search_find(data, end - data);
+        if (match == NULL)
+        {
+            break;
+        }
+        count++;
+        const char* newline = memchr(match, '\n', end - match);
+        data = newline ? newline + 1 : end;
+    }
+    return count;
+}
@@ -0,0 +1,25 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+/*
+ * Substring search used by finder and aesdsocket. search_compile() picks the
+ * widest kernel the CPU supports (AVX2, SSE2, or a scalar fallback); a
+ * compiled pattern is read-only, so threads can share it. search_init() sets
+ * the single process-wide pattern the other search_ functions use.
+ */
+typedef struct SearchPattern {
+    const char* m_needle;
+    size_t m_len;
+    const char* (*m_find)(const struct SearchPattern* pattern, const char* data, size_t size);
+} SearchPattern;
+
+void search_compile(SearchPattern* pattern, const char* needle, size_t needle_len);
+const char* search_pattern_find(const SearchPattern* pattern, const char* data, size_t size);
+
+void search_init(const char* needle, size_t needle_len);
+const char* search_find(const char* data, size_t size);
+size_t search_count_lines(const char* data, size_t size);
+
+#endif // SEARCH_H
@@ -0,0 +1,427 @@
+#include "trigram_index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+    Index file layout, native endian, every field 8 byte aligned:
+        magic[8]
+        uint64 entry count
+        per entry:
+            uint32 path length including NUL, uint32 trigram count,
+            int64 mtime sec, int64 mtime nsec, uint64 size,
+            path padded to 8 bytes,
+            uint32 trigrams[count] padded to 8 bytes (none for TRIGRAM_ALL)
+*/
+
+#define INDEX_MAGIC "FNDRIDX1"
+#define TRIGRAM_SPACE (1u << 24)
+
+typedef struct RecordHeader {
+    uint32_t m_path_len;
+    uint32_t m_count;
+    int64_t m_mtime_sec;
+    int64_t m_mtime_nsec;
+    uint64_t m_size;
+} RecordHeader;
+
+static size_t _pad(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+static uint64_t _hash(const char* path)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (; *path; path++)
+    {
+        hash = (hash ^ (unsigned char)*path) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static size_t _trigram_bytes(uint32_t count)
+{
+    return count == TRIGRAM_ALL ? 0 : _pad(count * sizeof(uint32_t));
+}
+
+/* _parse()
+ *   Point entries into the loaded buffer. A truncated or foreign file is
+ *   treated as an empty index, which simply causes a full rescan.
+ */
+static int _parse(TrigramIndex* index, size_t size)
+{
+    if (size < 16 || memcmp(index->m_buffer, INDEX_MAGIC, 8) != 0)
+    {
+        return -1;
+    }
+    uint64_t count;
+    memcpy(&count, index->m_buffer + 8, sizeof(count));
+    if (count > size / sizeof(RecordHeader))
+    {
+        return -1;
+    }
+
+    index->m_entries = calloc(count ? count : 1, sizeof(IndexEntry));
+    if (index->m_entries == NULL)
+    {
+        return -1;
+    }
+
+    size_t offset = 16;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (offset + sizeof(RecordHeader) > size)
+        {
+            return -1;
+        }
+        RecordHeader* header = (RecordHeader*)(index->m_buffer + offset);
+        offset += sizeof(RecordHeader);
+        // lengths come from disk; compare them with what is left before
+        // padding or multiplying, which could wrap a 32-bit size_t
+        size_t remaining = size - offset;
+        if (header->m_path_len == 0 || header->m_path_len > remaining || _pad(header->m_path_len) > remaining)
+        {
+            return -1;
+        }
+        size_t path_bytes = _pad(header->m_path_len);
+        if (header->m_count != TRIGRAM_ALL && header->m_count > (remaining - path_bytes) / sizeof(uint32_t))
+        {
+            return -1;
+        }
+        size_t trigram_bytes = _trigram_bytes(header->m_count);
+        if (path_bytes + trigram_bytes > remaining || index->m_buffer[offset + header->m_path_len - 1] != '\0')
+        {
+            return -1;
+        }
+
+        IndexEntry* entry = &index->m_entries[i];
+        entry->m_path = index->m_buffer + offset;
+        entry->m_mtime_sec = header->m_mtime_sec;
+        entry->m_mtime_nsec = header->m_mtime_nsec;
+        entry->m_size = header->m_size;
+        entry->m_count = header->m_count;
+        entry->m_trigrams = (uint32_t*)(index->m_buffer + offset + path_bytes);
+        entry->m_owned = 0;
+        offset += path_bytes + trigram_bytes;
+    }
+    index->m_count = count;
+    return 0;
+}
+
+static int _build_table(TrigramIndex* index)
+{
+    index->m_table_size = 16;
+    while (index->m_table_size < 2 * index->m_count)
+    {
+        index->m_table_size *= 2;
+    }
+    index->m_table = malloc(index->m_table_size * sizeof(size_t));
+    if (index->m_table == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < index->m_table_size; i++)
+    {
+        index->m_table[i] = SIZE_MAX;
+    }
+    for (size_t i = 0; i < index->m_count; i++)
+    {
+        size_t slot = _hash(index->m_entries[i].m_path) & (index->m_table_size - 1);
+        while (index->m_table[slot] != SIZE_MAX)
+        {
+            slot = (slot + 1) & (index->m_table_size - 1);
+        }
+        index->m_table[slot] = i;
+    }
+    return 0;
+}
+
+/* trigram_index_load()
+ *   Load an index written by trigram_index_write(). A missing or unreadable
+ *   index loads as empty.
+ * out: 0 success, -1 error
+ */
+int trigram_index_load(TrigramIndex* index, const char* path)
+{
+    memset(index, 0, sizeof(TrigramIndex));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        index->m_buffer = malloc(st.st_size);
+        size_t loaded = 0;
+        while (index->m_buffer != NULL && loaded < (size_t)st.st_size)
+        {
+            ssize_t bytes = read(fd, index->m_buffer + loaded, st.st_size - loaded);
+            if (bytes <= 0)
+            {
+                break;
+            }
+            loaded += bytes;
+        }
+        if (index->m_buffer == NULL || loaded != (size_t)st.st_size || _parse(index, loaded) != 0)
+        {
+            fprintf(stderr, "ignoring unreadable index %s\n", path);
+            free(index->m_entries);
+            index->m_entries = NULL;
+            index->m_count = 0;
+        }
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    return _build_table(index);
+}
+
+const IndexEntry* trigram_index_find(const TrigramIndex* index, const char* path)
+{
+    size_t slot = _hash(path) & (index->m_table_size - 1);
+    while (index->m_table[slot] != SIZE_MAX)
+    {
+        const IndexEntry* entry = &index->m_entries[index->m_table[slot]];
+        if (strcmp(entry->m_path, path) == 0)
+        {
+            return entry;
+        }
+        slot = (slot + 1) & (index->m_table_size - 1);
+    }
+    return NULL;
+}
+
+static int _write_all(FILE* file, const void* data, size_t size)
+{
+    static const char zeros[8];
+    size_t padded = _pad(size);
+    if (fwrite(data, 1, size, file) != size || fwrite(zeros, 1, padded - size, file) != padded - size)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* trigram_index_write()
+ *   Atomically replace the index at path with entries
+ * out: 0 success, -1 error
+ */
+int trigram_index_write(const char* path, IndexEntry** entries, size_t count)
+{
+    size_t length = strlen(path) + 5;
+    char temp_path[length];
+    snprintf(temp_path, length, "%s.tmp", path);
+
+    FILE* file = fopen(temp_path, "w");
+    if (file == NULL)
+    {
+        perror(temp_path);
+        return -1;
+    }
+
+    uint64_t total = count;
+    int status = fwrite(INDEX_MAGIC, 1, 8, file) == 8 && fwrite(&total, sizeof(total), 1, file) == 1 ? 0 : -1;
+    for (size_t i = 0; i < count && status == 0; i++)
+    {
+        const IndexEntry* entry = entries[i];
+        RecordHeader header;
+        header.m_path_len = strlen(entry->m_path) + 1;
+        header.m_count = entry->m_count;
+        header.m_mtime_sec = entry->m_mtime_sec;
+        header.m_mtime_nsec = entry->m_mtime_nsec;
+        header.m_size = entry->m_size;
+        if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+            _write_all(file, entry->m_path, header.m_path_len) != 0 ||
+            (entry->m_count != TRIGRAM_ALL &&
+             _write_all(file, entry->m_trigrams, entry->m_count * sizeof(uint32_t)) != 0))
+        {
+            status = -1;
+        }
+    }
+
+    if (fclose(file) != 0 || status != 0)
+    {
+        perror(temp_path);
+        unlink(temp_path);
+        return -1;
+    }
+    if (rename(temp_path, path) != 0)
+    {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+void trigram_index_free(TrigramIndex* index)
+{
+    free(index->m_buffer);
+    free(index->m_entries);
+    free(index->m_table);
+    memset(index, 0, sizeof(TrigramIndex));
+}
+
+static int _compare(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* trigram_needle()
+ *   Distinct trigrams of the search string, sorted. Needles shorter than
+ *   three bytes have none, so every file is a candidate.
+ * out: 0 success, -1 error
+ */
+int trigram_needle(const char* needle, size_t needle_len, uint32_t** trigrams, size_t* count)
+{
+    *count = 0;
+    *trigrams = malloc((needle_len > 2 ? needle_len - 2 : 1) * sizeof(uint32_t));
+    if (*trigrams == NULL)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i + 2 < needle_len; i++)
+    {
+        (*trigrams)[(*count)++] = ((uint32_t)(unsigned char)needle[i] << 16) |
+                                  ((uint32_t)(unsigned char)needle[i + 1] << 8) |
+                                  (unsigned char)needle[i + 2];
+    }
+    qsort(*trigrams, *count, sizeof(uint32_t), _compare);
+    size_t unique = 0;
+    for (size_t i = 0; i < *count; i++)
+    {
+        if (unique == 0 || (*trigrams)[unique - 1] != (*trigrams)[i])
+        {
+            (*trigrams)[unique++] = (*trigrams)[i];
+        }
+    }
+    *count = unique;
+    return 0;
+}
+
+/* trigram_entry_may_match()
+ *   Merge the sorted needle trigrams against the file's sorted set
+ * out: 1 if the file contains every needle trigram, 0 if it cannot match
+ */
+int trigram_entry_may_match(const IndexEntry* entry, const uint32_t* trigrams, size_t count)
+{
+    if (entry->m_count == TRIGRAM_ALL)
+    {
+        return 1;
+    }
+    size_t j = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        while (j < entry->m_count && entry->m_trigrams[j] < trigrams[i])
+        {
+            j++;
+        }
+        if (j == entry->m_count || entry->m_trigrams[j] != trigrams[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int trigram_set_init(TrigramSet* set)
+{
+    memset(set, 0, sizeof(TrigramSet));
+    set->m_bits = calloc(TRIGRAM_SPACE / 8, 1);
+    if (set->m_bits == NULL)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* trigram_set_add()
+ *   Add the trigrams of the next bytes of the current file. Trigrams that
+ *   span two calls are included.
+ */
+void trigram_set_add(TrigramSet* set, const char* data, size_t size)
+{
+    for (size_t i = 0; i < size && !set->m_overflow; i++)
+    {
+        set->m_window = ((set->m_window << 8) | (unsigned char)data[i]) & (TRIGRAM_SPACE - 1);
+        if (set->m_window_size < 2)
+        {
+            set->m_window_size++;
+            continue;
+        }
+
+        uint32_t trigram = set->m_window;
+        uint8_t mask = (uint8_t)(1u << (trigram & 7));
+        if (set->m_bits[trigram >> 3] & mask)
+        {
+            continue;
+        }
+        if (set->m_count == TRIGRAM_LIMIT)
+        {
+            set->m_overflow = 1;
+            break;
+        }
+        if (set->m_count == set->m_capacity)
+        {
+            size_t capacity = set->m_capacity ? 2 * set->m_capacity : 1024;
+            uint32_t* temp = realloc(set->m_list, capacity * sizeof(uint32_t));
+            if (temp == NULL)
+            {
+                set->m_overflow = 1;
+                break;
+            }
+            set->m_list = temp;
+            set->m_capacity = capacity;
+        }
+        set->m_bits[trigram >> 3] |= mask;
+        set->m_list[set->m_count++] = trigram;
+    }
+}
+
+/* trigram_set_entry()
+ *   Move the collected trigrams into entry and reset the set for the next
+ *   file
+ * out: 0 success, -1 error
+ */
+int trigram_set_entry(TrigramSet* set, IndexEntry* entry)
+{
+    int status = 0;
+    entry->m_trigrams = NULL;
+    entry->m_count = TRIGRAM_ALL;
+    if (!set->m_overflow)
+    {
+        entry->m_trigrams = malloc((set->m_count ? set->m_count : 1) * sizeof(uint32_t));
+        if (entry->m_trigrams != NULL)
+        {
+            memcpy(entry->m_trigrams, set->m_list, set->m_count * sizeof(uint32_t));
+            qsort(entry->m_trigrams, set->m_count, sizeof(uint32_t), _compare);
+            entry->m_count = set->m_count;
+        }
+        else
+        {
+            status = -1;
+        }
+    }
+
+    for (size_t i = 0; i < set->m_count; i++)
+    {
+        set->m_bits[set->m_list[i] >> 3] = 0;
+    }
+    set->m_count = 0;
+    set->m_overflow = 0;
+    set->m_window = 0;
+    set->m_window_size = 0;
+    return status;
+}
+
+void trigram_set_free(TrigramSet* set)
+{
+    free(set->m_bits);
+    free(set->m_list);
+    memset(set, 0, sizeof(TrigramSet));
+}
@@ -0,0 +1,62 @@
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// files with more distinct trigrams than this are always searched
+#define TRIGRAM_LIMIT (64 * 1024)
+
+// m_count value for files that are always searched
+#define TRIGRAM_ALL UINT32_MAX
+
+/*
+ * What the index remembers about one file: enough to tell whether it changed
+ * (mtime and size) and the sorted set of byte trigrams it contains.
+ */
+typedef struct IndexEntry {
+    char* m_path;
+    int64_t m_mtime_sec;
+    int64_t m_mtime_nsec;
+    uint64_t m_size;
+    uint32_t m_count;
+    uint32_t* m_trigrams;
+    int m_owned;
+} IndexEntry;
+
+typedef struct TrigramIndex {
+    char* m_buffer;
+    IndexEntry* m_entries;
+    size_t m_count;
+    size_t* m_table;
+    size_t m_table_size;
+} TrigramIndex;
+
+/*
+ * Distinct trigrams seen while scanning one file, collected in a 2^24 bit
+ * bitmap so duplicates cost nothing.
+ */
+typedef struct TrigramSet {
+    uint8_t* m_bits;
+    uint32_t* m_list;
+    size_t m_count;
+    size_t m_capacity;
+    int m_overflow;
+    uint32_t m_window;
+    int m_window_size;
+} TrigramSet;
+
+int trigram_index_load(TrigramIndex* index, const char* path);
+const IndexEntry* trigram_index_find(const TrigramIndex* index, const char* path);
+int trigram_index_write(const char* path, IndexEntry** entries, size_t count);
+void trigram_index_free(TrigramIndex* index);
+
+int trigram_needle(const char* needle, size_t needle_len, uint32_t** trigrams, size_t* count);
+int trigram_entry_may_match(const IndexEntry* entry, const uint32_t* trigrams, size_t count);
+
+int trigram_set_init(TrigramSet* set);
+void trigram_set_add(TrigramSet* set, const char* data, size_t size);
+int trigram_set_entry(TrigramSet* set, IndexEntry* entry);
+void trigram_set_free(TrigramSet* set);
+
+#endif // TRIGRAM_INDEX_H
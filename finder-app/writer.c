@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -10,14 +16,556 @@
     input:
         1: writefile: relative path to a file (including filename)
         2: writestr: text string which will be written within this file
-    
+
+    bulk input:
+        -b [-e] [manifest]: read records from manifest, or stdin if omitted
+                            or "-"; -e decodes \n, \t and \\ in payloads
+
+    copy input:
+        -c source dest: copy source into dest, sharing extents where the
+                        filesystem allows
+
     output:
         1 = success    
         -1 = error
 */
+
+#define INPUT_BUFFER_SIZE (1024 * 1024)
+#define ARENA_SIZE (1024 * 1024)
+#define IOV_BATCH 64
+#define DIR_CACHE_SIZE 16
+#define COPY_CHUNK_SIZE (64 * 1024 * 1024)
+#define PREALLOCATE_MIN (64 * 1024)
+#define PATH_SET_MIN 64
+
+/*
+ * Directories of recent records, kept open so each file is created with
+ * openat() relative to its directory instead of a full path lookup.
+ */
+typedef struct DirCache {
+    char* m_paths[DIR_CACHE_SIZE];
+    int m_fds[DIR_CACHE_SIZE];
+    int m_next;
+} DirCache;
+
+/*
+ * Open-addressing hash set of the paths a manifest has written so far, so a
+ * path that comes back after other records is appended to rather than
+ * truncated again
+ */
+typedef struct PathSet {
+    char** m_slots;
+    size_t m_capacity;
+    size_t m_count;
+} PathSet;
+
+/*
+ * The file currently being written. Payloads of consecutive records for the
+ * same path are staged in the arena and flushed with one writev().
+ */
+typedef struct Output {
+    PathSet m_written;
+    char* m_path;
+    int m_fd;
+    struct iovec m_iov[IOV_BATCH];
+    int m_iovcnt;
+    char* m_arena;
+    size_t m_arena_used;
+    int m_failed;
+} Output;
+
+static int _dir_fd(DirCache* cache, const char* dir)
+{
+    for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        if (cache->m_paths[i] != NULL && strcmp(cache->m_paths[i], dir) == 0)
+        {
+            return cache->m_fds[i];
+        }
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    char* copy = strdup(dir);
+    if (copy == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+
+    int slot = cache->m_next;
+    cache->m_next = (cache->m_next + 1) % DIR_CACHE_SIZE;
+    if (cache->m_paths[slot] != NULL)
+    {
+        free(cache->m_paths[slot]);
+        close(cache->m_fds[slot]);
+    }
+    cache->m_paths[slot] = copy;
+    cache->m_fds[slot] = fd;
+    return fd;
+}
+
+static void _dir_cache_close(DirCache* cache)
+{
+    for (int i = 0; i < DIR_CACHE_SIZE; i++)
+    {
+        if (cache->m_paths[i] != NULL)
+        {
+            free(cache->m_paths[i]);
+            close(cache->m_fds[i]);
+        }
+    }
+}
+
+static size_t _path_hash(const char* path)
+{
+    size_t hash = 2166136261u;
+    for (; *path != '\0'; path++)
+    {
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    }
+    return hash;
+}
+
+static char** _path_slot(char** slots, size_t capacity, const char* path)
+{
+    size_t i = _path_hash(path) & (capacity - 1);
+    while (slots[i] != NULL && strcmp(slots[i], path) != 0)
+    {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &slots[i];
+}
+
+/* _path_set_add()
+ *   Remember path, growing the set to keep it at most half full
+ * out: 1 added, 0 already present, -1 allocation failed
+ */
+static int _path_set_add(PathSet* set, const char* path)
+{
+    if (set->m_capacity > 0 && *_path_slot(set->m_slots, set->m_capacity, path) != NULL)
+    {
+        return 0;
+    }
+    if ((set->m_count + 1) * 2 > set->m_capacity)
+    {
+        size_t capacity = set->m_capacity ? set->m_capacity * 2 : PATH_SET_MIN;
+        char** slots = calloc(capacity, sizeof(char*));
+        if (slots == NULL)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < set->m_capacity; i++)
+        {
+            if (set->m_slots[i] != NULL)
+            {
+                *_path_slot(slots, capacity, set->m_slots[i]) = set->m_slots[i];
+            }
+        }
+        free(set->m_slots);
+        set->m_slots = slots;
+        set->m_capacity = capacity;
+    }
+    char* copy = strdup(path);
+    if (copy == NULL)
+    {
+        return -1;
+    }
+    *_path_slot(set->m_slots, set->m_capacity, path) = copy;
+    set->m_count++;
+    return 1;
+}
+
+static void _path_set_free(PathSet* set)
+{
+    for (size_t i = 0; i < set->m_capacity; i++)
+    {
+        free(set->m_slots[i]);
+    }
+    free(set->m_slots);
+}
+
+/* _open_file()
+ *   Open path relative to its cached directory fd, creating it
+ * in: mode: O_TRUNC to start the file over, O_APPEND to add to it
+ * out: file descriptor, -1 on error
+ */
+static int _open_file(DirCache* cache, char* path, int mode)
+{
+    char* slash = strrchr(path, '/');
+    if (slash == NULL)
+    {
+        return open(path, O_WRONLY | mode | O_CREAT | O_CLOEXEC, 0644);
+    }
+
+    *slash = '\0';
+    int dir_fd = _dir_fd(cache, slash == path ? "/" : path);
+    *slash = '/';
+    if (dir_fd == -1)
+    {
+        return -1;
+    }
+    return openat(dir_fd, slash + 1, O_WRONLY | mode | O_CREAT | O_CLOEXEC, 0644);
+}
+
+/* _writev_all()
+ *   writev() until every byte is written, advancing past partial writes
+ * out: 0 success, -1 error
+ */
+static int _writev_all(int fd, struct iovec* iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t bytes = writev(fd, iov, iovcnt);
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)bytes >= iov->iov_len)
+        {
+            bytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+    return 0;
+}
+
+/* _preallocate()
+ *   Reserve size bytes at the current offset so large files are laid out in
+ *   one go. The file size only grows as data is written, so a failed or
+ *   short write never leaves a tail of zeros. Filesystems without
+ *   fallocate() support are not an error.
+ */
+static void _preallocate(int fd, off_t size)
+{
+    if (size < PREALLOCATE_MIN)
+    {
+        return;
+    }
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset != -1 && fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size) != 0 && errno != EOPNOTSUPP)
+    {
+        syslog(LOG_DEBUG, "fallocate() failed with error %d\n", errno);
+    }
+}
+
+static int _write_all(int fd, const char* data, size_t size)
+{
+    struct iovec iov = { (void*)data, size };
+    return _writev_all(fd, &iov, 1);
+}
+
+/* _copy_stream()
+ *   Plain read()/write() copy, used when the kernel cannot copy in place
+ * out: 0 success, -1 error
+ */
+static int _copy_stream(int in_fd, int out_fd)
+{
+    char* buffer = malloc(INPUT_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    int status = 0;
+    ssize_t bytes;
+    while ((bytes = read(in_fd, buffer, INPUT_BUFFER_SIZE)) != 0)
+    {
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            status = -1;
+            break;
+        }
+        if (_write_all(out_fd, buffer, bytes) != 0)
+        {
+            status = -1;
+            break;
+        }
+    }
+    free(buffer);
+    return status;
+}
+
+/* _copy()
+ *   Copy source to dest, cheapest first: a reflink shares the source's
+ *   extents, copy_file_range() keeps the data in the kernel, and a buffered
+ *   read()/write() loop handles pipes and cross-filesystem copies.
+ * out: 0 success, 1 error
+ */
+static int _copy(const char* source, const char* dest)
+{
+    int in_fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (in_fd == -1)
+    {
+        syslog(LOG_ERR, "failed to open file %s with error %d\n", source, errno);
+        return 1;
+    }
+    int out_fd = open(dest, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0644);
+    if (out_fd == -1)
+    {
+        syslog(LOG_ERR, "failed to open file %s with error %d\n", dest, errno);
+        close(in_fd);
+        return 1;
+    }
+
+    struct stat st;
+    int status = 0;
+    if (fstat(in_fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        status = _copy_stream(in_fd, out_fd);
+    }
+    else if (ioctl(out_fd, FICLONE, in_fd) != 0)
+    {
+        _preallocate(out_fd, st.st_size);
+        off_t copied = 0;
+        while (copied < st.st_size)
+        {
+            size_t chunk = st.st_size - copied < COPY_CHUNK_SIZE ? st.st_size - copied : COPY_CHUNK_SIZE;
+            ssize_t bytes = copy_file_range(in_fd, NULL, out_fd, NULL, chunk, 0);
+            if (bytes == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes <= 0)
+            {
+                // unsupported here, or the source shrank; finish in user space
+                status = bytes == 0 || errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                         errno == EOPNOTSUPP ? _copy_stream(in_fd, out_fd) : -1;
+                break;
+            }
+            copied += bytes;
+        }
+        if (status == 0 && copied == st.st_size)
+        {
+            // pick up anything appended since fstat()
+            status = _copy_stream(in_fd, out_fd);
+        }
+        off_t end = lseek(out_fd, 0, SEEK_CUR);
+        if (status == 0 && end != -1 && ftruncate(out_fd, end) != 0)
+        {
+            status = -1;
+        }
+    }
+
+    if (status != 0)
+    {
+        syslog(LOG_ERR, "failed to copy %s to %s with error %d\n", source, dest, errno);
+    }
+    close(in_fd);
+    if (close(out_fd) == -1)
+    {
+        syslog(LOG_ERR, "failed to close file %s\n", dest);
+        status = -1;
+    }
+    return status == 0 ? 0 : 1;
+}
+
+static void _flush(Output* output)
+{
+    if (output->m_iovcnt > 0 && output->m_fd != -1 &&
+        _writev_all(output->m_fd, output->m_iov, output->m_iovcnt) != 0)
+    {
+        syslog(LOG_ERR, "failed to write to file %s\n", output->m_path);
+        output->m_failed = 1;
+    }
+    output->m_iovcnt = 0;
+    output->m_arena_used = 0;
+}
+
+static void _finish(Output* output)
+{
+    _flush(output);
+    if (output->m_fd != -1 && close(output->m_fd) == -1)
+    {
+        syslog(LOG_ERR, "failed to close file %s\n", output->m_path);
+        output->m_failed = 1;
+    }
+    output->m_fd = -1;
+    free(output->m_path);
+    output->m_path = NULL;
+}
+
+/* _unescape()
+ *   Decode \n, \t and \\ in place so -e payloads can hold any byte but NUL
+ * out: decoded length
+ */
+static size_t _unescape(char* data, size_t size)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (data[i] == '\\' && i + 1 < size)
+        {
+            char next = data[++i];
+            data[out++] = next == 'n' ? '\n' : next == 't' ? '\t' : next;
+        }
+        else
+        {
+            data[out++] = data[i];
+        }
+    }
+    return out;
+}
+
+/* _write_record()
+ *   Stage one record. A new path finishes the previous file; a repeated
+ *   path appends, even after records for other paths, so one file can be
+ *   built from many records.
+ */
+static void _write_record(Output* output, DirCache* cache, const char* path, char* payload, size_t size)
+{
+    if (output->m_path == NULL || strcmp(output->m_path, path) != 0)
+    {
+        _finish(output);
+        output->m_path = strdup(path);
+        if (output->m_path == NULL)
+        {
+            output->m_failed = 1;
+            return;
+        }
+        int added = _path_set_add(&output->m_written, path);
+        if (added == -1)
+        {
+            output->m_failed = 1;
+            return;
+        }
+        output->m_fd = _open_file(cache, output->m_path, added ? O_TRUNC : O_APPEND);
+        if (output->m_fd == -1)
+        {
+            syslog(LOG_ERR, "failed to open file %s with error %d\n", path, errno);
+            output->m_failed = 1;
+        }
+    }
+    if (output->m_fd == -1)
+    {
+        return;
+    }
+
+    if (output->m_iovcnt == IOV_BATCH || output->m_arena_used + size > ARENA_SIZE)
+    {
+        _flush(output);
+    }
+    if (size > ARENA_SIZE)
+    {
+        _preallocate(output->m_fd, size);
+        if (_write_all(output->m_fd, payload, size) != 0)
+        {
+            syslog(LOG_ERR, "failed to write to file %s\n", path);
+            output->m_failed = 1;
+        }
+        return;
+    }
+
+    char* staged = output->m_arena + output->m_arena_used;
+    memcpy(staged, payload, size);
+    output->m_arena_used += size;
+    output->m_iov[output->m_iovcnt].iov_base = staged;
+    output->m_iov[output->m_iovcnt].iov_len = size;
+    output->m_iovcnt++;
+}
+
+/* _bulk()
+ *   Write every record of the manifest in one process. Each line is
+ *   "<path>\t<payload>"; the payload is written without the line's newline,
+ *   exactly as the two argument form would write it. With unescape set,
+ *   escapes in the payload are decoded first.
+ * out: 0 success, 1 if any record failed
+ */
+static int _bulk(const char* manifest, int unescape)
+{
+    FILE* input = stdin;
+    if (manifest != NULL && strcmp(manifest, "-") != 0)
+    {
+        input = fopen(manifest, "r");
+        if (input == NULL)
+        {
+            syslog(LOG_ERR, "failed to open manifest %s\n", manifest);
+            return 1;
+        }
+    }
+    setvbuf(input, NULL, _IOFBF, INPUT_BUFFER_SIZE);
+
+    DirCache cache;
+    memset(&cache, 0, sizeof(cache));
+    Output output;
+    memset(&output, 0, sizeof(output));
+    output.m_fd = -1;
+    output.m_arena = malloc(ARENA_SIZE);
+    if (output.m_arena == NULL)
+    {
+        syslog(LOG_ERR, "failed to allocate %d bytes\n", ARENA_SIZE);
+        return 1;
+    }
+
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    size_t records = 0;
+    while ((length = getline(&line, &capacity, input)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+        {
+            line[--length] = '\0';
+        }
+        char* tab = memchr(line, '\t', length);
+        if (tab == NULL || tab == line)
+        {
+            syslog(LOG_ERR, "malformed record %zu\n", records + 1);
+            output.m_failed = 1;
+            continue;
+        }
+        *tab = '\0';
+        char* payload = tab + 1;
+        size_t size = line + length - payload;
+        if (unescape)
+        {
+            size = _unescape(payload, size);
+        }
+        _write_record(&output, &cache, line, payload, size);
+        records++;
+    }
+
+    _finish(&output);
+    _path_set_free(&output.m_written);
+    _dir_cache_close(&cache);
+    free(output.m_arena);
+    free(line);
+    if (input != stdin)
+    {
+        fclose(input);
+    }
+    syslog(LOG_DEBUG, "wrote %zu records\n", records);
+    return output.m_failed;
+}
+
 int main(int argc, char *argv[])
 {
     openlog(NULL, 0, LOG_USER);
+    if (argc >= 2 && strcmp(argv[1], "-b") == 0)
+    {
+        int unescape = argc > 2 && strcmp(argv[2], "-e") == 0;
+        return _bulk(argc > 2 + unescape ? argv[2 + unescape] : NULL, unescape);
+    }
+    if (argc == 4 && strcmp(argv[1], "-c") == 0)
+    {
+        return _copy(argv[2], argv[3]);
+    }
     if (argc != 3)
     {
         syslog(LOG_ERR, "expected 2 arguments, got %d\n", argc);
@@ -25,7 +573,7 @@ int main(int argc, char *argv[])
     }
     const char* writefile = argv[1];
     const char* writestr = argv[2];
-    int writesize = strlen(argv[2]);
+    size_t writesize = strlen(argv[2]);
 
     syslog(LOG_DEBUG, "Writing %s to %s\n", writestr, writefile);
     
@@ -36,18 +584,12 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    int bytes = write(file_descriptor, writestr, writesize);
-    if (bytes == -1)
-    {
-        syslog(LOG_ERR, "failed to write to file %s\n", writefile);
-    }
-    else if (bytes != writesize)
-    {
-        syslog(LOG_ERR, "partial write to %s, %d/%d bytes written\n", writefile, bytes, writesize);
-    }
-    else
+    _preallocate(file_descriptor, writesize);
+    int status = 0;
+    if (_write_all(file_descriptor, writestr, writesize) != 0)
     {
-        // syslog(LOG_DEBUG, "wrote %d bytes to %s\n", bytes, writefile);
+        syslog(LOG_ERR, "failed to write to file %s with error %d\n", writefile, errno);
+        status = 1;
     }
 
     if (close(file_descriptor) == -1)
@@ -56,5 +598,5 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    return 0;
+    return status;
 }
\ No newline at end of file
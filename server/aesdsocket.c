@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -12,12 +13,81 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <poll.h>
 #include "thread_pool_dynamic.h"
+#include "lock_profile.h"
+#include "buffer_pool.h"
+#include "replay_cache.h"
+#include "block_store.h"
+#include "journal.h"
+#include "memory_history.h"
+#include "subscribers.h"
+#include "replication.h"
+#include "retention.h"
+#include "line_index.h"
+#include "history_filter.h"
+#include "async_log.h"
+#include "trace.h"
+#include "channel_path.h"
 
 #define BUFFER_SIZE 1024
 
+// packets longer than this are discarded rather than cached
+#ifndef PACKET_LIMIT
+#define PACKET_LIMIT (64 * 1024 * 1024)
+#endif
+
+// iovec entries handed to a single writev()
+#define IOV_BATCH 64
+
 #define CACHE_FILE "/var/tmp/aesdsocketdata"
 
+#define DEFAULT_PORT "9000"
+#define LISTEN_BACKLOG 16
+#define MAX_LISTENERS 2
+#define PEER_STRLEN INET6_ADDRSTRLEN
+
+// sent as the first line by clients that accept block-compressed replays
+#define ENCODING_HEADER "ENCODING:lz\n"
+
+// first byte of a length-prefixed (framed) connection; text data never contains NUL
+#define FRAME_MAGIC '\0'
+
+// replays the history and then streams every later append on the connection
+#define SUBSCRIBE_HEADER "SUBSCRIBE\n"
+
+// selects the history a connection reads and appends to
+#define CHANNEL_HEADER "CHANNEL:"
+#define CHANNEL_NAME_MAX 64
+#define CHANNEL_BUCKETS 64
+#ifndef MAX_CHANNELS
+#define MAX_CHANNELS 1024
+#endif
+
+// "TAIL:<n>\n" replays the last n lines, "LINES:<a>-<b>\n" lines a to b (from 1)
+#define TAIL_HEADER "TAIL:"
+#define LINES_HEADER "LINES:"
+#define LINES_TAIL 1
+#define LINES_RANGE 2
+
+// "FILTER:<pattern>\n" replays only the lines containing pattern
+#define FILTER_PATTERN_MAX 256
+
+// replay from wherever the retained history starts rather than a fixed offset
+#define HISTORY_RETAINED UINT64_MAX
+
+// seconds between passes releasing history that left the retention window
+#define RETENTION_INTERVAL 10
+
+// bytes queued for a subscriber before it is evicted as a slow consumer
+#ifndef SUBSCRIBER_QUEUE_LIMIT
+#define SUBSCRIBER_QUEUE_LIMIT (4 * 1024 * 1024)
+#endif
+
 void daemonize();
 
 /*
@@ -52,12 +122,70 @@ void daemonize();
     Logs message to the syslog “Caught signal, exiting” when SIGINT or SIGTERM is received.
 */
 
-volatile sig_atomic_t RUN = 1;
-static pthread_mutex_t file_lock;
+typedef struct Listeners
+{
+    int m_fds[MAX_LISTENERS];
+    int m_count;
+    // absolute, so the daemon's chdir("/") does not change what is unlinked
+    char m_unix_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+} Listeners;
+
+/*
+ * One independent history: its storage, the lock serialising its appends,
+ * its replay state and its subscribers. The default channel lives at
+ * history_path; "CHANNEL:<name>\n" selects a named one at
+ * history_path.ch-<name>, created on first use.
+ */
+typedef struct Channel
+{
+    char* m_name;
+    char* m_path;
+    ProfiledMutex m_lock;
+    ReplayCache m_replay_cache;
+    BlockStore m_block_store;
+    Journal m_journal;
+    MemoryHistory m_memory_history;
+    Retention m_retention;
+    LineIndex m_lines;
+    SubscriberHub m_subscribers;
+    struct Channel* m_next;
+} Channel;
 
-int _setup(const char *host, const char *port, int daemon)
+volatile sig_atomic_t RUN = 1;
+// wakes the periodic tasks as soon as shutdown starts
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+// set by SIGUSR1, the accept loop then dumps the trace
+static volatile sig_atomic_t dump_trace = 0;
+static Channel default_channel;
+// named channels, chained by FNV-1a hash of the name
+static Channel* channels[CHANNEL_BUCKETS];
+static size_t channel_count = 0;
+static ProfiledMutex channel_lock;
+static Follower follower;
+static int compress_history = 0;
+static int persist_history = 0;
+// set by -m <bytes>: keep only recent packets, in memory, instead of CACHE_FILE
+static size_t memory_capacity = 0;
+// set by -o <path>, so a leader and a follower can share one host
+static const char* history_path = CACHE_FILE;
+// set by -r <host:port>: copy that leader's history and serve reads only
+static const char* leader_address = NULL;
+// set by -B <bytes>, -L <lines> and -A <seconds> for the plain history file
+static RetentionPolicy retention_policy;
+static int retain_history = 0;
+// the plain history file keeps a line index for TAIL and LINES requests
+static int index_history = 0;
+
+/* _setup()
+ *   Bind and listen on a TCP address
+ * in: host, port: address to bind, host NULL for the wildcard address
+ *     family: AF_INET, or AF_INET6 for a dual-stack listener
+ * out: listening socket, -1 error
+ */
+int _setup(const char *host, const char *port, int family)
 {
-    const int capacity = 1;
+    const int capacity = LISTEN_BACKLOG;
 
     struct addrinfo hints, *res, *p;
     int sock_fd;
@@ -65,7 +193,7 @@ int _setup(const char *host, const char *port, int daemon)
 
     // Zero out the hints structure
     memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;        // AF_INET or AF_INET6 to force version
+    hints.ai_family = family;           // AF_INET or AF_INET6 to force version
     hints.ai_socktype = SOCK_STREAM;    // TCP
     hints.ai_flags = AI_PASSIVE;        // For wildcard IP address if host is NULL
 
@@ -90,6 +218,14 @@ int _setup(const char *host, const char *port, int daemon)
             continue;
         }
 
+        // accept IPv4 clients as v4-mapped addresses on the same socket
+        int no = 0;
+        if (p->ai_family == AF_INET6 && setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)) == -1) {
+            perror("setsockopt(IPV6_V6ONLY)");
+            close(sock_fd);
+            continue;
+        }
+
         if (bind(sock_fd, p->ai_addr, p->ai_addrlen) == -1) {
             perror("bind()\n");
             close(sock_fd);
@@ -104,14 +240,9 @@ int _setup(const char *host, const char *port, int daemon)
         return -1;
     }
 
-    printf("socket bound successfully on %s:%s\n", host, port);
+    printf("socket bound successfully on %s:%s\n", host ? host : "*", port);
     freeaddrinfo(res);
 
-    if (daemon)
-    {
-        daemonize();
-    }
-
     if (listen(sock_fd, capacity) == -1) {
         perror("listen()");
         close(sock_fd);
@@ -121,7 +252,89 @@ int _setup(const char *host, const char *port, int daemon)
     return sock_fd;
 }
 
-int _accept(int sock_fd, struct sockaddr_in* cliaddr, char ipstr[INET_ADDRSTRLEN])
+/* _setup_unix()
+ *   Bind and listen on a Unix domain stream socket, replacing a stale one.
+ *   A socket is stale when nothing accepts on it; a live socket or any
+ *   other file at path is left alone.
+ * in: path: socket path, relative to the working directory or absolute
+ * out: listening socket, -1 error. bound receives the absolute path.
+ */
+int _setup_unix(const char *path, char bound[sizeof(((struct sockaddr_un*)0)->sun_path)])
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int length;
+    if (path[0] == '/') {
+        length = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    } else {
+        char cwd[sizeof(addr.sun_path)];
+        if (getcwd(cwd, sizeof(cwd)) == NULL) {
+            perror("getcwd()");
+            return -1;
+        }
+        length = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", cwd, path);
+    }
+    if (length < 0 || (size_t)length >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "unix socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock_fd == -1) {
+        perror("socket()");
+        return -1;
+    }
+    struct stat existing;
+    if (lstat(addr.sun_path, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", addr.sun_path);
+            close(sock_fd);
+            return -1;
+        }
+        // another instance still listening keeps its socket
+        if (connect(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0 || errno != ECONNREFUSED) {
+            fprintf(stderr, "%s: address in use\n", addr.sun_path);
+            close(sock_fd);
+            return -1;
+        }
+        unlink(addr.sun_path);
+    }
+    if (bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("bind()");
+        close(sock_fd);
+        return -1;
+    }
+    if (listen(sock_fd, LISTEN_BACKLOG) == -1) {
+        perror("listen()");
+        close(sock_fd);
+        unlink(addr.sun_path);
+        return -1;
+    }
+    memcpy(bound, addr.sun_path, sizeof(addr.sun_path));
+    printf("socket bound successfully on %s\n", addr.sun_path);
+    return sock_fd;
+}
+
+void _close_listeners(Listeners* listeners)
+{
+    for (int i = 0; i < listeners->m_count; i++)
+    {
+        close(listeners->m_fds[i]);
+    }
+    listeners->m_count = 0;
+    if (listeners->m_unix_path[0] != '\0')
+    {
+        unlink(listeners->m_unix_path);
+    }
+}
+
+/* _accept()
+ *   Accept a connection from any listener type
+ * in: sock_fd: listening socket
+ * out: client socket, -1 error. cliaddr, ipstr and port describe the peer.
+ */
+int _accept(int sock_fd, struct sockaddr_storage* cliaddr, char ipstr[PEER_STRLEN], int* port)
 {
     int client_fd;
     socklen_t cliaddrlen = sizeof(*cliaddr);
@@ -130,8 +343,28 @@ int _accept(int sock_fd, struct sockaddr_in* cliaddr, char ipstr[INET_ADDRSTRLEN
         perror("accept()");
         return -1;
     }
-    inet_ntop(AF_INET, &(cliaddr->sin_addr), ipstr, INET_ADDRSTRLEN);
-    syslog(LOG_USER, "Accepted connection from %s:%d", ipstr, ntohs(cliaddr->sin_port));
+
+    *port = 0;
+    if (cliaddr->ss_family == AF_INET) {
+        struct sockaddr_in* in = (struct sockaddr_in*)cliaddr;
+        inet_ntop(AF_INET, &in->sin_addr, ipstr, PEER_STRLEN);
+        *port = ntohs(in->sin_port);
+    }
+    else if (cliaddr->ss_family == AF_INET6) {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)cliaddr;
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+            // log dual-stack IPv4 clients the same way as on an IPv4 listener
+            inet_ntop(AF_INET, &in6->sin6_addr.s6_addr[12], ipstr, PEER_STRLEN);
+        }
+        else {
+            inet_ntop(AF_INET6, &in6->sin6_addr, ipstr, PEER_STRLEN);
+        }
+        *port = ntohs(in6->sin6_port);
+    }
+    else {
+        snprintf(ipstr, PEER_STRLEN, "local");
+    }
+    ASYNC_LOG(LOG_INFO, "Accepted connection from %s:%d", ipstr, *port);
     return client_fd;
 }
 
@@ -142,7 +375,6 @@ int _receive(int client_fd, char* buffer, int size) {
         return -1;
     }
     if (bytes_received == 0) {
-        close(client_fd);
         return 0;
     }
     buffer[bytes_received] = '\0'; // null-terminate safely
@@ -150,255 +382,1371 @@ int _receive(int client_fd, char* buffer, int size) {
     return bytes_received;
 }
 
-int _cache(const char* writefile, const char* writestr, int writesize)
+/* _cache()
+ *   Append a packet to the cache file
+ * in: writefile: path to the cache file
+ *     iov, iovcnt: packet contents, possibly spread over several buffers
+ * out: 0 success, -1 error
+ */
+int _cache(const char* writefile, const struct iovec* iov, int iovcnt)
 {
     int file_descriptor = open(writefile, O_WRONLY | O_APPEND | O_CREAT, 0644);
     if (file_descriptor == -1)
     {
-        syslog(LOG_ERR, "failed to open file %s with error %d\n", writefile, file_descriptor);
+        ASYNC_LOG(LOG_ERR, "failed to open file %s with error %d", writefile, file_descriptor);
         return -1;
     }
 
-    int bytes = write(file_descriptor, writestr, writesize);
-    if (bytes == -1)
+    size_t writesize = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        writesize += iov[i].iov_len;
+    }
+
+    // writev() may stop short, so advance through the iovec until everything is written
+    struct iovec pending[IOV_BATCH];
+    int pending_cnt = 0;
+    int status = 0;
+    size_t bytes = 0;
+    while (iovcnt > 0 || pending_cnt > 0)
     {
-        syslog(LOG_ERR, "failed to write to file %s\n", writefile);
+        while (pending_cnt < IOV_BATCH && iovcnt > 0)
+        {
+            pending[pending_cnt++] = *iov++;
+            iovcnt--;
+        }
+
+        ssize_t written = writev(file_descriptor, pending, pending_cnt);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ASYNC_LOG(LOG_ERR, "failed to write to file %s", writefile);
+            status = -1;
+            break;
+        }
+        bytes += written;
+
+        int consumed = 0;
+        while (consumed < pending_cnt && (size_t)written >= pending[consumed].iov_len)
+        {
+            written -= pending[consumed].iov_len;
+            consumed++;
+        }
+        if (consumed < pending_cnt)
+        {
+            pending[consumed].iov_base = (char*)pending[consumed].iov_base + written;
+            pending[consumed].iov_len -= written;
+        }
+        memmove(pending, pending + consumed, (pending_cnt - consumed) * sizeof(struct iovec));
+        pending_cnt -= consumed;
     }
-    else if (bytes != writesize)
+
+    if (status == 0 && bytes != writesize)
     {
-        syslog(LOG_ERR, "partial write to %s, %d/%d bytes written\n", writefile, bytes, writesize);
+        ASYNC_LOG(LOG_ERR, "partial write to %s, %zu/%zu bytes written", writefile, bytes, writesize);
     }
-    else
+    else if (status == 0)
     {
-        printf("%d: %.*s\n", writesize, writesize, writestr);
-        syslog(LOG_DEBUG, "wrote %d bytes to %s\n", bytes, writefile);
+        ASYNC_LOG(LOG_DEBUG, "wrote %zu bytes to %s", bytes, writefile);
     }
 
-    if (fsync(file_descriptor) < 0)
+    int synced;
+    TRACE_SPAN("fsync", synced = fsync(file_descriptor));
+    if (synced < 0)
     {
-        syslog(LOG_ERR, "failed to fsync. %s may not be up to date\n", writefile);
+        ASYNC_LOG(LOG_ERR, "failed to fsync. %s may not be up to date", writefile);
     }
 
     if (close(file_descriptor) == -1)
     {
-        syslog(LOG_ERR, "failed to close file %s\n", writefile);
+        ASYNC_LOG(LOG_ERR, "failed to close file %s", writefile);
         return -1;
     }
+    return status;
 }
 
-/* _send_cache()
- *   Send entire cache file to client
- * in: client_fd: file descriptor to client socket
+/* _channel_unwind()
+ *   Undo the first stages steps of a failed _channel_open()
+ */
+static void _channel_unwind(Channel* channel, int stages)
+{
+    if (stages > 5 && index_history)
+    {
+        line_index_close(&channel->m_lines);
+    }
+    if (stages > 4 && retain_history)
+    {
+        retention_free(&channel->m_retention);
+    }
+    if (stages > 3 && memory_capacity > 0)
+    {
+        memory_history_destroy(&channel->m_memory_history);
+    }
+    if (stages > 2 && compress_history)
+    {
+        block_store_close(&channel->m_block_store);
+    }
+    if (stages > 1)
+    {
+        replay_cache_destroy(&channel->m_replay_cache);
+    }
+    if (stages > 0 && persist_history && !compress_history)
+    {
+        journal_close(&channel->m_journal);
+    }
+    profiled_mutex_destroy(&channel->m_lock);
+    free(channel->m_name);
+    free(channel->m_path);
+}
+
+/* _channel_open()
+ *   Open a channel's storage in the configured format
+ * in: name: channel name, NULL for the default channel
  * out: 0 success, -1 error
  */
-int _send_cache(int client_fd) {
-    
-    char cache_buffer[BUFFER_SIZE];
-    int cache_fd = open(CACHE_FILE, O_RDONLY);
-    if (cache_fd == -1) {
-        perror("open()");
+static int _channel_open(Channel* channel, const char* name)
+{
+    memset(channel, 0, sizeof(*channel));
+    if (name != NULL)
+    {
+        channel->m_name = strdup(name);
+    }
+    channel->m_path = channel_path(history_path, name);
+    if (channel->m_path == NULL || (name != NULL && channel->m_name == NULL))
+    {
+        free(channel->m_name);
+        free(channel->m_path);
+        fprintf(stderr, "channel failed to allocate\n");
         return -1;
     }
 
-    ssize_t bytes_read;
-    while ((bytes_read = read(cache_fd, cache_buffer, sizeof(cache_buffer))) > 0) {
-
-        ssize_t total_bytes_sent = 0;
-        while (total_bytes_sent < bytes_read)
-        {
-            ssize_t bytes_sent = send(client_fd, cache_buffer + total_bytes_sent, bytes_read - total_bytes_sent, 0);
-            if (bytes_sent == -1 || bytes_sent == 0)
-            {
-                close(cache_fd);
-                perror("send()");
-                return -1;
-            }
-            total_bytes_sent += bytes_sent;
-        }
+    profiled_mutex_init(&channel->m_lock, name ? channel->m_name : "file_lock", 0);
+    // recover before anything maps the history, so torn writes are never replayed
+    if (persist_history && !compress_history && journal_open(&channel->m_journal, channel->m_path) != 0)
+    {
+        perror("journal_open()");
+        _channel_unwind(channel, 0);
+        return -1;
     }
-
-    close(cache_fd);
-    if (bytes_read == -1)
+    if (replay_cache_init(&channel->m_replay_cache, channel->m_path) != 0)
+    {
+        perror("replay_cache_init()");
+        _channel_unwind(channel, 1);
+        return -1;
+    }
+    if (compress_history && block_store_open(&channel->m_block_store, channel->m_path) != 0)
+    {
+        perror("block_store_open()");
+        _channel_unwind(channel, 2);
+        return -1;
+    }
+    if (memory_capacity > 0 && memory_history_init(&channel->m_memory_history, memory_capacity) != 0)
+    {
+        perror("memory_history_init()");
+        _channel_unwind(channel, 3);
+        return -1;
+    }
+    if (retain_history && (retention_init(&channel->m_retention, &retention_policy) != 0 ||
+                           retention_load(&channel->m_retention, channel->m_path) != 0))
+    {
+        perror("retention_load()");
+        retention_free(&channel->m_retention);
+        _channel_unwind(channel, 4);
+        return -1;
+    }
+    if (index_history && line_index_open(&channel->m_lines, channel->m_path) != 0)
     {
-        perror("read()");
+        perror("line_index_open()");
+        _channel_unwind(channel, 5);
+        return -1;
+    }
+    if (subscriber_hub_init(&channel->m_subscribers, SUBSCRIBER_QUEUE_LIMIT) != 0)
+    {
+        perror("subscriber_hub_init()");
+        _channel_unwind(channel, 6);
         return -1;
     }
     return 0;
 }
 
-static void signal_handler(int signal_number)
+/* _channel_close()
+ *   Stop a channel's subscribers and keep or remove its history
+ * out: 0 success, -1 error
+ */
+static int _channel_close(Channel* channel)
 {
-    if (signal_number == SIGTERM || signal_number == SIGINT)
+    int status = 0;
+    subscriber_hub_destroy(&channel->m_subscribers);
+    profiled_mutex_destroy(&channel->m_lock);
+    replay_cache_destroy(&channel->m_replay_cache);
+    if (retain_history)
     {
-        syslog(LOG_USER, "Caught signal, exiting");
-        RUN = 0;// shutdown
+        retention_free(&channel->m_retention);
+    }
+    if (index_history && persist_history)
+    {
+        line_index_close(&channel->m_lines);
+    }
+    else if (index_history && line_index_remove(&channel->m_lines) != 0)
+    {
+        status = -1;
+    }
+    if (memory_capacity > 0)
+    {
+        // nothing was written to disk
+        memory_history_destroy(&channel->m_memory_history);
+    }
+    else if (persist_history)
+    {
+        // keep the history for the next start
+        if (compress_history)
+        {
+            block_store_close(&channel->m_block_store);
+        }
+        else
+        {
+            journal_close(&channel->m_journal);
+        }
+    }
+    else if (compress_history)
+    {
+        status = block_store_remove(&channel->m_block_store);
+    }
+    else if (remove(channel->m_path) == -1 && errno != ENOENT)
+    {
+        perror("remove()");
+        status = -1;
     }
+    free(channel->m_name);
+    free(channel->m_path);
+    return status;
 }
 
-int is_daemon(int argc, char *argv[])
+/* _channel_find()
+ *   Look up a named channel, opening it on first use. Names are limited to
+ *   [A-Za-z0-9_-] since they become part of a file name.
+ * out: channel, NULL for an invalid name, too many channels or an error
+ */
+static Channel* _channel_find(const char* name, size_t length)
 {
-    int debug = 0;
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-d") == 0) {
-            debug = 1;
-            break;
+    if (length == 0 || length > CHANNEL_NAME_MAX)
+    {
+        return NULL;
+    }
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-'))
+        {
+            return NULL;
+        }
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    }
+
+    profiled_mutex_lock(&channel_lock);
+    Channel** bucket = &channels[hash % CHANNEL_BUCKETS];
+    Channel* channel = *bucket;
+    while (channel != NULL && (strlen(channel->m_name) != length || memcmp(channel->m_name, name, length) != 0))
+    {
+        channel = channel->m_next;
+    }
+    if (channel == NULL && channel_count < MAX_CHANNELS)
+    {
+        char copy[CHANNEL_NAME_MAX + 1];
+        memcpy(copy, name, length);
+        copy[length] = '\0';
+        channel = (Channel*)malloc(sizeof(Channel));
+        if (channel != NULL && _channel_open(channel, copy) != 0)
+        {
+            free(channel);
+            channel = NULL;
+        }
+        if (channel != NULL)
+        {
+            channel->m_next = *bucket;
+            *bucket = channel;
+            channel_count++;
         }
     }
-    return debug;
+    profiled_mutex_unlock(&channel_lock);
+    return channel;
 }
 
-void daemonize()
+/* _list_channels()
+ *   Copy the named channels into list, MAX_CHANNELS long, so background
+ *   tasks can work through them without holding channel_lock. Channels are
+ *   only freed after every task has returned.
+ * out: number of channels listed
+ */
+static size_t _list_channels(Channel** list)
 {
-    pid_t pid = fork();
-    switch (pid) {
-        case -1: // failure
-            perror("fork()");
-            exit(EXIT_FAILURE);
-
-        case 0: // child process
-            pid_t sid = setsid(); // make daemon session leader
-            if (sid == -1)
-            {
-                perror("setsid()");
-                exit(EXIT_FAILURE);
-            }
-            if (chdir("/") == -1)
-            {
-                perror("chdir()");
-                exit(EXIT_FAILURE);
-            }
-            int fd = open("/dev/null", O_RDWR); // reroute stdio to null
-            if (fd == -1)
-            {
-                perror("open()");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd, STDIN_FILENO);
-            dup2(fd, STDOUT_FILENO);
-            dup2(fd, STDERR_FILENO);
-            if (fd > 2)
-            {
-                close(fd);
-            }
-
-            pid = fork(); // double fork to prevent reaquiring terminal (remove daemon from session leader)
-            if (pid == -1) {
-                exit(EXIT_FAILURE);
-            }
-            else if (pid != 0) {
-                exit(EXIT_SUCCESS);
-            }
-            return;
-
-        default: // parent process
-            exit(EXIT_SUCCESS);
+    size_t count = 0;
+    profiled_mutex_lock(&channel_lock);
+    for (int i = 0; i < CHANNEL_BUCKETS; i++)
+    {
+        for (Channel* channel = channels[i]; channel != NULL; channel = channel->m_next)
+        {
+            list[count++] = channel;
+        }
     }
+    profiled_mutex_unlock(&channel_lock);
+    return count;
 }
 
-typedef struct ClientTaskParams
+/* _discard_torn()
+ *   Cut the history file back to its committed size after a failed append,
+ *   so the next append starts where the journal, replay cache and line
+ *   index expect it to
+ */
+static void _discard_torn(Channel* channel)
 {
-    struct sockaddr_in cliaddr;
-    char ipstr[INET_ADDRSTRLEN];
-    int client_fd;
-    int sock_fd;
-} ClientTaskParams;
+    uint64_t committed = persist_history ? channel->m_journal.m_data_size : channel->m_replay_cache.m_committed;
+    if (truncate(channel->m_path, committed) != 0)
+    {
+        perror("truncate()");
+    }
+    replay_cache_reset(&channel->m_replay_cache);
+}
 
-void client_task(void* params)
+/* _store_history()
+ *   Append a packet to the history in the configured storage format.
+ *   Caller must hold the channel lock.
+ * out: 0 success, -1 error
+ */
+static int _store_history(Channel* channel, const struct iovec* iov, int iovcnt, size_t size)
 {
-    ClientTaskParams* p = (ClientTaskParams*)params;
-    char buffer[BUFFER_SIZE];
-    size_t line_buffer_size = BUFFER_SIZE;
-    size_t used_size = 0;
-    char* line_buffer = malloc(BUFFER_SIZE);
-    if (line_buffer == NULL) {
-        free(p);
-        perror("malloc()");
-        return;
+    if (memory_capacity > 0)
+    {
+        return memory_history_append(&channel->m_memory_history, iov, iovcnt, size);
     }
-
-    int connected = 1;
-    while(connected && RUN)
+    if (compress_history)
     {
-        int bytes_received = _receive(p->client_fd, buffer, BUFFER_SIZE);
-        if (bytes_received == -1) {
-            close(p->client_fd);
-            free(p);
-            perror("_receive()");
-            return;
-        }
-        else if (bytes_received == 0) {
-            connected = 0;
+        return block_store_append(&channel->m_block_store, iov, iovcnt);
+    }
+    // a partial write may have landed before _cache() failed
+    if (_cache(channel->m_path, iov, iovcnt) == -1)
+    {
+        _discard_torn(channel);
+        return -1;
+    }
+    if (persist_history && journal_append(&channel->m_journal, iov, iovcnt) != 0)
+    {
+        // unframed bytes would be dropped by recovery anyway, so drop them now
+        _discard_torn(channel);
+        return -1;
+    }
+    replay_cache_append(&channel->m_replay_cache, size);
+    time_t now = time(NULL);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        // a failed index only disables TAIL and LINES, the append itself stands
+        line_index_append(&channel->m_lines, iov[i].iov_base, iov[i].iov_len);
+        if (retain_history)
+        {
+            retention_observe(&channel->m_retention, iov[i].iov_base, iov[i].iov_len, now);
         }
-
+    }
+    return 0;
+}
+
+/* _append_history()
+ *   Store a packet and push it to live subscribers in commit order.
+ *   Caller must hold the channel lock.
+ * out: 0 success, -1 error
+ */
+static int _append_history(Channel* channel, const struct iovec* iov, int iovcnt, size_t size)
+{
+    if (_store_history(channel, iov, iovcnt, size) != 0)
+    {
+        return -1;
+    }
+    subscriber_hub_publish(&channel->m_subscribers, iov, iovcnt, size);
+    return 0;
+}
+
+/* _send_length()
+ *   Send the 8 byte big-endian history length that starts a framed reply
+ * out: 0 success, -1 error
+ */
+static int _send_length(int client_fd, uint64_t length)
+{
+    unsigned char header[8];
+    for (int i = 0; i < 8; i++)
+    {
+        header[i] = (unsigned char)(length >> (56 - 8 * i));
+    }
+    size_t sent = 0;
+    while (sent < sizeof(header))
+    {
+        ssize_t bytes = send(client_fd, header + sent, sizeof(header) - sent, MSG_NOSIGNAL);
+        if (bytes == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+        sent += bytes > 0 ? bytes : 0;
+    }
+    return 0;
+}
+
+/* _send_stored()
+ *   Send uncompressed bytes as stored frames of at most one block each
+ * out: 0 success, -1 error
+ */
+static int _send_stored(int client_fd, const char* data, size_t remaining)
+{
+    while (remaining > 0)
+    {
+        uint32_t size = remaining < BLOCK_STORE_BLOCK_SIZE ? remaining : BLOCK_STORE_BLOCK_SIZE;
+        if (block_store_send_frame(client_fd, data, size, size) != 0)
+        {
+            return -1;
+        }
+        data += size;
+        remaining -= size;
+    }
+    return 0;
+}
+
+/* _send_frames()
+ *   Replay an uncompressed snapshot to a client that negotiated compressed
+ *   replays, as stored (uncompressed) frames
+ * out: 0 success, -1 error
+ */
+static int _send_frames(ReplaySnapshot* snapshot, size_t from, int client_fd)
+{
+    for (int i = 0; i < snapshot->m_count; i++)
+    {
+        size_t length = snapshot->m_iov[i].iov_len;
+        size_t skip = from < length ? from : length;
+        from -= skip;
+        if (_send_stored(client_fd, (const char*)snapshot->m_iov[i].iov_base + skip, length - skip) != 0)
+        {
+            return -1;
+        }
+    }
+    return block_store_send_frame(client_fd, NULL, 0, 0);
+}
+
+/*
+ * The history at one point in time, taken under the channel lock and sent
+ * without it. Which fields are set depends on the storage format: a mapped snapshot
+ * of the plain file, the -z block index plus its uncompressed tail, or a -m
+ * copy in m_data.
+ */
+typedef struct HistoryCapture {
+    ReplaySnapshot* m_snapshot;
+    BlockIndexEntry* m_blocks;
+    size_t m_count;
+    char* m_data;
+    size_t m_size;
+    uint64_t m_from;
+    Channel* m_channel;
+    RetentionPin m_pin;
+    int m_pinned;
+} HistoryCapture;
+
+/* _history_size()
+ *   Committed history size in bytes, the offset replication resumes from.
+ *   Caller holds the channel lock.
+ */
+static uint64_t _history_size(Channel* channel)
+{
+    if (compress_history)
+    {
+        return channel->m_block_store.m_raw_size;
+    }
+    return channel->m_replay_cache.m_committed;
+}
+
+static void _release_capture(HistoryCapture* capture)
+{
+    if (capture->m_snapshot != NULL)
+    {
+        replay_cache_release(&capture->m_channel->m_replay_cache, capture->m_snapshot);
+    }
+    if (capture->m_pinned)
+    {
+        retention_unpin(&capture->m_channel->m_retention, &capture->m_pin);
+    }
+    free(capture->m_blocks);
+    free(capture->m_data);
+}
+
+/* _capture_history()
+ *   Capture the committed history from raw byte offset from, or from the
+ *   start of the retention window for HISTORY_RETAINED. Offsets that have
+ *   left the window cannot be captured. Caller holds the channel lock,
+ *   except for the plain file, whose replay cache only hands out committed
+ *   lengths anyway. The in-memory history drops old packets, so it has no
+ *   stable offsets and can only be captured whole.
+ * out: 0 success, -1 error
+ */
+static int _capture_history(Channel* channel, HistoryCapture* capture, uint64_t from)
+{
+    memset(capture, 0, sizeof(*capture));
+    capture->m_channel = channel;
+    if (retain_history)
+    {
+        // pinned before the snapshot is taken, so the start never passes its
+        // end, and nothing the capture replays is released until it is done
+        if (from == HISTORY_RETAINED)
+        {
+            from = retention_pin_start(&channel->m_retention, &capture->m_pin);
+        }
+        else if (retention_pin(&channel->m_retention, &capture->m_pin, from) != 0)
+        {
+            return -1;
+        }
+        capture->m_pinned = 1;
+    }
+    else if (from == HISTORY_RETAINED)
+    {
+        from = 0;
+    }
+    capture->m_from = from;
+    if (memory_capacity > 0)
+    {
+        if (from != 0)
+        {
+            return -1;
+        }
+        return memory_history_copy(&channel->m_memory_history, &capture->m_data, &capture->m_size);
+    }
+    if (compress_history)
+    {
+        if (from > channel->m_block_store.m_raw_size)
+        {
+            return -1;
+        }
+        return block_store_snapshot(&channel->m_block_store, from, &capture->m_blocks, &capture->m_count,
+                                    &capture->m_data, &capture->m_size);
+    }
+    if (replay_cache_acquire(&channel->m_replay_cache, &capture->m_snapshot) != 0 ||
+        from > capture->m_snapshot->m_length)
+    {
+        _release_capture(capture);
+        return -1;
+    }
+    return 0;
+}
+
+/* _send_capture()
+ *   Replay a captured history
+ * in: client_fd: file descriptor to client socket
+ *     compressed: client negotiated framed, block-compressed replays
+ *     framed: client connected in length-prefixed mode, so the history is
+ *             preceded by its 8 byte big-endian length
+ * out: 0 success, -1 error
+ */
+static int _send_capture(int client_fd, const HistoryCapture* capture, int compressed, int framed)
+{
+    int status = 0;
+    if (capture->m_snapshot != NULL)
+    {
+        status = framed ? _send_length(client_fd, capture->m_snapshot->m_length - capture->m_from) : 0;
+        if (status == 0)
+        {
+            status = compressed ? _send_frames(capture->m_snapshot, capture->m_from, client_fd)
+                                : replay_cache_send(capture->m_snapshot, capture->m_from, client_fd);
+        }
+        return status;
+    }
+
+    if (compress_history)
+    {
+        // decompress unless the client negotiated compressed replays
+        if (framed)
+        {
+            uint64_t length = capture->m_size;
+            for (size_t i = 0; i < capture->m_count; i++)
+            {
+                length += capture->m_blocks[i].m_raw_size;
+            }
+            status = _send_length(client_fd, length);
+        }
+        if (status == 0)
+        {
+            status = block_store_replay(capture->m_channel->m_path, capture->m_from, capture->m_blocks, capture->m_count,
+                                        capture->m_data, capture->m_size, client_fd, compressed);
+        }
+        return status;
+    }
+
+    if (framed)
+    {
+        status = _send_length(client_fd, capture->m_size);
+    }
+    if (status == 0 && compressed)
+    {
+        status = _send_stored(client_fd, capture->m_data, capture->m_size) == 0
+                     ? block_store_send_frame(client_fd, NULL, 0, 0) : -1;
+    }
+    else
+    {
+        for (size_t sent = 0; sent < capture->m_size && status == 0;)
+        {
+            ssize_t bytes = send(client_fd, capture->m_data + sent, capture->m_size - sent, MSG_NOSIGNAL);
+            if (bytes == -1 && errno != EINTR)
+            {
+                status = -1;
+            }
+            sent += bytes > 0 ? bytes : 0;
+        }
+    }
+    return status;
+}
+
+/* _send_cache()
+ *   Send entire cache file to client. Clients replaying the same committed
+ *   history share one mapped snapshot instead of each reading the file.
+ * in: channel: history to send
+ *     client_fd: file descriptor to client socket
+ *     compressed, framed: as for _send_capture()
+ * out: 0 success, -1 error
+ */
+int _send_cache(Channel* channel, int client_fd, int compressed, int framed) {
+
+    HistoryCapture capture;
+    int status;
+    if (memory_capacity > 0 || compress_history) {
+        TRACE_SPAN("lock wait", profiled_mutex_lock(&channel->m_lock));
+        status = _capture_history(channel, &capture, HISTORY_RETAINED);
+        profiled_mutex_unlock(&channel->m_lock);
+    }
+    else {
+        status = _capture_history(channel, &capture, HISTORY_RETAINED);
+    }
+    if (status != 0) {
+        return -1;
+    }
+
+    status = _send_capture(client_fd, &capture, compressed, framed);
+    _release_capture(&capture);
+    return status;
+}
+
+static void signal_handler(int signal_number)
+{
+    if (signal_number == SIGTERM || signal_number == SIGINT)
+    {
+        syslog(LOG_USER, "Caught signal, exiting");
+        RUN = 0;// shutdown
+    }
+    else if (signal_number == SIGUSR1)
+    {
+        dump_trace = 1;
+    }
+}
+
+int has_flag(int argc, char *argv[], const char* flag)
+{
+    int found = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], flag) == 0) {
+            found = 1;
+            break;
+        }
+    }
+    return found;
+}
+
+const char* get_option(int argc, char *argv[], const char* flag)
+{
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], flag) == 0) {
+            return argv[i + 1];
+        }
+    }
+    return NULL;
+}
+
+void daemonize()
+{
+    pid_t pid = fork();
+    switch (pid) {
+        case -1: // failure
+            perror("fork()");
+            exit(EXIT_FAILURE);
+
+        case 0: // child process
+            pid_t sid = setsid(); // make daemon session leader
+            if (sid == -1)
+            {
+                perror("setsid()");
+                exit(EXIT_FAILURE);
+            }
+            if (chdir("/") == -1)
+            {
+                perror("chdir()");
+                exit(EXIT_FAILURE);
+            }
+            int fd = open("/dev/null", O_RDWR); // reroute stdio to null
+            if (fd == -1)
+            {
+                perror("open()");
+                exit(EXIT_FAILURE);
+            }
+            dup2(fd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            if (fd > 2)
+            {
+                close(fd);
+            }
+
+            pid = fork(); // double fork to prevent reaquiring terminal (remove daemon from session leader)
+            if (pid == -1) {
+                exit(EXIT_FAILURE);
+            }
+            else if (pid != 0) {
+                exit(EXIT_SUCCESS);
+            }
+            return;
+
+        default: // parent process
+            exit(EXIT_SUCCESS);
+    }
+}
+
+typedef struct ClientTaskParams
+{
+    struct sockaddr_storage cliaddr;
+    char ipstr[PEER_STRLEN];
+    int port;
+    int client_fd;
+    int sock_fd;
+    int compressed;
+    int framed;
+    int subscribe;
+    uint64_t subscribe_from;
+    int report_offset;
+    int lines_request;
+    uint64_t lines_first;
+    uint64_t lines_last;
+    int filter_request;
+    char filter_pattern[FILTER_PATTERN_MAX];
+    size_t filter_len;
+    ThreadPool* thread_pool;
+    Channel* channel;
+    struct ClientTaskParams* prev;
+    struct ClientTaskParams* next;
+} ClientTaskParams;
+
+// open client connections, shut down at exit so no task stays blocked on one
+static ClientTaskParams* clients = NULL;
+static ProfiledMutex clients_lock;
+
+static void _client_track(ClientTaskParams* p)
+{
+    profiled_mutex_lock(&clients_lock);
+    p->prev = NULL;
+    p->next = clients;
+    if (clients != NULL)
+    {
+        clients->prev = p;
+    }
+    clients = p;
+    profiled_mutex_unlock(&clients_lock);
+}
+
+/* _client_untrack()
+ *   Forget a connection before its fd is closed or handed to a subscriber
+ *   hub, so shutdown never touches a descriptor that may have been reused
+ */
+static void _client_untrack(ClientTaskParams* p)
+{
+    profiled_mutex_lock(&clients_lock);
+    if (p->prev != NULL)
+    {
+        p->prev->next = p->next;
+    }
+    else if (clients == p)
+    {
+        clients = p->next;
+    }
+    if (p->next != NULL)
+    {
+        p->next->prev = p->prev;
+    }
+    p->prev = NULL;
+    p->next = NULL;
+    profiled_mutex_unlock(&clients_lock);
+}
+
+static void _client_close(ClientTaskParams* p)
+{
+    _client_untrack(p);
+    close(p->client_fd);
+    free(p);
+}
+
+/* _shutdown_clients()
+ *   Wake every task blocked receiving from or sending to a client
+ */
+static void _shutdown_clients(void)
+{
+    profiled_mutex_lock(&clients_lock);
+    for (ClientTaskParams* p = clients; p != NULL; p = p->next)
+    {
+        shutdown(p->client_fd, SHUT_RDWR);
+    }
+    profiled_mutex_unlock(&clients_lock);
+}
+
+/* _parse_header()
+ *   Recognise connection options sent ahead of the data packet
+ * out: 1 if the packet was a header and must not be cached, 0 otherwise
+ */
+static int _parse_header(ClientTaskParams* p, BufferChain* packet)
+{
+    if (packet->m_blocks != 1)
+    {
+        return 0;
+    }
+    const char* line = packet->m_head->m_data;
+    size_t length = packet->m_size;
+
+    if (length == strlen(ENCODING_HEADER) && memcmp(line, ENCODING_HEADER, length) == 0)
+    {
+        p->compressed = 1;
+        return 1;
+    }
+    if (length == strlen(SUBSCRIBE_HEADER) && memcmp(line, SUBSCRIBE_HEADER, length) == 0)
+    {
+        p->subscribe = 1;
+        return 1;
+    }
+    // a follower's subscription, resuming after the bytes it already stores
+    if (length > strlen(REPLICATE_HEADER) && memcmp(line, REPLICATE_HEADER, strlen(REPLICATE_HEADER)) == 0
+        && line[length - 1] == '\n')
+    {
+        p->subscribe = 1;
+        p->subscribe_from = strtoull(line + strlen(REPLICATE_HEADER), NULL, 10);
+        return 1;
+    }
+    if (length == strlen(OFFSET_HEADER) && memcmp(line, OFFSET_HEADER, length) == 0)
+    {
+        p->report_offset = 1;
+        return 1;
+    }
+    if (length > strlen(TAIL_HEADER) && memcmp(line, TAIL_HEADER, strlen(TAIL_HEADER)) == 0
+        && line[length - 1] == '\n')
+    {
+        p->lines_request = LINES_TAIL;
+        p->lines_last = strtoull(line + strlen(TAIL_HEADER), NULL, 10);
+        return 1;
+    }
+    if (length > strlen(LINES_HEADER) && memcmp(line, LINES_HEADER, strlen(LINES_HEADER)) == 0
+        && line[length - 1] == '\n')
+    {
+        char* dash;
+        p->lines_request = LINES_RANGE;
+        p->lines_first = strtoull(line + strlen(LINES_HEADER), &dash, 10);
+        p->lines_last = *dash == '-' ? strtoull(dash + 1, NULL, 10) : p->lines_first;
+        return 1;
+    }
+    if (length > strlen(FILTER_HEADER) && memcmp(line, FILTER_HEADER, strlen(FILTER_HEADER)) == 0
+        && line[length - 1] == '\n')
+    {
+        // an over-long pattern is kept truncated but refused when the filter runs
+        p->filter_request = 1;
+        p->filter_len = length - strlen(FILTER_HEADER) - 1;
+        memcpy(p->filter_pattern, line + strlen(FILTER_HEADER),
+               p->filter_len < FILTER_PATTERN_MAX ? p->filter_len : FILTER_PATTERN_MAX);
+        return 1;
+    }
+    if (length > strlen(CHANNEL_HEADER) && memcmp(line, CHANNEL_HEADER, strlen(CHANNEL_HEADER)) == 0
+        && line[length - 1] == '\n')
+    {
+        // NULL makes the caller drop the connection
+        p->channel = _channel_find(line + strlen(CHANNEL_HEADER), length - strlen(CHANNEL_HEADER) - 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* _send_offset()
+ *   Answer OFFSET_HEADER with the committed history size, which followers
+ *   compare with their own to report replication lag, and the start of the
+ *   retention window, which tells a follower it can no longer resume
+ * out: 0 success, -1 error
+ */
+static int _send_offset(ClientTaskParams* p)
+{
+    TRACE_SPAN("lock wait", profiled_mutex_lock(&p->channel->m_lock));
+    uint64_t size = _history_size(p->channel);
+    profiled_mutex_unlock(&p->channel->m_lock);
+    uint64_t start = retain_history ? retention_start(&p->channel->m_retention) : 0;
+
+    char line[48];
+    int length = snprintf(line, sizeof(line), "%llu %llu\n", (unsigned long long)size, (unsigned long long)start);
+    return send(p->client_fd, line, length, MSG_NOSIGNAL) == length ? 0 : -1;
+}
+
+/* _send_lines()
+ *   Answer TAIL or LINES from the line index: two index reads locate the
+ *   byte range, which is sent with sendfile() straight from the history file.
+ *   Lines before the retention window are not sent.
+ * out: 0 success, -1 error
+ */
+static int _send_lines(ClientTaskParams* p)
+{
+    Channel* channel = p->channel;
+    if (!index_history)
+    {
+        ASYNC_LOG(LOG_ERR, "line requests need the line index of the plain history file");
+        return -1;
+    }
+
+    uint64_t count = line_index_count(&channel->m_lines);
+    uint64_t first = p->lines_first > 0 ? p->lines_first : 1;
+    uint64_t last = p->lines_last < count ? p->lines_last : count;
+    if (p->lines_request == LINES_TAIL)
+    {
+        first = count > p->lines_last ? count - p->lines_last + 1 : 1;
+        last = count;
+    }
+    uint64_t start = 0;
+    uint64_t end = 0;
+    if (first <= last && (line_index_end(&channel->m_lines, first - 1, &start) != 0 ||
+                          line_index_end(&channel->m_lines, last, &end) != 0))
+    {
+        return -1;
+    }
+    RetentionPin pin;
+    if (retain_history)
+    {
+        uint64_t retained = retention_pin_start(&channel->m_retention, &pin);
+        start = start > retained ? start : retained;
+    }
+    int data_fd = end > start ? open(channel->m_path, O_RDONLY | O_CLOEXEC) : -1;
+    if (end > start && data_fd == -1)
+    {
+        perror("open()");
+    }
+    if (data_fd == -1)
+    {
+        if (retain_history)
+        {
+            retention_unpin(&channel->m_retention, &pin);
+        }
+        return end > start ? -1 : 0;
+    }
+    off_t offset = start;
+    int status = 0;
+    while (status == 0 && (uint64_t)offset < end)
+    {
+        ssize_t sent = sendfile(p->client_fd, data_fd, &offset, end - offset);
+        if (sent == -1 && errno != EINTR)
+        {
+            perror("sendfile()");
+            status = -1;
+        }
+        else if (sent == 0)
+        {
+            status = -1;
+        }
+    }
+    close(data_fd);
+    if (retain_history)
+    {
+        retention_unpin(&channel->m_retention, &pin);
+    }
+    return status;
+}
+
+/* _send_filter()
+ *   Answer FILTER with the retained history lines containing the pattern,
+ *   scanned in parallel on the pool
+ * out: 0 success, -1 error
+ */
+static int _send_filter(ClientTaskParams* p)
+{
+    if (p->filter_len > FILTER_PATTERN_MAX)
+    {
+        ASYNC_LOG(LOG_ERR, "filter pattern longer than %d bytes", FILTER_PATTERN_MAX);
+        return -1;
+    }
+    if (compress_history)
+    {
+        ASYNC_LOG(LOG_ERR, "filter requests need an uncompressed history");
+        return -1;
+    }
+
+    HistoryCapture capture;
+    int status;
+    if (memory_capacity > 0)
+    {
+        TRACE_SPAN("lock wait", profiled_mutex_lock(&p->channel->m_lock));
+        status = _capture_history(p->channel, &capture, HISTORY_RETAINED);
+        profiled_mutex_unlock(&p->channel->m_lock);
+    }
+    else
+    {
+        status = _capture_history(p->channel, &capture, HISTORY_RETAINED);
+    }
+    if (status != 0)
+    {
+        return -1;
+    }
+
+    // the file may be longer than the snapshot, only its committed part is read
+    FilterSource source = { .m_fd = -1, .m_data = capture.m_data, .m_begin = 0, .m_end = capture.m_size };
+    if (capture.m_snapshot != NULL)
+    {
+        source.m_begin = capture.m_from;
+        source.m_end = capture.m_snapshot->m_length;
+        source.m_fd = source.m_begin < source.m_end ? open(p->channel->m_path, O_RDONLY | O_CLOEXEC) : -1;
+        if (source.m_begin < source.m_end && source.m_fd == -1)
+        {
+            perror("open()");
+            _release_capture(&capture);
+            return -1;
+        }
+    }
+
+    SearchPattern pattern;
+    search_compile(&pattern, p->filter_pattern, p->filter_len);
+    status = history_filter_send(p->thread_pool, &pattern, &source, p->client_fd);
+    if (source.m_fd != -1)
+    {
+        close(source.m_fd);
+    }
+    _release_capture(&capture);
+    return status;
+}
+
+/* _subscribe()
+ *   Replay the history from subscribe_from, then hand the connection to the
+ *   subscriber hub so every later append, timestamps included, is pushed as
+ *   it is committed. Pushed appends are raw bytes, so the replay ignores
+ *   ENCODING:lz. Followers replicate through the same path.
+ * out: 0 success, -1 error. Either way the caller no longer owns client_fd.
+ */
+static int _subscribe(ClientTaskParams* p)
+{
+    Channel* channel = p->channel;
+    HistoryCapture capture;
+    TRACE_SPAN("lock wait", profiled_mutex_lock(&channel->m_lock));
+    int status = _capture_history(channel, &capture, p->subscribe_from);
+    Subscriber* subscriber = status == 0 ? subscriber_hub_add(&channel->m_subscribers, p->client_fd) : NULL;
+    profiled_mutex_unlock(&channel->m_lock);
+    if (subscriber == NULL)
+    {
+        if (status == 0)
+        {
+            _release_capture(&capture);
+        }
+        _client_untrack(p);
+        close(p->client_fd);
+        return -1;
+    }
+
+    uint64_t from = capture.m_from;
+    status = _send_capture(p->client_fd, &capture, 0, 0);
+    _release_capture(&capture);
+    // the hub owns the fd from here and may close it
+    _client_untrack(p);
+    if (status != 0)
+    {
+        subscriber_hub_cancel(&channel->m_subscribers, subscriber);
+        return -1;
+    }
+    subscriber_hub_start(&channel->m_subscribers, subscriber);
+    ASYNC_LOG(LOG_INFO, "Subscribed %s:%d from offset %llu", p->ipstr, p->port, (unsigned long long)from);
+    return 0;
+}
+
+/* _commit()
+ *   Append a completed packet to the cache and replay the cache to the client
+ * in: p: client connection
+ *     iov, iovcnt, size: packet contents
+ * out: 0 success, -1 error
+ */
+static int _commit(ClientTaskParams* p, const struct iovec* iov, int iovcnt, size_t size)
+{
+    TRACE_SPAN("lock wait", profiled_mutex_lock(&p->channel->m_lock));
+
+    // flush to cache; a follower only stores what the leader sends it
+    if (size > 0 && leader_address == NULL && _append_history(p->channel, iov, iovcnt, size) == -1) {
+        profiled_mutex_unlock(&p->channel->m_lock);
+        perror("cache()");
+        return -1;
+    }
+
+    profiled_mutex_unlock(&p->channel->m_lock);
+
+    // the replay works from a snapshot, so other writers need not wait for it
+    int sent;
+    TRACE_SPAN("send history", sent = _send_cache(p->channel, p->client_fd, p->compressed, p->framed));
+    if (sent == -1) {
+        perror("send()");
+        return -1;
+    }
+    return 0;
+}
+
+/* _commit_packet()
+ *   Commit a newline-delimited packet
+ * in: p: client connection
+ *     packet: chained packet contents, including the trailing newline
+ * out: 0 success, -1 error
+ */
+static int _commit_packet(ClientTaskParams* p, BufferChain* packet)
+{
+    struct iovec iov[packet->m_blocks];
+    int iovcnt = buffer_chain_iovec(packet, iov, packet->m_blocks);
+    if (iovcnt == -1)
+    {
+        return -1;
+    }
+    return _commit(p, iov, iovcnt, packet->m_size);
+}
+
+/* _receive_exact()
+ *   Fill dst with size bytes, first from the bytes already received with
+ *   the magic byte, then straight from the socket
+ * out: 0 success, -1 error or early close
+ */
+static int _receive_exact(int client_fd, char* dst, size_t size, const char** pending, size_t* pending_size)
+{
+    size_t copied = size < *pending_size ? size : *pending_size;
+    memcpy(dst, *pending, copied);
+    *pending += copied;
+    *pending_size -= copied;
+
+    while (copied < size)
+    {
+        ssize_t bytes = recv(client_fd, dst + copied, size - copied, MSG_WAITALL);
+        if (bytes == 0 || (bytes == -1 && errno != EINTR))
+        {
+            return -1;
+        }
+        copied += bytes > 0 ? bytes : 0;
+    }
+    return 0;
+}
+
+/* _serve_framed()
+ *   Length-prefixed mode, chosen by a FRAME_MAGIC first byte: a 4 byte
+ *   big-endian length and that many payload bytes, which may be binary.
+ *   The payload is received into an exactly sized buffer and appended
+ *   without scanning; the reply is the history with its length in front.
+ * in: p: client connection
+ *     pending, pending_size: bytes received after the magic byte
+ * out: 0 success, -1 error
+ */
+static int _serve_framed(ClientTaskParams* p, const char* pending, size_t pending_size)
+{
+    p->framed = 1;
+    unsigned char header[4];
+    if (_receive_exact(p->client_fd, (char*)header, sizeof(header), &pending, &pending_size) != 0)
+    {
+        return -1;
+    }
+    uint32_t length = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+    if (length > PACKET_LIMIT)
+    {
+        ASYNC_LOG(LOG_ERR, "rejecting frame from %s, %u bytes exceeds %d", p->ipstr, length, PACKET_LIMIT);
+        return -1;
+    }
+
+    char* payload = malloc(length ? length : 1);
+    if (payload == NULL)
+    {
+        ASYNC_LOG(LOG_ERR, "rejecting frame from %s, out of memory", p->ipstr);
+        return -1;
+    }
+    int status = _receive_exact(p->client_fd, payload, length, &pending, &pending_size);
+    if (status == 0)
+    {
+        struct iovec iov = { .iov_base = payload, .iov_len = length };
+        status = _commit(p, &iov, 1, length);
+    }
+    free(payload);
+    return status;
+}
+
+void client_task(void* params)
+{
+    ClientTaskParams* p = (ClientTaskParams*)params;
+    char buffer[BUFFER_SIZE];
+    BufferChain packet;
+    buffer_chain_init(&packet);
+    int discarding = 0;
+    int first = 1;
+
+    int connected = 1;
+    while(connected && RUN)
+    {
+        int bytes_received;
+        TRACE_SPAN("recv", bytes_received = _receive(p->client_fd, buffer, BUFFER_SIZE));
+        if (bytes_received == -1) {
+            buffer_chain_reset(&packet);
+            _client_close(p);
+            perror("_receive()");
+            return;
+        }
+        else if (bytes_received == 0) {
+            connected = 0;
+        }
+
+        // a text packet never starts with NUL, so it selects the framed mode
+        if (first && bytes_received > 0 && buffer[0] == FRAME_MAGIC)
+        {
+            if (_serve_framed(p, buffer + 1, bytes_received - 1) == -1)
+            {
+                ASYNC_LOG(LOG_ERR, "dropping framed connection from %s", p->ipstr);
+            }
+            break;
+        }
+        first = 0;
+
         // append until no more data
-        for (int i = 0; i < bytes_received; i++)
+        char* segment = buffer;
+        size_t remaining = bytes_received;
+        while (remaining > 0)
         {
+            char* newline = memchr(segment, '\n', remaining);
+            size_t length = newline ? (size_t)(newline - segment) + 1 : remaining;
 
-            size_t remaining_size = line_buffer_size - used_size;
-            if (remaining_size == 0)
+            if (!discarding && packet.m_size + length > PACKET_LIMIT)
             {
-                // grow size if not enough room
-                // table doubling
-                char* temp = realloc(line_buffer, 2*line_buffer_size);
-                if (temp == NULL) {
-                    free(line_buffer);
-                    close(p->client_fd);
-                    free(p);
-                    perror("realloc()");
-                    return;
-                }
-                line_buffer = temp;
-                line_buffer_size = 2*line_buffer_size;
+                ASYNC_LOG(LOG_ERR, "discarding packet from %s, exceeds %d bytes", p->ipstr, PACKET_LIMIT);
+                discarding = 1;
+            }
+            if (!discarding && buffer_chain_append(&packet, segment, length) != 0)
+            {
+                ASYNC_LOG(LOG_ERR, "discarding packet from %s, out of memory", p->ipstr);
+                discarding = 1;
+            }
+            if (discarding)
+            {
+                // drop the over-length packet but keep reading until its newline
+                buffer_chain_reset(&packet);
             }
 
-            *(line_buffer + used_size++) = buffer[i];
-            if (buffer[i] == '\n')
+            segment += length;
+            remaining -= length;
+
+            if (newline == NULL)
             {
-                pthread_mutex_lock(&file_lock);
-                
-                // flush to cache
-                if (_cache(CACHE_FILE, line_buffer, used_size) == -1) {
-                    free(line_buffer);
-                    close(p->client_fd);
-                    free(p);
-                    perror("cache()");
-                    pthread_mutex_unlock(&file_lock);
-                    return;
+                continue;
+            }
+            if (discarding)
+            {
+                discarding = 0;
+                continue;
+            }
+            if (_parse_header(p, &packet))
+            {
+                buffer_chain_reset(&packet);
+                if (p->channel == NULL)
+                {
+                    ASYNC_LOG(LOG_ERR, "rejecting channel requested by %s", p->ipstr);
+                    connected = 0;
+                    break;
                 }
-
-                if (_send_cache(p->client_fd) == -1) {
-                    free(line_buffer);
-                    close(p->client_fd);
+                if (p->subscribe)
+                {
+                    if (_subscribe(p) == -1)
+                    {
+                        ASYNC_LOG(LOG_ERR, "subscription from %s failed", p->ipstr);
+                    }
                     free(p);
-                    perror("send()");
-                    pthread_mutex_unlock(&file_lock);
                     return;
                 }
+                if (p->report_offset)
+                {
+                    if (_send_offset(p) == -1)
+                    {
+                        perror("send()");
+                    }
+                    connected = 0;
+                    break;
+                }
+                if (p->filter_request)
+                {
+                    int sent;
+                    TRACE_SPAN("send filter", sent = _send_filter(p));
+                    if (sent == -1)
+                    {
+                        ASYNC_LOG(LOG_ERR, "filter request from %s failed", p->ipstr);
+                    }
+                    connected = 0;
+                    break;
+                }
+                if (p->lines_request)
+                {
+                    int sent;
+                    TRACE_SPAN("send lines", sent = _send_lines(p));
+                    if (sent == -1)
+                    {
+                        ASYNC_LOG(LOG_ERR, "line request from %s failed", p->ipstr);
+                    }
+                    connected = 0;
+                    break;
+                }
+                continue;
+            }
 
-                pthread_mutex_unlock(&file_lock);
-                // reset buffer
-                used_size = 0;
-                connected = 0;
-                break;
+            if (_commit_packet(p, &packet) == -1) {
+                buffer_chain_reset(&packet);
+                _client_close(p);
+                return;
             }
+
+            // reset buffer
+            buffer_chain_reset(&packet);
+            connected = 0;
+            break;
         }
     }
-    free(line_buffer);
-    close(p->client_fd);
-    syslog(LOG_USER, "Closed connection from %s:%d", p->ipstr, ntohs(p->cliaddr.sin_port));
-    free(p);
+    buffer_chain_reset(&packet);
+    ASYNC_LOG(LOG_INFO, "Closed connection from %s:%d", p->ipstr, p->port);
+    _client_close(p);
+}
+
+/* _sleep_while_running()
+ *   Sleep for seconds, returning early once shutdown starts
+ * out: 1 still running, 0 shutting down
+ */
+static int _sleep_while_running(int seconds)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+    pthread_mutex_lock(&run_lock);
+    while (RUN && pthread_cond_timedwait(&run_cond, &run_lock, &deadline) != ETIMEDOUT)
+    {
+    }
+    pthread_mutex_unlock(&run_lock);
+    return RUN;
+}
+
+static void _stop_running(void)
+{
+    pthread_mutex_lock(&run_lock);
+    RUN = 0;
+    pthread_cond_broadcast(&run_cond);
+    pthread_mutex_unlock(&run_lock);
 }
 
 void timestamp_task(void* arg)
 {
     ThreadPool* thread_pool = (ThreadPool*)arg;
-    while (RUN)
+    Channel** list = (Channel**)malloc(MAX_CHANNELS * sizeof(Channel*));
+    if (list == NULL)
+    {
+        ASYNC_LOG(LOG_ERR, "timestamp task failed to allocate its channel list");
+        return;
+    }
+    while (_sleep_while_running(10))
     {
-        sleep(10);
-        if (!RUN)
-        {
-            break;
-        }
         time_t rawtime;
         struct tm* timeinfo;
         time(&rawtime);
@@ -406,16 +1754,102 @@ void timestamp_task(void* arg)
         char buffer[20];
         strftime(buffer, sizeof(buffer), "%Y:%m:%d:%H:%M:%S", timeinfo);
         char timestamp[31];
-        snprintf(timestamp, sizeof(timestamp), "timestamp:%s\n", buffer);
+        int length = snprintf(timestamp, sizeof(timestamp), "timestamp:%s\n", buffer);
+        struct iovec iov = { .iov_base = timestamp, .iov_len = length };
 
-        pthread_mutex_lock(&thread_pool->m_lock);
+        profiled_mutex_lock(&thread_pool->m_lock);
         pool_cleanup(thread_pool->m_cleanup);
-        pthread_mutex_unlock(&thread_pool->m_lock);
+        profiled_mutex_unlock(&thread_pool->m_lock);
+
+        // followers receive the leader's timestamps and report their lag instead
+        if (leader_address != NULL)
+        {
+            follower_report_lag(&follower);
+            continue;
+        }
+
+        // every channel is a complete log, so each gets its own timestamps
+        profiled_mutex_lock(&default_channel.m_lock);
+        _append_history(&default_channel, &iov, 1, length);
+        profiled_mutex_unlock(&default_channel.m_lock);
+
+        // each append fsyncs, which must not hold up channel lookups
+        size_t count = _list_channels(list);
+        for (size_t i = 0; i < count; i++)
+        {
+            TRACE_SPAN("lock wait", profiled_mutex_lock(&list[i]->m_lock));
+            _append_history(list[i], &iov, 1, length);
+            profiled_mutex_unlock(&list[i]->m_lock);
+        }
+    }
+    free(list);
+}
+
+/* _apply_replicated()
+ *   Store bytes streamed from the leader's default channel, pushing them on
+ *   to this follower's own subscribers
+ * out: 0 success, -1 error
+ */
+static int _apply_replicated(const char* data, size_t size)
+{
+    struct iovec iov = { .iov_base = (void*)data, .iov_len = size };
+    profiled_mutex_lock(&default_channel.m_lock);
+    int status = _append_history(&default_channel, &iov, 1, size);
+    profiled_mutex_unlock(&default_channel.m_lock);
+    return status;
+}
+
+static uint64_t _replicated_offset(void)
+{
+    profiled_mutex_lock(&default_channel.m_lock);
+    uint64_t size = _history_size(&default_channel);
+    profiled_mutex_unlock(&default_channel.m_lock);
+    return size;
+}
+
+void replication_task(void* arg)
+{
+    follower_run((Follower*)arg);
+}
+
+/* _release_retained()
+ *   Punch out the segments that have left a channel's window, short of
+ *   whatever a running replay, filter or line request still reads
+ */
+static void _release_retained(Channel* channel)
+{
+    TRACE_SPAN("lock wait", profiled_mutex_lock(&channel->m_lock));
+    uint64_t upto = channel->m_retention.m_start;
+    if (persist_history && upto - upto % RETENTION_SEGMENT_SIZE > channel->m_retention.m_released)
+    {
+        // recovery must never verify records whose bytes were punched out
+        journal_checkpoint(&channel->m_journal);
+    }
+    profiled_mutex_unlock(&channel->m_lock);
 
-        pthread_mutex_lock(&file_lock);
-        _cache(CACHE_FILE, timestamp, sizeof(timestamp));
-        pthread_mutex_unlock(&file_lock);
+    retention_release(&channel->m_retention, channel->m_path, upto);
+}
+
+void retention_task(void* arg)
+{
+    (void)arg;
+    Channel** list = (Channel**)malloc(MAX_CHANNELS * sizeof(Channel*));
+    if (list == NULL)
+    {
+        ASYNC_LOG(LOG_ERR, "retention task failed to allocate its channel list");
+        return;
+    }
+    while (_sleep_while_running(RETENTION_INTERVAL))
+    {
+        _release_retained(&default_channel);
+        // checkpoints and hole punching must not hold up channel lookups
+        size_t count = _list_channels(list);
+        for (size_t i = 0; i < count; i++)
+        {
+            _release_retained(list[i]);
+        }
     }
+    free(list);
 }
 
 int main(int argc, char *argv[])
@@ -433,50 +1867,245 @@ int main(int argc, char *argv[])
         perror("sigaction(SIGINT)");
         return -1;
     }
+    if (sigaction(SIGUSR1, &new_action, NULL) != 0)
+    {
+        perror("sigaction(SIGUSR1)");
+        return -1;
+    }
+    // every thread inherits the blocked mask, so the handled signals only
+    // arrive while the accept loop waits in ppoll() with accept_mask
+    sigset_t handled, accept_mask;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGINT);
+    sigaddset(&handled, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &handled, &accept_mask) != 0)
+    {
+        fprintf(stderr, "pthread_sigmask() failed\n");
+        return -1;
+    }
 
     openlog(NULL, LOG_PID, LOG_USER);
     
-    int daemon = is_daemon(argc, argv);
-    int sock_fd = _setup("0.0.0.0", "9000", daemon);
+    int daemon = has_flag(argc, argv, "-d");
+    compress_history = has_flag(argc, argv, "-z");
+    persist_history = has_flag(argc, argv, "-p");
+    const char* memory_option = get_option(argc, argv, "-m");
+    if (memory_option != NULL)
+    {
+        memory_capacity = strtoull(memory_option, NULL, 10);
+        if (memory_capacity == 0)
+        {
+            fprintf(stderr, "-m expects the history arena size in bytes\n");
+            return -1;
+        }
+        if (compress_history || persist_history)
+        {
+            syslog(LOG_WARNING, "-m keeps history in memory only, ignoring -z and -p");
+            compress_history = 0;
+            persist_history = 0;
+        }
+    }
+    const char* bytes_option = get_option(argc, argv, "-B");
+    const char* lines_option = get_option(argc, argv, "-L");
+    const char* age_option = get_option(argc, argv, "-A");
+    retention_policy.m_max_bytes = bytes_option ? strtoull(bytes_option, NULL, 10) : 0;
+    retention_policy.m_max_lines = lines_option ? strtoull(lines_option, NULL, 10) : 0;
+    retention_policy.m_max_age = age_option ? (time_t)strtoll(age_option, NULL, 10) : 0;
+    retain_history = retention_enabled(&retention_policy);
+    if (retain_history && (compress_history || memory_capacity > 0))
+    {
+        // -m is bounded already and -z blocks are not released individually
+        syslog(LOG_WARNING, "retention applies to the plain history file only, ignoring -B, -L and -A");
+        retain_history = 0;
+    }
+    index_history = memory_capacity == 0 && !compress_history;
+    const char* path_option = get_option(argc, argv, "-o");
+    if (path_option != NULL)
+    {
+        history_path = path_option;
+    }
+    leader_address = get_option(argc, argv, "-r");
+    if (leader_address != NULL && memory_capacity > 0)
+    {
+        fprintf(stderr, "-r needs stable history offsets, which -m does not keep\n");
+        return -1;
+    }
+    const char* port = get_option(argc, argv, "-P");
+    if (port == NULL)
+    {
+        port = DEFAULT_PORT;
+    }
+    Listeners listeners;
+    memset(&listeners, 0, sizeof(listeners));
+
+    // -6 listens dual-stack on [::]:port, otherwise IPv4 only on 0.0.0.0:port
+    int sock_fd = has_flag(argc, argv, "-6") ? _setup(NULL, port, AF_INET6)
+                                             : _setup("0.0.0.0", port, AF_INET);
     if (sock_fd == -1) {
         perror("setup()");
         return -1;
     }
+    listeners.m_fds[listeners.m_count++] = sock_fd;
+
+    // -u <path> adds a Unix domain listener for producers on the same host
+    const char* unix_path = get_option(argc, argv, "-u");
+    if (unix_path != NULL) {
+        sock_fd = _setup_unix(unix_path, listeners.m_unix_path);
+        if (sock_fd == -1) {
+            // _setup_unix() has reported why
+            _close_listeners(&listeners);
+            return -1;
+        }
+        listeners.m_fds[listeners.m_count++] = sock_fd;
+    }
+
+    if (daemon)
+    {
+        daemonize();
+    }
+
+    // -t <path> records spans, written to path on SIGUSR1 and at shutdown
+    const char* trace_option = get_option(argc, argv, "-t");
+    if (trace_option != NULL)
+    {
+        trace_start(trace_option);
+    }
+
+    // the drainer thread must start after daemonize() forks; -l logs to a file instead of syslog
+    if (async_log_start(get_option(argc, argv, "-l")) != 0)
+    {
+        _close_listeners(&listeners);
+        return -1;
+    }
 
     ThreadPool* thread_pool;
     if (pool_make_thread_pool(&thread_pool) != 0)
     {
-        close(sock_fd);
+        _close_listeners(&listeners);
         perror("make_thread_pool()");
         return -1;
     }
 
-    pthread_mutex_init(&file_lock, NULL);
+    profiled_mutex_init(&channel_lock, "channel_lock", 0);
+    profiled_mutex_init(&clients_lock, "clients_lock", 0);
+    if (_channel_open(&default_channel, NULL) != 0)
+    {
+        _close_listeners(&listeners);
+        perror("channel_open()");
+        return -1;
+    }
 
     pool_dispatch(thread_pool, timestamp_task, thread_pool);
+    if (retain_history)
+    {
+        pool_dispatch(thread_pool, retention_task, NULL);
+    }
+    if (leader_address != NULL)
+    {
+        follower.m_leader = leader_address;
+        follower.m_apply = _apply_replicated;
+        follower.m_offset = _replicated_offset;
+        follower.m_run = &RUN;
+        pool_dispatch(thread_pool, replication_task, &follower);
+    }
+
+    struct pollfd pollfds[MAX_LISTENERS];
+    for (int i = 0; i < listeners.m_count; i++)
+    {
+        pollfds[i].fd = listeners.m_fds[i];
+        pollfds[i].events = POLLIN;
+    }
 
     while(RUN)
     {
+        if (dump_trace)
+        {
+            dump_trace = 0;
+            trace_dump();
+        }
+        if (ppoll(pollfds, listeners.m_count, NULL, &accept_mask) == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("ppoll()");
+            }
+            continue;
+        }
 
-        // accept new connection
-        ClientTaskParams* client_params = (ClientTaskParams*)malloc(sizeof(ClientTaskParams));
-        struct sockaddr_in cliaddr;
-        char ipstr[INET_ADDRSTRLEN];
-        client_params->client_fd = _accept(sock_fd, &client_params->cliaddr, client_params->ipstr);
-        if (client_params->client_fd >= 0)
+        // every listener type feeds the same client task
+        for (int i = 0; i < listeners.m_count; i++)
         {
-            pool_dispatch(thread_pool, client_task, (void*)client_params);
+            if (!(pollfds[i].revents & POLLIN))
+            {
+                continue;
+            }
+
+            // accept new connection
+            ClientTaskParams* client_params = (ClientTaskParams*)malloc(sizeof(ClientTaskParams));
+            if (client_params == NULL)
+            {
+                perror("malloc()");
+                continue;
+            }
+            client_params->compressed = 0;
+            client_params->framed = 0;
+            client_params->subscribe = 0;
+            client_params->subscribe_from = HISTORY_RETAINED;
+            client_params->report_offset = 0;
+            client_params->lines_request = 0;
+            client_params->lines_first = 0;
+            client_params->lines_last = 0;
+            client_params->filter_request = 0;
+            client_params->filter_len = 0;
+            client_params->thread_pool = thread_pool;
+            client_params->channel = &default_channel;
+            client_params->sock_fd = listeners.m_fds[i];
+            TRACE_SPAN("accept", client_params->client_fd = _accept(listeners.m_fds[i], &client_params->cliaddr,
+                                                                   client_params->ipstr, &client_params->port));
+            if (client_params->client_fd >= 0)
+            {
+                _client_track(client_params);
+                if (pool_dispatch(thread_pool, client_task, (void*)client_params) != 0)
+                {
+                    _client_close(client_params);
+                }
+            }
+            else
+            {
+                free(client_params);
+            }
         }
     }
     // add to signal handler
     printf("shutting down...");
-    close(sock_fd);  // Or continue with listen(), accept(), etc.
-    pthread_mutex_destroy(&file_lock);
-    if (remove(CACHE_FILE) == -1)
+    _close_listeners(&listeners);
+
+    // every task must have returned before the channels it uses are torn down
+    _stop_running();
+    _shutdown_clients();
+    pool_destroy_thread_pool(thread_pool);
+    profiled_mutex_destroy(&clients_lock);
+
+    int status = 0;
+    for (int i = 0; i < CHANNEL_BUCKETS; i++)
     {
-        perror("remove()");
-        return -1;
+        while (channels[i] != NULL)
+        {
+            Channel* channel = channels[i];
+            channels[i] = channel->m_next;
+            status |= _channel_close(channel);
+            free(channel);
+        }
+    }
+    status |= _channel_close(&default_channel);
+    profiled_mutex_destroy(&channel_lock);
+    trace_dump();
+    async_log_stop();
+    if (async_log_dropped() > 0)
+    {
+        fprintf(stderr, "log dropped %llu messages\n", (unsigned long long)async_log_dropped());
     }
     
-    return 0;
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,318 @@
+#include "async_log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// bytes of file output gathered into one write()
+#define ASYNC_LOG_BATCH_SIZE (64 * 1024)
+
+/*
+ * Header of each ring record, followed by m_length bytes of text and
+ * padding to the next 8 byte boundary
+ */
+typedef struct LogRecord {
+    uint32_t m_length;
+    int32_t m_level;
+    struct timespec m_time;
+} LogRecord;
+
+/*
+ * Single-producer single-consumer byte ring. m_head and m_tail only grow;
+ * the owning thread advances m_tail and the drainer m_head. A ring outlives
+ * its thread and is handed to the next thread that claims it, so rings are
+ * allocated once however many threads the pools start.
+ */
+typedef struct LogRing {
+    char* m_data;
+    uint64_t m_head;
+    uint64_t m_tail;
+    uint64_t m_dropped;
+    uint64_t m_reported;
+    int m_owned;
+} LogRing;
+
+static LogRing rings[ASYNC_LOG_MAX_RINGS];
+static __thread LogRing* thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+// messages from threads that found every ring claimed
+static uint64_t unowned_dropped;
+static uint64_t unowned_reported;
+
+static pthread_t drainer;
+static int running;
+static int log_fd = -1;
+static char batch[ASYNC_LOG_BATCH_SIZE];
+static size_t batch_used;
+
+static void _release_ring(void* arg)
+{
+    LogRing* ring = (LogRing*)arg;
+    __atomic_store_n(&ring->m_owned, 0, __ATOMIC_RELEASE);
+}
+
+static void _create_key(void)
+{
+    pthread_key_create(&ring_key, _release_ring);
+}
+
+/* _claim()
+ *   Give the calling thread a ring of its own until it exits
+ * out: ring, NULL if all are claimed or allocation failed
+ */
+static LogRing* _claim(void)
+{
+    pthread_once(&ring_key_once, _create_key);
+    for (int i = 0; i < ASYNC_LOG_MAX_RINGS; i++)
+    {
+        LogRing* ring = &rings[i];
+        int free_ring = 0;
+        if (__atomic_load_n(&ring->m_owned, __ATOMIC_RELAXED) ||
+            !__atomic_compare_exchange_n(&ring->m_owned, &free_ring, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+        if (ring->m_data == NULL)
+        {
+            char* data = (char*)malloc(ASYNC_LOG_RING_SIZE);
+            if (data == NULL)
+            {
+                __atomic_store_n(&ring->m_owned, 0, __ATOMIC_RELEASE);
+                return NULL;
+            }
+            __atomic_store_n(&ring->m_data, data, __ATOMIC_RELEASE);
+        }
+        pthread_setspecific(ring_key, ring);
+        thread_ring = ring;
+        return ring;
+    }
+    return NULL;
+}
+
+static void _copy_in(LogRing* ring, uint64_t position, const void* src, size_t size)
+{
+    size_t offset = position % ASYNC_LOG_RING_SIZE;
+    size_t first = ASYNC_LOG_RING_SIZE - offset < size ? ASYNC_LOG_RING_SIZE - offset : size;
+    memcpy(ring->m_data + offset, src, first);
+    memcpy(ring->m_data, (const char*)src + first, size - first);
+}
+
+static void _copy_out(const LogRing* ring, uint64_t position, void* dst, size_t size)
+{
+    size_t offset = position % ASYNC_LOG_RING_SIZE;
+    size_t first = ASYNC_LOG_RING_SIZE - offset < size ? ASYNC_LOG_RING_SIZE - offset : size;
+    memcpy(dst, ring->m_data + offset, first);
+    memcpy((char*)dst + first, ring->m_data, size - first);
+}
+
+static size_t _record_size(size_t length)
+{
+    return (sizeof(LogRecord) + length + 7) & ~(size_t)7;
+}
+
+/* async_log_write()
+ *   Queue a message on the calling thread's ring; never blocks
+ */
+void async_log_write(int level, const char* format, ...)
+{
+    LogRing* ring = thread_ring != NULL ? thread_ring : _claim();
+    if (ring == NULL)
+    {
+        __atomic_fetch_add(&unowned_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    char text[ASYNC_LOG_MESSAGE_MAX];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length < 0)
+    {
+        return;
+    }
+    length = (size_t)length < sizeof(text) ? length : (int)sizeof(text) - 1;
+
+    LogRecord record = { .m_length = length, .m_level = level };
+    clock_gettime(CLOCK_REALTIME, &record.m_time);
+    size_t size = _record_size(length);
+    uint64_t tail = ring->m_tail;
+    if (tail + size - __atomic_load_n(&ring->m_head, __ATOMIC_ACQUIRE) > ASYNC_LOG_RING_SIZE)
+    {
+        __atomic_store_n(&ring->m_dropped, ring->m_dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    _copy_in(ring, tail, &record, sizeof(record));
+    _copy_in(ring, tail + sizeof(record), text, length);
+    __atomic_store_n(&ring->m_tail, tail + size, __ATOMIC_RELEASE);
+}
+
+static void _flush(void)
+{
+    const char* data = batch;
+    while (batch_used > 0)
+    {
+        ssize_t written = write(log_fd, data, batch_used);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            // nowhere left to report it, the batch is lost
+            break;
+        }
+        data += written;
+        batch_used -= written;
+    }
+    batch_used = 0;
+}
+
+/* _emit()
+ *   Hand one message to syslog, or add it to the batch written to the file
+ */
+static void _emit(int level, const struct timespec* when, const char* text, size_t length)
+{
+    static const char* const names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+    if (log_fd == -1)
+    {
+        syslog(level, "%.*s", (int)length, text);
+        return;
+    }
+    if (ASYNC_LOG_BATCH_SIZE - batch_used < ASYNC_LOG_MESSAGE_MAX + 64)
+    {
+        _flush();
+    }
+    struct tm tm;
+    localtime_r(&when->tv_sec, &tm);
+    batch_used += strftime(batch + batch_used, ASYNC_LOG_BATCH_SIZE - batch_used, "%Y-%m-%d %H:%M:%S", &tm);
+    batch_used += snprintf(batch + batch_used, ASYNC_LOG_BATCH_SIZE - batch_used, ".%03ld %s %.*s\n",
+                           when->tv_nsec / 1000000, names[level & LOG_PRIMASK], (int)length, text);
+}
+
+static void _report_drops(uint64_t* reported, uint64_t dropped)
+{
+    if (dropped != *reported)
+    {
+        char text[64];
+        int length = snprintf(text, sizeof(text), "log dropped %llu messages", (unsigned long long)(dropped - *reported));
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        _emit(LOG_WARNING, &now, text, length);
+        *reported = dropped;
+    }
+}
+
+/* _drain()
+ *   Write out everything queued so far. Messages keep their order within a
+ *   thread; threads are drained one after another.
+ */
+static void _drain(void)
+{
+    char text[ASYNC_LOG_MESSAGE_MAX];
+    for (int i = 0; i < ASYNC_LOG_MAX_RINGS; i++)
+    {
+        LogRing* ring = &rings[i];
+        if (__atomic_load_n(&ring->m_data, __ATOMIC_ACQUIRE) == NULL)
+        {
+            continue;
+        }
+        uint64_t head = ring->m_head;
+        uint64_t tail = __atomic_load_n(&ring->m_tail, __ATOMIC_ACQUIRE);
+        while (head < tail)
+        {
+            LogRecord record;
+            _copy_out(ring, head, &record, sizeof(record));
+            _copy_out(ring, head + sizeof(record), text, record.m_length);
+            _emit(record.m_level, &record.m_time, text, record.m_length);
+            head += _record_size(record.m_length);
+        }
+        __atomic_store_n(&ring->m_head, head, __ATOMIC_RELEASE);
+        _report_drops(&ring->m_reported, __atomic_load_n(&ring->m_dropped, __ATOMIC_RELAXED));
+    }
+    _report_drops(&unowned_reported, __atomic_load_n(&unowned_dropped, __ATOMIC_RELAXED));
+    if (log_fd != -1)
+    {
+        _flush();
+    }
+}
+
+static void* _drainer_main(void* arg)
+{
+    (void)arg;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = ASYNC_LOG_DRAIN_MS * 1000000L };
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        _drain();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/* async_log_start()
+ *   Start the drainer. Messages go to path, appended, or to syslog if NULL.
+ *   Messages logged before the drainer starts are kept until it does.
+ * out: 0 success, -1 error
+ */
+int async_log_start(const char* path)
+{
+    if (path != NULL)
+    {
+        log_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (log_fd == -1)
+        {
+            perror("open()");
+            return -1;
+        }
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&drainer, NULL, _drainer_main, NULL) != 0)
+    {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        if (log_fd != -1)
+        {
+            close(log_fd);
+            log_fd = -1;
+        }
+        fprintf(stderr, "failed to start the log drainer\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* async_log_stop()
+ *   Stop the drainer after a last pass. Rings are not freed, since pool
+ *   threads still finishing may log into them.
+ */
+void async_log_stop(void)
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(drainer, NULL);
+    _drain();
+    if (log_fd != -1)
+    {
+        close(log_fd);
+        log_fd = -1;
+    }
+}
+
+uint64_t async_log_dropped(void)
+{
+    uint64_t dropped = __atomic_load_n(&unowned_dropped, __ATOMIC_RELAXED);
+    for (int i = 0; i < ASYNC_LOG_MAX_RINGS; i++)
+    {
+        dropped += __atomic_load_n(&rings[i].m_dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
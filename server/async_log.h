@@ -0,0 +1,48 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <stdint.h>
+#include <syslog.h>
+
+// most verbose syslog priority compiled in; build with LOG_LEVEL=7 for debug
+#ifndef ASYNC_LOG_LEVEL
+#define ASYNC_LOG_LEVEL LOG_INFO
+#endif
+
+// bytes buffered per thread before its messages are dropped
+#ifndef ASYNC_LOG_RING_SIZE
+#define ASYNC_LOG_RING_SIZE (64 * 1024)
+#endif
+
+// threads logging at once; further threads drop their messages
+#ifndef ASYNC_LOG_MAX_RINGS
+#define ASYNC_LOG_MAX_RINGS 256
+#endif
+
+// longer messages are truncated
+#define ASYNC_LOG_MESSAGE_MAX 512
+
+// milliseconds between drainer passes
+#define ASYNC_LOG_DRAIN_MS 50
+
+/*
+ * Log without blocking: the message is formatted into the calling thread's
+ * ring and written to syslog or a file by the drainer thread. A full ring
+ * drops the message and counts it. Messages less severe than
+ * ASYNC_LOG_LEVEL compile to nothing.
+ */
+#define ASYNC_LOG(level, ...)                          \
+    do                                                 \
+    {                                                  \
+        if ((level) <= ASYNC_LOG_LEVEL)                \
+        {                                              \
+            async_log_write((level), __VA_ARGS__);     \
+        }                                              \
+    } while (0)
+
+int async_log_start(const char* path);
+void async_log_stop(void);
+void async_log_write(int level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+uint64_t async_log_dropped(void);
+
+#endif // ASYNC_LOG_H
@@ -0,0 +1,454 @@
+#include "block_store.h"
+#include "error_handling.h"
+#include "lz.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// the tail file starts with the raw offset of its first byte
+#define TAIL_HEADER_SIZE sizeof(uint64_t)
+
+static char* _suffixed(const char* path, const char* suffix)
+{
+    size_t length = strlen(path) + strlen(suffix) + 1;
+    char* result = (char*)malloc(length);
+    if (result != NULL)
+    {
+        snprintf(result, length, "%s%s", path, suffix);
+    }
+    return result;
+}
+
+static int _write_all(int fd, const char* data, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            perror("pwrite()");
+            return -1;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+static int _read_all(int fd, char* data, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = pread(fd, data, size, offset);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return -1;
+        }
+        data += bytes;
+        size -= bytes;
+        offset += bytes;
+    }
+    return 0;
+}
+
+static int _send_all(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            perror("send()");
+            return -1;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+static int _push_index(BlockStore* store, const BlockIndexEntry* entry)
+{
+    if (store->m_count == store->m_capacity)
+    {
+        size_t capacity = store->m_capacity ? 2 * store->m_capacity : 64;
+        BlockIndexEntry* temp = (BlockIndexEntry*)realloc(store->m_index, capacity * sizeof(BlockIndexEntry));
+        if (temp == NULL)
+        {
+            RET_ERR("block index failed to grow");
+        }
+        store->m_index = temp;
+        store->m_capacity = capacity;
+    }
+    store->m_index[store->m_count++] = *entry;
+    return 0;
+}
+
+static int _reset_tail(BlockStore* store)
+{
+    uint64_t offset = store->m_raw_size;
+    if (ftruncate(store->m_tail_fd, 0) != 0 ||
+        _write_all(store->m_tail_fd, (const char*)&offset, sizeof(offset), 0) != 0 ||
+        fsync(store->m_tail_fd) != 0)
+    {
+        RET_ERR("tail file failed to reset");
+    }
+    store->m_tail_size = 0;
+    store->m_tail_persisted = 0;
+    return 0;
+}
+
+/* _load()
+ *   Rebuild the in-memory state from the index, data and tail files. Blocks
+ *   that were not completely indexed and stale tails left behind by a seal
+ *   that did not finish are discarded.
+ */
+static int _load(BlockStore* store)
+{
+    struct stat st;
+    if (fstat(store->m_index_fd, &st) != 0 || fstat(store->m_data_fd, &st) != 0)
+    {
+        RET_ERR("block store failed to stat");
+    }
+    uint64_t data_size = st.st_size;
+
+    BlockIndexEntry entry;
+    off_t offset = 0;
+    while (_read_all(store->m_index_fd, (char*)&entry, sizeof(entry), offset) == 0)
+    {
+        if (entry.m_file_offset + entry.m_stored_size > data_size || entry.m_raw_offset != store->m_raw_size)
+        {
+            break;
+        }
+        if (_push_index(store, &entry) != 0)
+        {
+            return -1;
+        }
+        store->m_raw_size += entry.m_raw_size;
+        store->m_file_size = entry.m_file_offset + entry.m_stored_size;
+        offset += sizeof(entry);
+    }
+    if (ftruncate(store->m_index_fd, offset) != 0 || ftruncate(store->m_data_fd, store->m_file_size) != 0)
+    {
+        RET_ERR("block store failed to truncate");
+    }
+
+    uint64_t tail_offset;
+    if (fstat(store->m_tail_fd, &st) != 0 ||
+        (size_t)st.st_size < TAIL_HEADER_SIZE ||
+        _read_all(store->m_tail_fd, (char*)&tail_offset, sizeof(tail_offset), 0) != 0 ||
+        tail_offset != store->m_raw_size)
+    {
+        return _reset_tail(store);
+    }
+
+    size_t tail_size = st.st_size - TAIL_HEADER_SIZE;
+    if (tail_size > BLOCK_STORE_BLOCK_SIZE)
+    {
+        tail_size = BLOCK_STORE_BLOCK_SIZE;
+    }
+    if (_read_all(store->m_tail_fd, store->m_tail, tail_size, TAIL_HEADER_SIZE) != 0)
+    {
+        return _reset_tail(store);
+    }
+    store->m_tail_size = tail_size;
+    store->m_tail_persisted = tail_size;
+    store->m_raw_size += tail_size;
+    return 0;
+}
+
+int block_store_open(BlockStore* store, const char* path)
+{
+    if (store == NULL || path == NULL)
+    {
+        RET_ERR("unexpected NULL");
+    }
+    memset(store, 0, sizeof(BlockStore));
+    store->m_data_fd = -1;
+    store->m_index_fd = -1;
+    store->m_tail_fd = -1;
+
+    store->m_path = strdup(path);
+    store->m_index_path = _suffixed(path, BLOCK_STORE_INDEX_SUFFIX);
+    store->m_tail_path = _suffixed(path, BLOCK_STORE_TAIL_SUFFIX);
+    store->m_tail = (char*)malloc(BLOCK_STORE_BLOCK_SIZE);
+    if (store->m_path == NULL || store->m_index_path == NULL || store->m_tail_path == NULL || store->m_tail == NULL)
+    {
+        block_store_close(store);
+        RET_ERR("block store failed to allocate");
+    }
+
+    store->m_data_fd = open(store->m_path, O_RDWR | O_CREAT, 0644);
+    store->m_index_fd = open(store->m_index_path, O_RDWR | O_CREAT, 0644);
+    store->m_tail_fd = open(store->m_tail_path, O_RDWR | O_CREAT, 0644);
+    if (store->m_data_fd == -1 || store->m_index_fd == -1 || store->m_tail_fd == -1)
+    {
+        block_store_close(store);
+        RET_ERR("block store failed to open");
+    }
+
+    if (_load(store) != 0)
+    {
+        block_store_close(store);
+        RET_ERR("block store failed to load");
+    }
+    return 0;
+}
+
+void block_store_close(BlockStore* store)
+{
+    if (store->m_data_fd != -1)
+    {
+        close(store->m_data_fd);
+    }
+    if (store->m_index_fd != -1)
+    {
+        close(store->m_index_fd);
+    }
+    if (store->m_tail_fd != -1)
+    {
+        close(store->m_tail_fd);
+    }
+    free(store->m_path);
+    free(store->m_index_path);
+    free(store->m_tail_path);
+    free(store->m_index);
+    free(store->m_tail);
+    memset(store, 0, sizeof(BlockStore));
+    store->m_data_fd = -1;
+    store->m_index_fd = -1;
+    store->m_tail_fd = -1;
+}
+
+int block_store_remove(BlockStore* store)
+{
+    int status = 0;
+    if (remove(store->m_path) == -1 || remove(store->m_index_path) == -1 || remove(store->m_tail_path) == -1)
+    {
+        perror("remove()");
+        status = -1;
+    }
+    block_store_close(store);
+    return status;
+}
+
+/* _seal()
+ *   Compress the full tail block and append it to the data file. The index
+ *   entry is only written once the block is durable.
+ */
+static int _seal(BlockStore* store)
+{
+    char compressed[LZ_COMPRESS_BOUND(BLOCK_STORE_BLOCK_SIZE)];
+    int stored = lz_compress(store->m_tail, store->m_tail_size, compressed, store->m_tail_size - 1);
+    const char* data = compressed;
+    if (stored <= 0)
+    {
+        data = store->m_tail;
+        stored = store->m_tail_size;
+    }
+
+    BlockIndexEntry entry;
+    entry.m_raw_offset = store->m_raw_size - store->m_tail_size;
+    entry.m_file_offset = store->m_file_size;
+    entry.m_raw_size = store->m_tail_size;
+    entry.m_stored_size = stored;
+
+    if (_write_all(store->m_data_fd, data, stored, entry.m_file_offset) != 0 || fsync(store->m_data_fd) != 0)
+    {
+        RET_ERR("block failed to write");
+    }
+    off_t index_offset = store->m_count * sizeof(BlockIndexEntry);
+    if (_write_all(store->m_index_fd, (const char*)&entry, sizeof(entry), index_offset) != 0 ||
+        fsync(store->m_index_fd) != 0)
+    {
+        RET_ERR("block index failed to write");
+    }
+    if (_push_index(store, &entry) != 0)
+    {
+        return -1;
+    }
+    store->m_file_size += stored;
+    return _reset_tail(store);
+}
+
+int block_store_append(BlockStore* store, const struct iovec* iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char* data = (const char*)iov[i].iov_base;
+        size_t size = iov[i].iov_len;
+        while (size > 0)
+        {
+            size_t room = BLOCK_STORE_BLOCK_SIZE - store->m_tail_size;
+            size_t count = size < room ? size : room;
+            memcpy(store->m_tail + store->m_tail_size, data, count);
+            store->m_tail_size += count;
+            store->m_raw_size += count;
+            data += count;
+            size -= count;
+
+            if (store->m_tail_size == BLOCK_STORE_BLOCK_SIZE && _seal(store) != 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    size_t pending = store->m_tail_size - store->m_tail_persisted;
+    if (pending > 0)
+    {
+        if (_write_all(store->m_tail_fd, store->m_tail + store->m_tail_persisted, pending,
+                       TAIL_HEADER_SIZE + store->m_tail_persisted) != 0 ||
+            fsync(store->m_tail_fd) != 0)
+        {
+            RET_ERR("tail failed to write");
+        }
+        store->m_tail_persisted = store->m_tail_size;
+    }
+    return 0;
+}
+
+/* block_store_snapshot()
+ *   Copy out what a replay starting at raw offset from needs, so the replay
+ *   itself can run without holding the caller's lock. Sealed blocks are
+ *   immutable, so only their index entries and the open tail are copied.
+ * out: 0 success, -1 error. blocks and tail must be freed by the caller.
+ */
+int block_store_snapshot(BlockStore* store, uint64_t from, BlockIndexEntry** blocks, size_t* count,
+                         char** tail, size_t* tail_size)
+{
+    // binary search for the first block holding bytes at or after from
+    size_t lo = 0;
+    size_t hi = store->m_count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (store->m_index[mid].m_raw_offset + store->m_index[mid].m_raw_size <= from)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    uint64_t tail_offset = store->m_raw_size - store->m_tail_size;
+    size_t skip = from > tail_offset ? from - tail_offset : 0;
+    if (skip > store->m_tail_size)
+    {
+        skip = store->m_tail_size;
+    }
+
+    *count = store->m_count - lo;
+    *tail_size = store->m_tail_size - skip;
+    *blocks = (BlockIndexEntry*)malloc((*count ? *count : 1) * sizeof(BlockIndexEntry));
+    *tail = (char*)malloc(*tail_size ? *tail_size : 1);
+    if (*blocks == NULL || *tail == NULL)
+    {
+        free(*blocks);
+        free(*tail);
+        RET_ERR("replay snapshot failed to allocate");
+    }
+    memcpy(*blocks, store->m_index + lo, *count * sizeof(BlockIndexEntry));
+    memcpy(*tail, store->m_tail + skip, *tail_size);
+    return 0;
+}
+
+int block_store_send_frame(int fd, const char* data, uint32_t raw_size, uint32_t stored_size)
+{
+    uint32_t header[2] = { htonl(raw_size), htonl(stored_size) };
+    if (_send_all(fd, (const char*)header, sizeof(header)) != 0)
+    {
+        return -1;
+    }
+    return _send_all(fd, data, stored_size);
+}
+
+/* block_store_replay()
+ *   Send history from raw offset from. Compressed clients receive whole
+ *   sealed blocks as stored, framed by (raw size, stored size) and terminated
+ *   by an empty frame; other clients receive the decompressed bytes.
+ * out: 0 success, -1 error
+ */
+int block_store_replay(const char* path, uint64_t from, const BlockIndexEntry* blocks, size_t count,
+                       const char* tail, size_t tail_size, int fd, int compressed)
+{
+    int data_fd = open(path, O_RDONLY);
+    if (data_fd == -1)
+    {
+        perror("open()");
+        return -1;
+    }
+
+    char* stored = (char*)malloc(BLOCK_STORE_BLOCK_SIZE);
+    char* raw = (char*)malloc(BLOCK_STORE_BLOCK_SIZE);
+    int status = stored != NULL && raw != NULL ? 0 : -1;
+
+    for (size_t i = 0; i < count && status == 0; i++)
+    {
+        const BlockIndexEntry* block = &blocks[i];
+        if (_read_all(data_fd, stored, block->m_stored_size, block->m_file_offset) != 0)
+        {
+            fprintf(stderr, "block at %llu failed to read\n", (unsigned long long)block->m_file_offset);
+            status = -1;
+            break;
+        }
+
+        if (compressed)
+        {
+            status = block_store_send_frame(fd, stored, block->m_raw_size, block->m_stored_size);
+            continue;
+        }
+
+        const char* data = stored;
+        if (block->m_stored_size != block->m_raw_size)
+        {
+            if (lz_decompress(stored, block->m_stored_size, raw, BLOCK_STORE_BLOCK_SIZE) != (int)block->m_raw_size)
+            {
+                fprintf(stderr, "block at %llu is corrupt\n", (unsigned long long)block->m_file_offset);
+                status = -1;
+                break;
+            }
+            data = raw;
+        }
+        size_t skip = from > block->m_raw_offset ? from - block->m_raw_offset : 0;
+        status = _send_all(fd, data + skip, block->m_raw_size - skip);
+    }
+    close(data_fd);
+    free(stored);
+    free(raw);
+
+    if (status == 0 && compressed)
+    {
+        status = block_store_send_frame(fd, tail, tail_size, tail_size);
+        if (status == 0 && tail_size > 0)
+        {
+            status = block_store_send_frame(fd, NULL, 0, 0);
+        }
+    }
+    else if (status == 0)
+    {
+        status = _send_all(fd, tail, tail_size);
+    }
+    return status;
+}
@@ -0,0 +1,57 @@
+#ifndef BLOCK_STORE_H
+#define BLOCK_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// raw bytes per compressed block
+#define BLOCK_STORE_BLOCK_SIZE (64 * 1024)
+
+#define BLOCK_STORE_INDEX_SUFFIX ".idx"
+#define BLOCK_STORE_TAIL_SUFFIX ".tail"
+
+/*
+ * One sealed block. Blocks whose compressed form would not be smaller are
+ * stored raw, which is marked by m_stored_size == m_raw_size.
+ */
+typedef struct BlockIndexEntry {
+    uint64_t m_raw_offset;
+    uint64_t m_file_offset;
+    uint32_t m_raw_size;
+    uint32_t m_stored_size;
+} BlockIndexEntry;
+
+/*
+ * History stored as independently compressed blocks. The block being filled
+ * is kept uncompressed in memory and mirrored to the tail file so that every
+ * append is durable before it is sealed.
+ */
+typedef struct BlockStore {
+    char* m_path;
+    char* m_index_path;
+    char* m_tail_path;
+    int m_data_fd;
+    int m_index_fd;
+    int m_tail_fd;
+    BlockIndexEntry* m_index;
+    size_t m_count;
+    size_t m_capacity;
+    uint64_t m_raw_size;
+    uint64_t m_file_size;
+    char* m_tail;
+    size_t m_tail_size;
+    size_t m_tail_persisted;
+} BlockStore;
+
+int block_store_open(BlockStore* store, const char* path);
+void block_store_close(BlockStore* store);
+int block_store_remove(BlockStore* store);
+int block_store_append(BlockStore* store, const struct iovec* iov, int iovcnt);
+int block_store_snapshot(BlockStore* store, uint64_t from, BlockIndexEntry** blocks, size_t* count,
+                         char** tail, size_t* tail_size);
+int block_store_replay(const char* path, uint64_t from, const BlockIndexEntry* blocks, size_t count,
+                       const char* tail, size_t tail_size, int fd, int compressed);
+int block_store_send_frame(int fd, const char* data, uint32_t raw_size, uint32_t stored_size);
+
+#endif // BLOCK_STORE_H
@@ -0,0 +1,224 @@
+#include "buffer_pool.h"
+#include "error_handling.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static const size_t CLASS_SIZES[BUFFER_POOL_NUM_CLASSES] = { 1024, 4096, 64 * 1024, 1024 * 1024 };
+
+// blocks kept per thread before spilling into the shared depot
+static const int LOCAL_LIMIT[BUFFER_POOL_NUM_CLASSES] = { 16, 8, 4, 1 };
+
+// blocks kept in the shared depot before returning memory to the heap
+static const int DEPOT_LIMIT[BUFFER_POOL_NUM_CLASSES] = { 256, 64, 16, 4 };
+
+typedef struct BufferCache {
+    BufferBlock* m_free[BUFFER_POOL_NUM_CLASSES];
+    int m_count[BUFFER_POOL_NUM_CLASSES];
+} BufferCache;
+
+static __thread BufferCache t_cache;
+static __thread int t_registered = 0;
+
+// client threads are short lived, so their caches drain here on exit
+static BufferCache g_depot;
+static pthread_mutex_t g_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_cache_key;
+static pthread_once_t g_cache_once = PTHREAD_ONCE_INIT;
+
+static void _push(BufferCache* cache, BufferBlock* block)
+{
+    block->m_next = cache->m_free[block->m_class];
+    cache->m_free[block->m_class] = block;
+    cache->m_count[block->m_class]++;
+}
+
+static BufferBlock* _pop(BufferCache* cache, int size_class)
+{
+    BufferBlock* block = cache->m_free[size_class];
+    if (block != NULL)
+    {
+        cache->m_free[size_class] = block->m_next;
+        cache->m_count[size_class]--;
+    }
+    return block;
+}
+
+static void _depot_release(BufferBlock* block)
+{
+    pthread_mutex_lock(&g_depot_lock);
+    if (g_depot.m_count[block->m_class] < DEPOT_LIMIT[block->m_class])
+    {
+        _push(&g_depot, block);
+        block = NULL;
+    }
+    pthread_mutex_unlock(&g_depot_lock);
+    free(block);
+}
+
+static void _flush_thread_cache(void* arg)
+{
+    BufferCache* cache = (BufferCache*)arg;
+    for (int i = 0; i < BUFFER_POOL_NUM_CLASSES; i++)
+    {
+        BufferBlock* block;
+        while ((block = _pop(cache, i)) != NULL)
+        {
+            _depot_release(block);
+        }
+    }
+}
+
+static void _make_key(void)
+{
+    if (pthread_key_create(&g_cache_key, _flush_thread_cache) != 0)
+    {
+        fprintf(stderr, "buffer pool failed to create thread cache key\n");
+    }
+}
+
+static void _register_thread(void)
+{
+    if (t_registered)
+    {
+        return;
+    }
+    pthread_once(&g_cache_once, _make_key);
+    if (pthread_setspecific(g_cache_key, &t_cache) == 0)
+    {
+        t_registered = 1;
+    }
+}
+
+size_t buffer_pool_class_size(int size_class)
+{
+    if (size_class < 0 || size_class >= BUFFER_POOL_NUM_CLASSES)
+    {
+        return 0;
+    }
+    return CLASS_SIZES[size_class];
+}
+
+int buffer_pool_acquire(int size_class, BufferBlock** block)
+{
+    if (block == NULL || size_class < 0 || size_class >= BUFFER_POOL_NUM_CLASSES)
+    {
+        RET_ERR("invalid buffer class");
+    }
+
+    _register_thread();
+
+    *block = _pop(&t_cache, size_class);
+    if (*block == NULL)
+    {
+        pthread_mutex_lock(&g_depot_lock);
+        *block = _pop(&g_depot, size_class);
+        pthread_mutex_unlock(&g_depot_lock);
+    }
+    if (*block == NULL)
+    {
+        *block = (BufferBlock*)malloc(sizeof(BufferBlock) + CLASS_SIZES[size_class]);
+        if (*block == NULL)
+        {
+            RET_ERR("buffer block failed to allocate");
+        }
+        (*block)->m_class = size_class;
+        (*block)->m_capacity = CLASS_SIZES[size_class];
+    }
+    (*block)->m_next = NULL;
+    (*block)->m_size = 0;
+    return 0;
+}
+
+void buffer_pool_release(BufferBlock* block)
+{
+    if (block == NULL)
+    {
+        return;
+    }
+    if (t_registered && t_cache.m_count[block->m_class] < LOCAL_LIMIT[block->m_class])
+    {
+        _push(&t_cache, block);
+        return;
+    }
+    _depot_release(block);
+}
+
+void buffer_chain_init(BufferChain* chain)
+{
+    chain->m_head = NULL;
+    chain->m_tail = NULL;
+    chain->m_size = 0;
+    chain->m_blocks = 0;
+}
+
+int buffer_chain_append(BufferChain* chain, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        if (chain->m_tail == NULL || chain->m_tail->m_size == chain->m_tail->m_capacity)
+        {
+            // each new block steps up one size class until the largest
+            int size_class = chain->m_blocks < BUFFER_POOL_NUM_CLASSES ? chain->m_blocks : BUFFER_POOL_NUM_CLASSES - 1;
+            BufferBlock* block;
+            if (buffer_pool_acquire(size_class, &block) != 0)
+            {
+                RET_ERR("chain failed to grow");
+            }
+            if (chain->m_tail == NULL)
+            {
+                chain->m_head = block;
+            }
+            else
+            {
+                chain->m_tail->m_next = block;
+            }
+            chain->m_tail = block;
+            chain->m_blocks++;
+        }
+
+        BufferBlock* tail = chain->m_tail;
+        size_t room = tail->m_capacity - tail->m_size;
+        size_t count = size < room ? size : room;
+        memcpy(tail->m_data + tail->m_size, data, count);
+        tail->m_size += count;
+        chain->m_size += count;
+        data += count;
+        size -= count;
+    }
+    return 0;
+}
+
+/* buffer_chain_iovec()
+ *   Describe the chain contents without copying
+ * in: iov: array with room for at least chain->m_blocks entries
+ * out: number of entries filled, -1 error
+ */
+int buffer_chain_iovec(BufferChain* chain, struct iovec* iov, int iovcnt)
+{
+    if (chain == NULL || iov == NULL || iovcnt < chain->m_blocks)
+    {
+        RET_ERR("iovec too small for chain");
+    }
+    int count = 0;
+    for (BufferBlock* block = chain->m_head; block != NULL; block = block->m_next)
+    {
+        iov[count].iov_base = block->m_data;
+        iov[count].iov_len = block->m_size;
+        count++;
+    }
+    return count;
+}
+
+void buffer_chain_reset(BufferChain* chain)
+{
+    BufferBlock* block = chain->m_head;
+    while (block != NULL)
+    {
+        BufferBlock* next = block->m_next;
+        buffer_pool_release(block);
+        block = next;
+    }
+    buffer_chain_init(chain);
+}
@@ -0,0 +1,38 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// size classes: 1K, 4K, 64K, 1M
+#define BUFFER_POOL_NUM_CLASSES 4
+
+typedef struct BufferBlock {
+    struct BufferBlock* m_next;
+    size_t m_capacity;
+    size_t m_size;
+    int m_class;
+    char m_data[];
+} BufferBlock;
+
+/*
+ * A packet under construction. Blocks are chained rather than reallocated,
+ * so growing the packet never copies bytes that were already received.
+ */
+typedef struct BufferChain {
+    BufferBlock* m_head;
+    BufferBlock* m_tail;
+    size_t m_size;
+    int m_blocks;
+} BufferChain;
+
+int buffer_pool_acquire(int size_class, BufferBlock** block);
+void buffer_pool_release(BufferBlock* block);
+size_t buffer_pool_class_size(int size_class);
+
+void buffer_chain_init(BufferChain* chain);
+int buffer_chain_append(BufferChain* chain, const char* data, size_t size);
+int buffer_chain_iovec(BufferChain* chain, struct iovec* iov, int iovcnt);
+void buffer_chain_reset(BufferChain* chain);
+
+#endif // BUFFER_POOL_H
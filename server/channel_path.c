@@ -0,0 +1,24 @@
+#include "channel_path.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* channel_path()
+ *   Path of a channel's history file
+ * in: name: channel name, NULL for the default channel
+ * out: allocated path, NULL if allocation failed
+ */
+char* channel_path(const char* history_path, const char* name)
+{
+    if (name == NULL)
+    {
+        return strdup(history_path);
+    }
+    size_t length = strlen(history_path) + strlen(CHANNEL_PATH_INFIX) + strlen(name) + 1;
+    char* path = (char*)malloc(length);
+    if (path != NULL)
+    {
+        snprintf(path, length, "%s%s%s", history_path, CHANNEL_PATH_INFIX, name);
+    }
+    return path;
+}
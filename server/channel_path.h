@@ -0,0 +1,14 @@
+#ifndef CHANNEL_PATH_H
+#define CHANNEL_PATH_H
+
+/*
+ * Named channels live at <history>.ch-<name>. Names are [A-Za-z0-9_-], so
+ * the infix keeps them apart from the sidecar files the storage modules
+ * keep beside the default channel (<history>.lines, .journal, .ckpt, .idx,
+ * .tail), and a channel's own sidecars from every other channel.
+ */
+#define CHANNEL_PATH_INFIX ".ch-"
+
+char* channel_path(const char* history_path, const char* name);
+
+#endif // CHANNEL_PATH_H
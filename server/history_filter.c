@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include "history_filter.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct FilterJob;
+
+/*
+ * One window slot. A chunk owns every line that starts inside
+ * [m_begin, m_end); its matching lines are packed to the front of m_buffer.
+ */
+typedef struct FilterChunk {
+    struct FilterJob* m_job;
+    uint64_t m_begin;
+    uint64_t m_end;
+    char* m_buffer;
+    size_t m_capacity;
+    size_t m_matched;
+    int m_status;
+    int m_done;
+} FilterChunk;
+
+typedef struct FilterJob {
+    const SearchPattern* m_pattern;
+    const FilterSource* m_source;
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_done;
+    FilterChunk m_chunks[FILTER_MAX_WINDOW];
+} FilterJob;
+
+/* _read()
+ *   Read size bytes of history at offset
+ * out: 0 success, -1 error or short read
+ */
+static int _read(const FilterSource* source, char* dst, size_t size, uint64_t offset)
+{
+    if (source->m_fd == -1)
+    {
+        memcpy(dst, source->m_data + offset, size);
+        return 0;
+    }
+    while (size > 0)
+    {
+        ssize_t bytes = pread(source->m_fd, dst, size, offset);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return -1;
+        }
+        dst += bytes;
+        size -= bytes;
+        offset += bytes;
+    }
+    return 0;
+}
+
+static int _reserve(FilterChunk* chunk, size_t size)
+{
+    if (size <= chunk->m_capacity)
+    {
+        return 0;
+    }
+    size_t capacity = chunk->m_capacity ? chunk->m_capacity : FILTER_CHUNK_SIZE;
+    while (capacity < size)
+    {
+        capacity *= 2;
+    }
+    char* buffer = (char*)realloc(chunk->m_buffer, capacity);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    chunk->m_buffer = buffer;
+    chunk->m_capacity = capacity;
+    return 0;
+}
+
+/* _load()
+ *   Read the lines a chunk owns. The byte before the chunk tells whether
+ *   its first line started in the previous chunk, and the last line is read
+ *   on to its newline even past the chunk end.
+ * out: offset of the first owned line in m_buffer, bytes loaded in *length,
+ *      -1 error
+ */
+static ssize_t _load(FilterChunk* chunk, size_t* length)
+{
+    const FilterSource* source = chunk->m_job->m_source;
+    uint64_t start = chunk->m_begin > source->m_begin ? chunk->m_begin - 1 : chunk->m_begin;
+    *length = chunk->m_end - start;
+    if (_reserve(chunk, *length) != 0 || _read(source, chunk->m_buffer, *length, start) != 0)
+    {
+        return -1;
+    }
+
+    size_t first = 0;
+    if (start < chunk->m_begin)
+    {
+        const char* newline = memchr(chunk->m_buffer, '\n', *length);
+        if (newline == NULL)
+        {
+            // a line longer than the chunk, owned by an earlier chunk
+            return *length;
+        }
+        first = newline - chunk->m_buffer + 1;
+    }
+    while (*length > first && chunk->m_buffer[*length - 1] != '\n' && start + *length < source->m_end)
+    {
+        size_t more = source->m_end - (start + *length);
+        more = more < FILTER_CHUNK_SIZE ? more : FILTER_CHUNK_SIZE;
+        if (_reserve(chunk, *length + more) != 0 ||
+            _read(source, chunk->m_buffer + *length, more, start + *length) != 0)
+        {
+            return -1;
+        }
+        // only the new bytes can hold the newline
+        const char* newline = memchr(chunk->m_buffer + *length, '\n', more);
+        *length = newline ? (size_t)(newline - chunk->m_buffer) + 1 : *length + more;
+    }
+    return first;
+}
+
+/* _scan_chunk()
+ *   Pool task: pack the chunk's matching lines to the front of its buffer.
+ *   A match jumps straight to the end of its line, so lines without one are
+ *   only touched by the search kernel.
+ */
+static void _scan_chunk(void* arg)
+{
+    FilterChunk* chunk = (FilterChunk*)arg;
+    FilterJob* job = chunk->m_job;
+    size_t length = 0;
+    ssize_t first = _load(chunk, &length);
+    size_t matched = 0;
+    if (first >= 0)
+    {
+        const char* data = chunk->m_buffer + first;
+        const char* end = chunk->m_buffer + length;
+        const char* match;
+        while (data < end && (match = search_pattern_find(job->m_pattern, data, end - data)) != NULL)
+        {
+            const char* line = memrchr(data, '\n', match - data);
+            line = line ? line + 1 : data;
+            const char* newline = memchr(match, '\n', end - match);
+            data = newline ? newline + 1 : end;
+            memmove(chunk->m_buffer + matched, line, data - line);
+            matched += data - line;
+        }
+    }
+
+    pthread_mutex_lock(&job->m_lock);
+    chunk->m_matched = matched;
+    chunk->m_status = first >= 0 ? 0 : -1;
+    chunk->m_done = 1;
+    pthread_cond_broadcast(&job->m_done);
+    pthread_mutex_unlock(&job->m_lock);
+}
+
+static void _dispatch(ThreadPool* pool, FilterChunk* chunk, uint64_t begin, uint64_t end)
+{
+    chunk->m_begin = begin;
+    chunk->m_end = end;
+    chunk->m_done = 0;
+    if (pool_dispatch(pool, _scan_chunk, chunk) != 0)
+    {
+        // no thread to spare, scan on the caller's
+        _scan_chunk(chunk);
+    }
+}
+
+static int _send_all(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+/* history_filter_send()
+ *   Send every history line containing the pattern, in history order. Up to
+ *   one chunk per CPU is scanned on the pool while the oldest finished chunk
+ *   is sent, so matches stream out as the scan proceeds.
+ * out: 0 success, -1 error
+ */
+int history_filter_send(ThreadPool* pool, const SearchPattern* pattern, const FilterSource* source, int client_fd)
+{
+    FilterJob* job = (FilterJob*)calloc(1, sizeof(FilterJob));
+    if (job == NULL)
+    {
+        return -1;
+    }
+    job->m_pattern = pattern;
+    job->m_source = source;
+    pthread_mutex_init(&job->m_lock, NULL);
+    pthread_cond_init(&job->m_done, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t window = cpus < 1 ? 1 : cpus > FILTER_MAX_WINDOW ? FILTER_MAX_WINDOW : (size_t)cpus;
+    size_t dispatched = 0;
+    uint64_t next = source->m_begin;
+    for (; dispatched < window && next < source->m_end; dispatched++)
+    {
+        FilterChunk* chunk = &job->m_chunks[dispatched];
+        chunk->m_job = job;
+        uint64_t end = source->m_end - next > FILTER_CHUNK_SIZE ? next + FILTER_CHUNK_SIZE : source->m_end;
+        _dispatch(pool, chunk, next, end);
+        next = end;
+    }
+
+    // after a failure keep collecting, every dispatched chunk must finish
+    // before the job is freed
+    int status = 0;
+    for (size_t i = 0; i < dispatched; i++)
+    {
+        FilterChunk* chunk = &job->m_chunks[i % window];
+        pthread_mutex_lock(&job->m_lock);
+        while (!chunk->m_done)
+        {
+            pthread_cond_wait(&job->m_done, &job->m_lock);
+        }
+        pthread_mutex_unlock(&job->m_lock);
+
+        if (status == 0 && chunk->m_status != 0)
+        {
+            syslog(LOG_ERR, "filter failed to read history at offset %llu", (unsigned long long)chunk->m_begin);
+            status = -1;
+        }
+        if (status == 0)
+        {
+            status = _send_all(client_fd, chunk->m_buffer, chunk->m_matched);
+        }
+        if (status == 0 && next < source->m_end)
+        {
+            uint64_t end = source->m_end - next > FILTER_CHUNK_SIZE ? next + FILTER_CHUNK_SIZE : source->m_end;
+            _dispatch(pool, chunk, next, end);
+            next = end;
+            dispatched++;
+        }
+    }
+
+    for (size_t i = 0; i < window; i++)
+    {
+        free(job->m_chunks[i].m_buffer);
+    }
+    pthread_cond_destroy(&job->m_done);
+    pthread_mutex_destroy(&job->m_lock);
+    free(job);
+    return status;
+}
@@ -0,0 +1,32 @@
+#ifndef HISTORY_FILTER_H
+#define HISTORY_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "search.h"
+#include "thread_pool_dynamic.h"
+
+#define FILTER_HEADER "FILTER:"
+
+// bytes of history one pool task scans
+#ifndef FILTER_CHUNK_SIZE
+#define FILTER_CHUNK_SIZE (1024 * 1024)
+#endif
+
+// chunks scanned ahead of the one being sent, at most one per CPU
+#define FILTER_MAX_WINDOW 8
+
+/*
+ * History bytes [m_begin, m_end) to filter, read from the history file
+ * m_fd, or from m_data (indexed by offset) when m_fd is -1
+ */
+typedef struct FilterSource {
+    int m_fd;
+    const char* m_data;
+    uint64_t m_begin;
+    uint64_t m_end;
+} FilterSource;
+
+int history_filter_send(ThreadPool* pool, const SearchPattern* pattern, const FilterSource* source, int client_fd);
+
+#endif // HISTORY_FILTER_H
@@ -0,0 +1,348 @@
+#include "journal.h"
+#include "error_handling.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define JOURNAL_READ_SIZE (64 * 1024)
+
+// largest record created when adopting an unjournaled history file
+#define JOURNAL_ADOPT_SIZE (64 * 1024 * 1024)
+
+static uint32_t crc_table[256];
+static int crc_ready = 0;
+
+static void _crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+    crc_ready = 1;
+}
+
+static uint32_t _crc_update(uint32_t crc, const char* data, size_t size)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = crc_table[(crc ^ (unsigned char)data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static char* _suffixed(const char* path, const char* suffix)
+{
+    size_t length = strlen(path) + strlen(suffix) + 1;
+    char* result = (char*)malloc(length);
+    if (result != NULL)
+    {
+        snprintf(result, length, "%s%s", path, suffix);
+    }
+    return result;
+}
+
+static int _pwrite_all(int fd, const char* data, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, data, size, offset);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            perror("pwrite()");
+            return -1;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+static uint32_t _checkpoint_checksum(const JournalCheckpoint* checkpoint)
+{
+    return _crc_update(0, (const char*)checkpoint, offsetof(JournalCheckpoint, m_checksum));
+}
+
+/* _verify()
+ *   Check a journal record against the bytes in the history file
+ * out: 0 valid, -1 torn or corrupt
+ */
+static int _verify(int data_fd, uint64_t data_file_size, const JournalRecord* record, char* scratch)
+{
+    if (record->m_offset + record->m_length > data_file_size)
+    {
+        return -1;
+    }
+    uint32_t crc = 0;
+    uint64_t offset = record->m_offset;
+    size_t remaining = record->m_length;
+    while (remaining > 0)
+    {
+        size_t count = remaining < JOURNAL_READ_SIZE ? remaining : JOURNAL_READ_SIZE;
+        ssize_t bytes = pread(data_fd, scratch, count, offset);
+        if (bytes <= 0)
+        {
+            return -1;
+        }
+        crc = _crc_update(crc, scratch, bytes);
+        offset += bytes;
+        remaining -= bytes;
+    }
+    return crc == record->m_checksum ? 0 : -1;
+}
+
+/* _recover()
+ *   Start from the last checkpoint, verify only the records appended after
+ *   it and truncate the journal and history file after the last good record.
+ */
+static int _recover(Journal* journal, int data_fd)
+{
+    struct stat st;
+    if (fstat(data_fd, &st) != 0)
+    {
+        RET_ERR("history file failed to stat");
+    }
+    uint64_t data_file_size = st.st_size;
+
+    JournalCheckpoint checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    int checkpoint_fd = open(journal->m_checkpoint_path, O_RDONLY);
+    if (checkpoint_fd != -1)
+    {
+        if (read(checkpoint_fd, &checkpoint, sizeof(checkpoint)) != sizeof(checkpoint) ||
+            checkpoint.m_checksum != _checkpoint_checksum(&checkpoint) ||
+            checkpoint.m_data_size > data_file_size)
+        {
+            fprintf(stderr, "ignoring invalid checkpoint %s\n", journal->m_checkpoint_path);
+            memset(&checkpoint, 0, sizeof(checkpoint));
+        }
+        close(checkpoint_fd);
+    }
+
+    if (fstat(journal->m_journal_fd, &st) != 0)
+    {
+        RET_ERR("journal failed to stat");
+    }
+    if ((uint64_t)st.st_size < checkpoint.m_journal_size)
+    {
+        memset(&checkpoint, 0, sizeof(checkpoint));
+    }
+
+    char* scratch = (char*)malloc(JOURNAL_READ_SIZE);
+    if (scratch == NULL)
+    {
+        RET_ERR("journal failed to allocate");
+    }
+
+    // history written before journaling was enabled is adopted as is
+    if (st.st_size == 0 && data_file_size > 0)
+    {
+        memset(&checkpoint, 0, sizeof(checkpoint));
+        JournalRecord record = { 0, 0, 0 };
+        while (record.m_offset < data_file_size)
+        {
+            ssize_t bytes = pread(data_fd, scratch, JOURNAL_READ_SIZE, record.m_offset + record.m_length);
+            if (bytes > 0)
+            {
+                record.m_checksum = _crc_update(record.m_checksum, scratch, bytes);
+                record.m_length += bytes;
+            }
+            if (bytes <= 0 || record.m_length >= JOURNAL_ADOPT_SIZE || record.m_offset + record.m_length == data_file_size)
+            {
+                if (record.m_length == 0 ||
+                    _pwrite_all(journal->m_journal_fd, (const char*)&record, sizeof(record), st.st_size) != 0)
+                {
+                    break;
+                }
+                st.st_size += sizeof(record);
+                record.m_offset += record.m_length;
+                record.m_length = 0;
+                record.m_checksum = 0;
+            }
+        }
+    }
+
+    uint64_t journal_size = checkpoint.m_journal_size;
+    uint64_t data_size = checkpoint.m_data_size;
+    size_t recovered = 0;
+    JournalRecord record;
+    while (journal_size + sizeof(record) <= (uint64_t)st.st_size)
+    {
+        if (pread(journal->m_journal_fd, &record, sizeof(record), journal_size) != sizeof(record) ||
+            record.m_offset != data_size ||
+            _verify(data_fd, data_file_size, &record, scratch) != 0)
+        {
+            break;
+        }
+        journal_size += sizeof(record);
+        data_size += record.m_length;
+        recovered++;
+    }
+    free(scratch);
+
+    if ((uint64_t)st.st_size != journal_size || data_file_size != data_size)
+    {
+        fprintf(stderr, "truncating torn history: journal %llu -> %llu, data %llu -> %llu\n",
+                (unsigned long long)st.st_size, (unsigned long long)journal_size,
+                (unsigned long long)data_file_size, (unsigned long long)data_size);
+    }
+    if (ftruncate(journal->m_journal_fd, journal_size) != 0 || ftruncate(data_fd, data_size) != 0)
+    {
+        RET_ERR("journal failed to truncate");
+    }
+    if (fsync(journal->m_journal_fd) != 0 || fsync(data_fd) != 0)
+    {
+        RET_ERR("journal failed to sync");
+    }
+
+    journal->m_journal_size = journal_size;
+    journal->m_data_size = data_size;
+    journal->m_since_checkpoint = recovered;
+    return 0;
+}
+
+int journal_open(Journal* journal, const char* data_path)
+{
+    if (journal == NULL || data_path == NULL)
+    {
+        RET_ERR("unexpected NULL");
+    }
+    if (!crc_ready)
+    {
+        _crc_init();
+    }
+    memset(journal, 0, sizeof(Journal));
+    journal->m_journal_fd = -1;
+
+    journal->m_data_path = strdup(data_path);
+    journal->m_journal_path = _suffixed(data_path, JOURNAL_SUFFIX);
+    journal->m_checkpoint_path = _suffixed(data_path, JOURNAL_CHECKPOINT_SUFFIX);
+    if (journal->m_data_path == NULL || journal->m_journal_path == NULL || journal->m_checkpoint_path == NULL)
+    {
+        journal_close(journal);
+        RET_ERR("journal failed to allocate");
+    }
+
+    int data_fd = open(data_path, O_RDWR | O_CREAT, 0644);
+    journal->m_journal_fd = open(journal->m_journal_path, O_RDWR | O_CREAT, 0644);
+    if (data_fd == -1 || journal->m_journal_fd == -1)
+    {
+        if (data_fd != -1)
+        {
+            close(data_fd);
+        }
+        journal_close(journal);
+        RET_ERR("journal failed to open");
+    }
+
+    int status = _recover(journal, data_fd);
+    close(data_fd);
+    if (status != 0)
+    {
+        // do not checkpoint a journal that failed to recover
+        close(journal->m_journal_fd);
+        journal->m_journal_fd = -1;
+        journal_close(journal);
+        RET_ERR("journal failed to recover");
+    }
+    if (journal->m_since_checkpoint > 0)
+    {
+        journal_checkpoint(journal);
+    }
+    return 0;
+}
+
+/* journal_append()
+ *   Frame bytes that were just appended to the history file. Caller must
+ *   serialise appends and must have synced the history file first.
+ * out: 0 success, -1 error
+ */
+int journal_append(Journal* journal, const struct iovec* iov, int iovcnt)
+{
+    JournalRecord record;
+    record.m_offset = journal->m_data_size;
+    record.m_length = 0;
+    record.m_checksum = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        record.m_checksum = _crc_update(record.m_checksum, (const char*)iov[i].iov_base, iov[i].iov_len);
+        record.m_length += iov[i].iov_len;
+    }
+
+    if (_pwrite_all(journal->m_journal_fd, (const char*)&record, sizeof(record), journal->m_journal_size) != 0 ||
+        fdatasync(journal->m_journal_fd) != 0)
+    {
+        RET_ERR("journal record failed to write");
+    }
+    journal->m_journal_size += sizeof(record);
+    journal->m_data_size += record.m_length;
+
+    if (++journal->m_since_checkpoint >= JOURNAL_CHECKPOINT_INTERVAL)
+    {
+        return journal_checkpoint(journal);
+    }
+    return 0;
+}
+
+/* journal_checkpoint()
+ *   Atomically replace the checkpoint with the current journal position
+ * out: 0 success, -1 error
+ */
+int journal_checkpoint(Journal* journal)
+{
+    JournalCheckpoint checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.m_journal_size = journal->m_journal_size;
+    checkpoint.m_data_size = journal->m_data_size;
+    checkpoint.m_checksum = _checkpoint_checksum(&checkpoint);
+
+    size_t length = strlen(journal->m_checkpoint_path) + 5;
+    char temp_path[length];
+    snprintf(temp_path, length, "%s.tmp", journal->m_checkpoint_path);
+
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        RET_ERR("checkpoint failed to open");
+    }
+    if (_pwrite_all(fd, (const char*)&checkpoint, sizeof(checkpoint), 0) != 0 || fsync(fd) != 0)
+    {
+        close(fd);
+        RET_ERR("checkpoint failed to write");
+    }
+    close(fd);
+    if (rename(temp_path, journal->m_checkpoint_path) != 0)
+    {
+        RET_ERR("checkpoint failed to rename");
+    }
+    journal->m_since_checkpoint = 0;
+    return 0;
+}
+
+void journal_close(Journal* journal)
+{
+    if (journal->m_journal_fd != -1)
+    {
+        journal_checkpoint(journal);
+        close(journal->m_journal_fd);
+    }
+    free(journal->m_data_path);
+    free(journal->m_journal_path);
+    free(journal->m_checkpoint_path);
+    memset(journal, 0, sizeof(Journal));
+    journal->m_journal_fd = -1;
+}
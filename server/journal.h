@@ -0,0 +1,50 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_CHECKPOINT_SUFFIX ".ckpt"
+
+// records appended between checkpoints
+#define JOURNAL_CHECKPOINT_INTERVAL 1024
+
+/*
+ * Framing for one append to the history file. The payload itself stays in
+ * the history file so replays can still send it without copying.
+ */
+typedef struct JournalRecord {
+    uint64_t m_offset;
+    uint32_t m_length;
+    uint32_t m_checksum;
+} JournalRecord;
+
+/*
+ * Everything before these sizes is known to be durable and valid, so
+ * recovery only verifies the records written after it.
+ */
+typedef struct JournalCheckpoint {
+    uint64_t m_journal_size;
+    uint64_t m_data_size;
+    uint32_t m_checksum;
+    uint32_t m_reserved;
+} JournalCheckpoint;
+
+typedef struct Journal {
+    char* m_data_path;
+    char* m_journal_path;
+    char* m_checkpoint_path;
+    int m_journal_fd;
+    uint64_t m_journal_size;
+    uint64_t m_data_size;
+    uint32_t m_since_checkpoint;
+} Journal;
+
+int journal_open(Journal* journal, const char* data_path);
+int journal_append(Journal* journal, const struct iovec* iov, int iovcnt);
+int journal_checkpoint(Journal* journal);
+void journal_close(Journal* journal);
+
+#endif // JOURNAL_H
@@ -0,0 +1,243 @@
+#include "line_index.h"
+#include "error_handling.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define LINE_INDEX_READ_SIZE (64 * 1024)
+
+// line ends written with one pwrite()
+#define LINE_INDEX_BATCH 512
+
+// stale entries dropped one by one before the index is rebuilt instead
+#define LINE_INDEX_REPAIR_LIMIT 1024
+
+/* _entry_valid()
+ *   An entry is trusted if it lies inside the history and ends on a newline
+ */
+static int _entry_valid(int data_fd, uint64_t data_size, uint64_t end)
+{
+    char last;
+    return end > 0 && end <= data_size && pread(data_fd, &last, 1, end - 1) == 1 && last == '\n';
+}
+
+/* _flush()
+ *   Append buffered line ends to the index file
+ * out: 0 success, -1 error
+ */
+static int _flush(LineIndex* index, const uint64_t* ends, size_t count)
+{
+    const char* data = (const char*)ends;
+    size_t remaining = count * sizeof(uint64_t);
+    off_t offset = index->m_count * sizeof(uint64_t);
+    while (remaining > 0)
+    {
+        ssize_t written = pwrite(index->m_fd, data, remaining, offset);
+        if (written == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return -1;
+        }
+        data += written;
+        remaining -= written;
+        offset += written;
+    }
+    __atomic_store_n(&index->m_count, index->m_count + count, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* line_index_open()
+ *   Open the index of a history file, dropping entries the history no
+ *   longer backs (after journal recovery truncated it, say) and indexing
+ *   whatever was appended since the index was last written
+ * out: 0 success, -1 error
+ */
+int line_index_open(LineIndex* index, const char* data_path)
+{
+    if (index == NULL || data_path == NULL)
+    {
+        RET_ERR("unexpected NULL");
+    }
+    memset(index, 0, sizeof(LineIndex));
+    index->m_path = (char*)malloc(strlen(data_path) + strlen(LINE_INDEX_SUFFIX) + 1);
+    if (index->m_path == NULL)
+    {
+        RET_ERR("line index failed to allocate");
+    }
+    sprintf(index->m_path, "%s%s", data_path, LINE_INDEX_SUFFIX);
+    index->m_fd = open(index->m_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (index->m_fd == -1)
+    {
+        perror("open()");
+        free(index->m_path);
+        return -1;
+    }
+
+    uint64_t data_size = 0;
+    int data_fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (data_fd != -1 && fstat(data_fd, &st) == 0)
+    {
+        data_size = st.st_size;
+    }
+
+    uint64_t count = 0;
+    if (fstat(index->m_fd, &st) == 0)
+    {
+        count = st.st_size / sizeof(uint64_t);
+    }
+    uint64_t end = 0;
+    int dropped = 0;
+    while (count > 0)
+    {
+        if (pread(index->m_fd, &end, sizeof(end), (count - 1) * sizeof(end)) == sizeof(end) &&
+            _entry_valid(data_fd, data_size, end))
+        {
+            break;
+        }
+        if (++dropped > LINE_INDEX_REPAIR_LIMIT)
+        {
+            fprintf(stderr, "line index %s does not match its history, rebuilding\n", index->m_path);
+            count = 0;
+            break;
+        }
+        count--;
+    }
+    if (count == 0)
+    {
+        end = 0;
+    }
+    if (ftruncate(index->m_fd, count * sizeof(uint64_t)) != 0)
+    {
+        perror("ftruncate()");
+    }
+    index->m_count = count;
+    index->m_size = end;
+
+    // index the tail the entries do not cover yet
+    int status = 0;
+    if (data_fd != -1 && index->m_size < data_size)
+    {
+        char* buffer = (char*)malloc(LINE_INDEX_READ_SIZE);
+        if (buffer == NULL)
+        {
+            status = -1;
+        }
+        ssize_t bytes = 0;
+        while (status == 0 && (bytes = pread(data_fd, buffer, LINE_INDEX_READ_SIZE, index->m_size)) > 0)
+        {
+            status = line_index_append(index, buffer, bytes);
+        }
+        free(buffer);
+        if (bytes == -1)
+        {
+            status = -1;
+        }
+    }
+    if (data_fd != -1)
+    {
+        close(data_fd);
+    }
+    if (status != 0)
+    {
+        line_index_close(index);
+        RET_ERR("line index failed to scan its history");
+    }
+    return 0;
+}
+
+void line_index_close(LineIndex* index)
+{
+    if (index->m_fd != -1)
+    {
+        close(index->m_fd);
+        index->m_fd = -1;
+    }
+    free(index->m_path);
+    index->m_path = NULL;
+}
+
+/* line_index_remove()
+ *   Close the index and delete its file along with a removed history
+ * out: 0 success, -1 error
+ */
+int line_index_remove(LineIndex* index)
+{
+    int status = unlink(index->m_path) == 0 || errno == ENOENT ? 0 : -1;
+    if (status != 0)
+    {
+        perror("unlink()");
+    }
+    line_index_close(index);
+    return status;
+}
+
+/* line_index_append()
+ *   Index bytes appended to the history. Caller serialises appends.
+ * out: 0 success, -1 error, after which the index refuses lookups
+ */
+int line_index_append(LineIndex* index, const char* data, size_t size)
+{
+    if (index->m_broken)
+    {
+        return -1;
+    }
+    uint64_t ends[LINE_INDEX_BATCH];
+    size_t count = 0;
+    const char* cursor = data;
+    const char* end = data + size;
+    const char* newline;
+    while ((newline = memchr(cursor, '\n', end - cursor)) != NULL)
+    {
+        ends[count++] = index->m_size + (newline - data) + 1;
+        if (count == LINE_INDEX_BATCH)
+        {
+            if (_flush(index, ends, count) != 0)
+            {
+                break;
+            }
+            count = 0;
+        }
+        cursor = newline + 1;
+    }
+    if (newline != NULL || (count > 0 && _flush(index, ends, count) != 0))
+    {
+        syslog(LOG_ERR, "line index %s failed to write, disabling it until restart", index->m_path);
+        index->m_broken = 1;
+        return -1;
+    }
+    index->m_size += size;
+    return 0;
+}
+
+uint64_t line_index_count(const LineIndex* index)
+{
+    return __atomic_load_n(&index->m_count, __ATOMIC_ACQUIRE);
+}
+
+/* line_index_end()
+ *   Offset just past line (1-based), so the line spans
+ *   [end of line - 1, end of line); line 0 ends at offset 0
+ * out: 0 success, -1 line not indexed or index unusable
+ */
+int line_index_end(const LineIndex* index, uint64_t line, uint64_t* end)
+{
+    if (index->m_broken || line > line_index_count(index))
+    {
+        return -1;
+    }
+    if (line == 0)
+    {
+        *end = 0;
+        return 0;
+    }
+    return pread(index->m_fd, end, sizeof(*end), (line - 1) * sizeof(*end)) == sizeof(*end) ? 0 : -1;
+}
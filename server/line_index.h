@@ -0,0 +1,31 @@
+#ifndef LINE_INDEX_H
+#define LINE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LINE_INDEX_SUFFIX ".lines"
+
+/*
+ * End offset of every line of a history file, kept in <history>.lines as
+ * 8 byte entries: entry n - 1 is where line n ends and line n + 1 starts.
+ * Entries are only ever appended, so they can be read with pread() while
+ * the writer holds its lock. The index is not synced; open verifies it
+ * against the history and rescans whatever it is missing.
+ */
+typedef struct LineIndex {
+    char* m_path;
+    int m_fd;
+    uint64_t m_count;
+    uint64_t m_size;
+    int m_broken;
+} LineIndex;
+
+int line_index_open(LineIndex* index, const char* data_path);
+void line_index_close(LineIndex* index);
+int line_index_remove(LineIndex* index);
+int line_index_append(LineIndex* index, const char* data, size_t size);
+uint64_t line_index_count(const LineIndex* index);
+int line_index_end(const LineIndex* index, uint64_t line, uint64_t* end);
+
+#endif // LINE_INDEX_H
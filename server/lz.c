@@ -0,0 +1,223 @@
+#include "lz.h"
+#include "error_handling.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static inline uint32_t _read32(const char* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t _hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* _put_length()
+ *   Write the part of a run length that did not fit in the token nibble
+ * out: bytes written, -1 if dst is full
+ */
+static int _put_length(size_t length, char* dst, size_t capacity)
+{
+    size_t written = 0;
+    while (length >= 255)
+    {
+        if (written >= capacity)
+        {
+            return -1;
+        }
+        dst[written++] = (char)255;
+        length -= 255;
+    }
+    if (written >= capacity)
+    {
+        return -1;
+    }
+    dst[written++] = (char)length;
+    return written;
+}
+
+static int _emit(const char* literals, size_t literal_len, size_t offset, size_t match_len,
+                 char* dst, size_t capacity, size_t* out)
+{
+    if (*out >= capacity)
+    {
+        return -1;
+    }
+    size_t token = *out;
+    (*out)++;
+    dst[token] = (char)((literal_len < 15 ? literal_len : 15) << 4);
+
+    if (literal_len >= 15)
+    {
+        int n = _put_length(literal_len - 15, dst + *out, capacity - *out);
+        if (n < 0)
+        {
+            return -1;
+        }
+        *out += n;
+    }
+    if (*out + literal_len > capacity)
+    {
+        return -1;
+    }
+    memcpy(dst + *out, literals, literal_len);
+    *out += literal_len;
+
+    if (match_len == 0) // final sequence carries literals only
+    {
+        return 0;
+    }
+
+    if (*out + 2 > capacity)
+    {
+        return -1;
+    }
+    dst[(*out)++] = (char)(offset & 0xff);
+    dst[(*out)++] = (char)(offset >> 8);
+
+    size_t extra = match_len - LZ_MIN_MATCH;
+    dst[token] |= (char)(extra < 15 ? extra : 15);
+    if (extra >= 15)
+    {
+        int n = _put_length(extra - 15, dst + *out, capacity - *out);
+        if (n < 0)
+        {
+            return -1;
+        }
+        *out += n;
+    }
+    return 0;
+}
+
+/* lz_compress()
+ *   Compress one block
+ * out: compressed size, -1 if the result does not fit in capacity
+ */
+int lz_compress(const char* src, size_t size, char* dst, size_t capacity)
+{
+    int32_t table[1 << LZ_HASH_BITS];
+    memset(table, -1, sizeof(table));
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    size_t out = 0;
+
+    while (size > LZ_LAST_LITERALS + LZ_MIN_MATCH && pos + LZ_MIN_MATCH <= size - LZ_LAST_LITERALS)
+    {
+        uint32_t sequence = _read32(src + pos);
+        uint32_t h = _hash(sequence);
+        int32_t ref = table[h];
+        table[h] = (int32_t)pos;
+
+        if (ref < 0 || pos - ref > LZ_MAX_OFFSET || _read32(src + ref) != sequence)
+        {
+            pos++;
+            continue;
+        }
+
+        size_t match_len = LZ_MIN_MATCH;
+        while (pos + match_len < size - LZ_LAST_LITERALS && src[ref + match_len] == src[pos + match_len])
+        {
+            match_len++;
+        }
+
+        if (_emit(src + anchor, pos - anchor, pos - ref, match_len, dst, capacity, &out) != 0)
+        {
+            return -1;
+        }
+        pos += match_len;
+        anchor = pos;
+    }
+
+    if (_emit(src + anchor, size - anchor, 0, 0, dst, capacity, &out) != 0)
+    {
+        return -1;
+    }
+    return (int)out;
+}
+
+static int _get_length(const char* src, size_t size, size_t* in, size_t* length)
+{
+    unsigned char byte;
+    do
+    {
+        if (*in >= size)
+        {
+            return -1;
+        }
+        byte = (unsigned char)src[(*in)++];
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/* lz_decompress()
+ *   Decompress one block
+ * out: decompressed size, -1 if the block is corrupt or dst too small
+ */
+int lz_decompress(const char* src, size_t size, char* dst, size_t capacity)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < size)
+    {
+        unsigned char token = (unsigned char)src[in++];
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && _get_length(src, size, &in, &literal_len) != 0)
+        {
+            RET_ERR("lz block truncated");
+        }
+        if (in + literal_len > size || out + literal_len > capacity)
+        {
+            RET_ERR("lz literal run out of bounds");
+        }
+        memcpy(dst + out, src + in, literal_len);
+        in += literal_len;
+        out += literal_len;
+
+        if (in == size)
+        {
+            break;
+        }
+
+        if (in + 2 > size)
+        {
+            RET_ERR("lz block truncated");
+        }
+        size_t offset = (unsigned char)src[in] | ((size_t)(unsigned char)src[in + 1] << 8);
+        in += 2;
+        if (offset == 0 || offset > out)
+        {
+            RET_ERR("lz offset out of bounds");
+        }
+
+        size_t match_len = token & 0x0f;
+        if (match_len == 15 && _get_length(src, size, &in, &match_len) != 0)
+        {
+            RET_ERR("lz block truncated");
+        }
+        match_len += LZ_MIN_MATCH;
+        if (out + match_len > capacity)
+        {
+            RET_ERR("lz match out of bounds");
+        }
+
+        // byte by byte, since the match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; i++, out++)
+        {
+            dst[out] = dst[out - offset];
+        }
+    }
+    return (int)out;
+}
@@ -0,0 +1,17 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/*
+ * Minimal LZ4-style block codec. Each block is self contained: a sequence
+ * of (literal run, back reference) pairs with offsets of at most 64K.
+ */
+
+// worst case output size for an incompressible block of size bytes
+#define LZ_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+int lz_compress(const char* src, size_t size, char* dst, size_t capacity);
+int lz_decompress(const char* src, size_t size, char* dst, size_t capacity);
+
+#endif // LZ_H
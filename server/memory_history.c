@@ -0,0 +1,73 @@
+#include "memory_history.h"
+#include "error_handling.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ENTRIES AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+int memory_history_init(MemoryHistory* history, size_t capacity)
+{
+    // double mapped where possible, so no packet is ever split at the ring's end
+    if (aesd_byte_ring_init(&history->m_ring, capacity, true) != 0)
+    {
+        RET_ERR("memory history ring failed to allocate");
+    }
+    return 0;
+}
+
+void memory_history_destroy(MemoryHistory* history)
+{
+    aesd_byte_ring_free(&history->m_ring);
+}
+
+/* memory_history_append()
+ *   Store one packet, evicting the oldest packets to make room
+ * out: 0 success, -1 if the packet is larger than the ring
+ */
+int memory_history_append(MemoryHistory* history, const struct iovec* iov, int iovcnt, size_t size)
+{
+    if (size == 0)
+    {
+        return 0;
+    }
+    char* data = aesd_byte_ring_alloc_entry(&history->m_ring, size);
+    if (data == NULL)
+    {
+        RET_ERR("packet larger than memory history");
+    }
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(data, iov[i].iov_base, iov[i].iov_len);
+        data += iov[i].iov_len;
+    }
+    return 0;
+}
+
+/* memory_history_copy()
+ *   Copy the retained history, oldest first, into one allocation the caller
+ *   frees. Replays send the copy after file_lock is released, so later
+ *   appends may reuse the ring while a slow client is still reading.
+ * out: 0 success, -1 error
+ */
+int memory_history_copy(const MemoryHistory* history, char** data, size_t* size)
+{
+    *size = history->m_ring.size;
+    *data = malloc(*size ? *size : 1);
+    if (*data == NULL)
+    {
+        RET_ERR("memory history copy failed to allocate");
+    }
+
+    struct iovec iov[ENTRIES];
+    size_t count;
+    aesd_circular_buffer_fill_iovec((struct aesd_circular_buffer*)&history->m_ring.index, 0, *size,
+                                    iov, ENTRIES, &count);
+    char* out = *data;
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(out, iov[i].iov_base, iov[i].iov_len);
+        out += iov[i].iov_len;
+    }
+    return 0;
+}
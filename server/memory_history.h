@@ -0,0 +1,22 @@
+#ifndef MEMORY_HISTORY_H
+#define MEMORY_HISTORY_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "aesd-byte-ring.h"
+
+/*
+ * Disk-free history: the most recent AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * packets, held in an aesd_byte_ring so storing a packet only ever evicts
+ * the oldest ones and never calls malloc().
+ */
+typedef struct MemoryHistory {
+    struct aesd_byte_ring m_ring;
+} MemoryHistory;
+
+int memory_history_init(MemoryHistory* history, size_t capacity);
+void memory_history_destroy(MemoryHistory* history);
+int memory_history_append(MemoryHistory* history, const struct iovec* iov, int iovcnt, size_t size);
+int memory_history_copy(const MemoryHistory* history, char** data, size_t* size);
+
+#endif // MEMORY_HISTORY_H
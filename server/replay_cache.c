@@ -0,0 +1,290 @@
+#include "replay_cache.h"
+#include "error_handling.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// snapshots with more mappings than this are coalesced into one
+#define REPLAY_MAX_MAPS 32
+
+// iovec entries handed to a single sendmsg()
+#define REPLAY_IOV_BATCH 64
+
+static void _release_map(ReplayMap* map)
+{
+    if (--map->m_refs == 0)
+    {
+        munmap(map->m_addr, map->m_length);
+        free(map);
+    }
+}
+
+static void _free_snapshot(ReplaySnapshot* snapshot)
+{
+    for (int i = 0; i < snapshot->m_count; i++)
+    {
+        _release_map(snapshot->m_maps[i]);
+    }
+    free(snapshot->m_maps);
+    free(snapshot->m_iov);
+    free(snapshot);
+}
+
+static void _release_snapshot(ReplaySnapshot* snapshot)
+{
+    if (snapshot != NULL && --snapshot->m_refs == 0)
+    {
+        _free_snapshot(snapshot);
+    }
+}
+
+/* _map_range()
+ *   Map bytes [offset, end) of the history file
+ * out: 0 success, -1 error
+ */
+static int _map_range(int fd, size_t offset, size_t end, ReplayMap** map, struct iovec* iov)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t aligned = offset - offset % page;
+
+    void* addr = mmap(NULL, end - aligned, PROT_READ, MAP_SHARED, fd, aligned);
+    if (addr == MAP_FAILED)
+    {
+        perror("mmap()");
+        return -1;
+    }
+
+    *map = (ReplayMap*)malloc(sizeof(ReplayMap));
+    if (*map == NULL)
+    {
+        munmap(addr, end - aligned);
+        RET_ERR("replay map failed to allocate");
+    }
+    (*map)->m_addr = addr;
+    (*map)->m_length = end - aligned;
+    (*map)->m_refs = 1;
+
+    iov->iov_base = (char*)addr + (offset - aligned);
+    iov->iov_len = end - offset;
+    return 0;
+}
+
+/* _build_snapshot()
+ *   Extend the previous snapshot (if any) up to length bytes. Only the bytes
+ *   appended since the previous snapshot are mapped.
+ * out: 0 success, -1 error
+ */
+static int _build_snapshot(ReplayCache* cache, size_t length, ReplaySnapshot** snapshot)
+{
+    ReplaySnapshot* previous = cache->m_current;
+    if (previous != NULL && previous->m_length > length)
+    {
+        previous = NULL;
+    }
+    int reuse = previous != NULL && previous->m_count < REPLAY_MAX_MAPS ? previous->m_count : 0;
+    size_t offset = reuse ? previous->m_length : 0;
+
+    *snapshot = (ReplaySnapshot*)calloc(1, sizeof(ReplaySnapshot));
+    if (*snapshot == NULL)
+    {
+        RET_ERR("replay snapshot failed to allocate");
+    }
+    (*snapshot)->m_maps = (ReplayMap**)calloc(reuse + 1, sizeof(ReplayMap*));
+    (*snapshot)->m_iov = (struct iovec*)calloc(reuse + 1, sizeof(struct iovec));
+    if ((*snapshot)->m_maps == NULL || (*snapshot)->m_iov == NULL)
+    {
+        _free_snapshot(*snapshot);
+        RET_ERR("replay snapshot failed to allocate");
+    }
+
+    for (int i = 0; i < reuse; i++)
+    {
+        previous->m_maps[i]->m_refs++;
+        (*snapshot)->m_maps[i] = previous->m_maps[i];
+        (*snapshot)->m_iov[i] = previous->m_iov[i];
+        (*snapshot)->m_count++;
+    }
+    (*snapshot)->m_length = offset;
+    (*snapshot)->m_refs = 1;
+
+    if (length > offset)
+    {
+        int fd = open(cache->m_path, O_RDONLY);
+        if (fd == -1)
+        {
+            _free_snapshot(*snapshot);
+            perror("open()");
+            return -1;
+        }
+        // never map past the end of the file
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size < length)
+        {
+            length = st.st_size;
+        }
+        if (length > offset)
+        {
+            int index = (*snapshot)->m_count;
+            if (_map_range(fd, offset, length, &(*snapshot)->m_maps[index], &(*snapshot)->m_iov[index]) != 0)
+            {
+                close(fd);
+                _free_snapshot(*snapshot);
+                return -1;
+            }
+            (*snapshot)->m_count++;
+            (*snapshot)->m_length = length;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+int replay_cache_init(ReplayCache* cache, const char* path)
+{
+    if (cache == NULL || path == NULL)
+    {
+        RET_ERR("unexpected NULL");
+    }
+    if (pthread_mutex_init(&cache->m_lock, NULL) != 0)
+    {
+        RET_ERR("lock failed to init");
+    }
+    cache->m_path = path;
+    cache->m_current = NULL;
+    cache->m_committed = 0;
+    replay_cache_reset(cache);
+    return 0;
+}
+
+void replay_cache_destroy(ReplayCache* cache)
+{
+    pthread_mutex_lock(&cache->m_lock);
+    _release_snapshot(cache->m_current);
+    cache->m_current = NULL;
+    pthread_mutex_unlock(&cache->m_lock);
+    pthread_mutex_destroy(&cache->m_lock);
+}
+
+/* replay_cache_append()
+ *   Record bytes appended to the history file. The current snapshot stays
+ *   valid for clients already replaying it; the next acquire maps the tail.
+ */
+void replay_cache_append(ReplayCache* cache, size_t bytes)
+{
+    pthread_mutex_lock(&cache->m_lock);
+    cache->m_committed += bytes;
+    pthread_mutex_unlock(&cache->m_lock);
+}
+
+/* replay_cache_reset()
+ *   Resynchronise with the history file after it was replaced or truncated
+ */
+void replay_cache_reset(ReplayCache* cache)
+{
+    struct stat st;
+    pthread_mutex_lock(&cache->m_lock);
+    _release_snapshot(cache->m_current);
+    cache->m_current = NULL;
+    cache->m_committed = stat(cache->m_path, &st) == 0 ? (size_t)st.st_size : 0;
+    pthread_mutex_unlock(&cache->m_lock);
+}
+
+int replay_cache_acquire(ReplayCache* cache, ReplaySnapshot** snapshot)
+{
+    if (cache == NULL || snapshot == NULL)
+    {
+        RET_ERR("unexpected NULL");
+    }
+
+    pthread_mutex_lock(&cache->m_lock);
+    if (cache->m_current == NULL || cache->m_current->m_length != cache->m_committed)
+    {
+        ReplaySnapshot* next;
+        if (_build_snapshot(cache, cache->m_committed, &next) != 0)
+        {
+            pthread_mutex_unlock(&cache->m_lock);
+            RET_ERR("replay snapshot failed to build");
+        }
+        _release_snapshot(cache->m_current);
+        cache->m_current = next;
+    }
+    cache->m_current->m_refs++;
+    *snapshot = cache->m_current;
+    pthread_mutex_unlock(&cache->m_lock);
+    return 0;
+}
+
+void replay_cache_release(ReplayCache* cache, ReplaySnapshot* snapshot)
+{
+    pthread_mutex_lock(&cache->m_lock);
+    _release_snapshot(snapshot);
+    pthread_mutex_unlock(&cache->m_lock);
+}
+
+/* replay_cache_send()
+ *   Send an acquired snapshot from byte offset from to a socket straight
+ *   from the mapped pages
+ * out: 0 success, -1 error
+ */
+int replay_cache_send(ReplaySnapshot* snapshot, size_t from, int fd)
+{
+    struct iovec pending[REPLAY_IOV_BATCH];
+    int next = 0;
+    int pending_cnt = 0;
+
+    while (next < snapshot->m_count && from >= snapshot->m_iov[next].iov_len)
+    {
+        from -= snapshot->m_iov[next++].iov_len;
+    }
+    if (next < snapshot->m_count && from > 0)
+    {
+        pending[0].iov_base = (char*)snapshot->m_iov[next].iov_base + from;
+        pending[0].iov_len = snapshot->m_iov[next].iov_len - from;
+        pending_cnt = 1;
+        next++;
+    }
+
+    while (next < snapshot->m_count || pending_cnt > 0)
+    {
+        while (pending_cnt < REPLAY_IOV_BATCH && next < snapshot->m_count)
+        {
+            pending[pending_cnt++] = snapshot->m_iov[next++];
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = pending;
+        msg.msg_iovlen = pending_cnt;
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            perror("sendmsg()");
+            return -1;
+        }
+
+        int consumed = 0;
+        while (consumed < pending_cnt && (size_t)sent >= pending[consumed].iov_len)
+        {
+            sent -= pending[consumed].iov_len;
+            consumed++;
+        }
+        if (consumed < pending_cnt)
+        {
+            pending[consumed].iov_base = (char*)pending[consumed].iov_base + sent;
+            pending[consumed].iov_len -= sent;
+        }
+        memmove(pending, pending + consumed, (pending_cnt - consumed) * sizeof(struct iovec));
+        pending_cnt -= consumed;
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+#ifndef REPLAY_CACHE_H
+#define REPLAY_CACHE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * A read-only mapping of part of the history file. Mappings are shared
+ * between snapshots, so extending the history only maps the new tail.
+ */
+typedef struct ReplayMap {
+    void* m_addr;
+    size_t m_length;
+    int m_refs;
+} ReplayMap;
+
+/*
+ * The history as of m_length committed bytes, ready to hand to sendmsg().
+ * Clients replaying the same committed length share one snapshot.
+ */
+typedef struct ReplaySnapshot {
+    ReplayMap** m_maps;
+    struct iovec* m_iov;
+    int m_count;
+    size_t m_length;
+    int m_refs;
+} ReplaySnapshot;
+
+typedef struct ReplayCache {
+    pthread_mutex_t m_lock;
+    const char* m_path;
+    ReplaySnapshot* m_current;
+    size_t m_committed;
+} ReplayCache;
+
+int replay_cache_init(ReplayCache* cache, const char* path);
+void replay_cache_destroy(ReplayCache* cache);
+void replay_cache_append(ReplayCache* cache, size_t bytes);
+void replay_cache_reset(ReplayCache* cache);
+int replay_cache_acquire(ReplayCache* cache, ReplaySnapshot** snapshot);
+void replay_cache_release(ReplayCache* cache, ReplaySnapshot* snapshot);
+int replay_cache_send(ReplaySnapshot* snapshot, size_t from, int fd);
+
+#endif // REPLAY_CACHE_H
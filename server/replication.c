@@ -0,0 +1,247 @@
+#include "replication.h"
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define REPLICATION_READ_SIZE (64 * 1024)
+
+// poll timeout, so a stopped follower notices within this many milliseconds
+#define REPLICATION_POLL_MS 1000
+
+/* replication_connect()
+ *   Connect to a "host:port" address; the port follows the last colon so
+ *   bracketless IPv6 hosts still parse. Connecting, sending and receiving
+ *   each time out after REPLICATION_TIMEOUT_SECONDS.
+ * out: connected socket, -1 error
+ */
+int replication_connect(const char* address)
+{
+    const char* colon = strrchr(address, ':');
+    if (colon == NULL || colon == address)
+    {
+        fprintf(stderr, "leader address must be host:port, got %s\n", address);
+        return -1;
+    }
+    char host[256];
+    size_t host_len = colon - address;
+    if (host_len >= sizeof(host))
+    {
+        fprintf(stderr, "leader host too long: %s\n", address);
+        return -1;
+    }
+    memcpy(host, address, host_len);
+    host[host_len] = '\0';
+
+    struct addrinfo hints, *res, *p;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &res) != 0)
+    {
+        return -1;
+    }
+
+    // Linux bounds a blocking connect() by the send timeout as well
+    struct timeval timeout = { .tv_sec = REPLICATION_TIMEOUT_SECONDS, .tv_usec = 0 };
+    int fd = -1;
+    for (p = res; p != NULL; p = p->ai_next)
+    {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0 &&
+            connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int _send_line(int fd, const char* line, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(fd, line, length, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        line += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/* replication_leader_offset()
+ *   Ask the leader for its committed history size and the offset its
+ *   retention window starts at, the oldest offset it can still replicate from
+ * out: 0 success, -1 error
+ */
+int replication_leader_offset(const char* address, uint64_t* offset, uint64_t* start)
+{
+    int fd = replication_connect(address);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    char reply[48];
+    size_t received = 0;
+    int status = _send_line(fd, OFFSET_HEADER, strlen(OFFSET_HEADER));
+    while (status == 0 && received < sizeof(reply) - 1 && memchr(reply, '\n', received) == NULL)
+    {
+        ssize_t bytes = recv(fd, reply + received, sizeof(reply) - 1 - received, 0);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            status = -1;
+        }
+        received += bytes > 0 ? bytes : 0;
+    }
+    close(fd);
+    if (status != 0 || memchr(reply, '\n', received) == NULL)
+    {
+        return -1;
+    }
+    reply[received] = '\0';
+    char* end;
+    *offset = strtoull(reply, &end, 10);
+    *start = strtoull(end, NULL, 10);
+    return 0;
+}
+
+/* _stream()
+ *   Apply the leader's stream until it disconnects or the follower stops
+ * out: 0 stopped, -1 disconnected or failed. *received counts applied bytes.
+ */
+static int _stream(Follower* follower, int fd, char* buffer, uint64_t* received)
+{
+    struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+    while (*follower->m_run)
+    {
+        int ready = poll(&pollfd, 1, REPLICATION_POLL_MS);
+        if (ready == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+        if (ready <= 0)
+        {
+            continue;
+        }
+        ssize_t bytes = recv(fd, buffer, REPLICATION_READ_SIZE, 0);
+        if (bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return -1;
+        }
+        if (follower->m_apply(buffer, bytes) != 0)
+        {
+            syslog(LOG_ERR, "follower failed to store %zd replicated bytes", bytes);
+            return -1;
+        }
+        *received += bytes;
+    }
+    return 0;
+}
+
+/* _left_window()
+ *   Whether the leader's retention window has moved past what the follower
+ *   stores, so the leader refuses to replicate to it
+ */
+static int _left_window(Follower* follower)
+{
+    uint64_t leader_offset, start;
+    if (replication_leader_offset(follower->m_leader, &leader_offset, &start) != 0 || follower->m_offset() >= start)
+    {
+        return 0;
+    }
+    syslog(LOG_ERR, "follower offset %llu has left the retention window of leader %s, which starts at %llu; "
+           "stopping replication", (unsigned long long)follower->m_offset(), follower->m_leader,
+           (unsigned long long)start);
+    return 1;
+}
+
+/* follower_run()
+ *   Replicate from the leader until *m_run is cleared, resuming from the
+ *   locally stored size after every disconnect. Stops early if the leader no
+ *   longer retains the offset to resume from, since every retry would fail.
+ */
+void follower_run(Follower* follower)
+{
+    char* buffer = (char*)malloc(REPLICATION_READ_SIZE);
+    if (buffer == NULL)
+    {
+        syslog(LOG_ERR, "follower failed to allocate its receive buffer");
+        return;
+    }
+
+    while (*follower->m_run)
+    {
+        int fd = replication_connect(follower->m_leader);
+        uint64_t received = 0;
+        int refused = 0;
+        if (fd != -1)
+        {
+            char request[64];
+            int length = snprintf(request, sizeof(request), REPLICATE_HEADER "%llu\n",
+                                  (unsigned long long)follower->m_offset());
+            if (_send_line(fd, request, length) == 0)
+            {
+                syslog(LOG_INFO, "replicating from %s at offset %llu", follower->m_leader,
+                       (unsigned long long)follower->m_offset());
+                // a refused offset ends the stream before a single byte
+                refused = _stream(follower, fd, buffer, &received) != 0 && received == 0;
+            }
+            close(fd);
+            if (refused && _left_window(follower))
+            {
+                break;
+            }
+        }
+        if (*follower->m_run)
+        {
+            syslog(LOG_WARNING, "lost leader %s, retrying", follower->m_leader);
+            sleep(REPLICATION_RETRY_SECONDS);
+        }
+    }
+    free(buffer);
+}
+
+/* follower_report_lag()
+ *   Log how many committed leader bytes are not stored locally yet
+ */
+void follower_report_lag(Follower* follower)
+{
+    uint64_t leader_offset, start;
+    if (replication_leader_offset(follower->m_leader, &leader_offset, &start) != 0)
+    {
+        syslog(LOG_WARNING, "replication lag unknown, leader %s unreachable", follower->m_leader);
+        return;
+    }
+    uint64_t local = follower->m_offset();
+    uint64_t lag = leader_offset > local ? leader_offset - local : 0;
+    syslog(LOG_INFO, "replication lag %llu bytes behind %s", (unsigned long long)lag, follower->m_leader);
+}
@@ -0,0 +1,44 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+
+// "REPLICATE:<offset>\n" streams the leader history from a raw byte offset
+#define REPLICATE_HEADER "REPLICATE:"
+
+// "OFFSET\n" is answered with "<committed size> <retention window start>\n"
+#define OFFSET_HEADER "OFFSET\n"
+
+// seconds between reconnect attempts to an unreachable leader
+#define REPLICATION_RETRY_SECONDS 1
+
+// seconds a connect, send or reply from the leader may take before the
+// attempt fails, so a leader that accepts but never answers cannot stall
+// the follower or its shutdown
+#ifndef REPLICATION_TIMEOUT_SECONDS
+#define REPLICATION_TIMEOUT_SECONDS 3
+#endif
+
+typedef int (*ReplicationApply)(const char* data, size_t size);
+typedef uint64_t (*ReplicationOffset)(void);
+
+/*
+ * A follower copying a leader's history. m_apply stores received bytes
+ * locally and m_offset reports how many bytes are stored, which is where
+ * replication resumes after a reconnect.
+ */
+typedef struct Follower {
+    const char* m_leader;
+    ReplicationApply m_apply;
+    ReplicationOffset m_offset;
+    volatile sig_atomic_t* m_run;
+} Follower;
+
+int replication_connect(const char* address);
+int replication_leader_offset(const char* address, uint64_t* offset, uint64_t* start);
+void follower_run(Follower* follower);
+void follower_report_lag(Follower* follower);
+
+#endif // REPLICATION_H
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include "retention.h"
+#include "error_handling.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define RETENTION_READ_SIZE (64 * 1024)
+#define RETENTION_INITIAL_CAPACITY 1024
+
+/* _grow()
+ *   Double a ring buffer, unwrapping it so the oldest element is at index 0
+ * out: 0 success, -1 error
+ */
+static int _grow(void** ring, size_t* head, size_t count, size_t* capacity, size_t element)
+{
+    size_t grown = *capacity ? *capacity * 2 : RETENTION_INITIAL_CAPACITY;
+    char* bigger = (char*)malloc(grown * element);
+    if (bigger == NULL)
+    {
+        return -1;
+    }
+    char* old = (char*)*ring;
+    size_t first = *capacity - *head < count ? *capacity - *head : count;
+    if (count > 0)
+    {
+        memcpy(bigger, old + *head * element, first * element);
+        memcpy(bigger + first * element, old, (count - first) * element);
+    }
+    free(old);
+    *ring = bigger;
+    *head = 0;
+    *capacity = grown;
+    return 0;
+}
+
+static void _push_line(Retention* retention, uint64_t end)
+{
+    if (retention->m_line_count == retention->m_line_capacity &&
+        _grow((void**)&retention->m_line_ends, &retention->m_line_head, retention->m_line_count,
+              &retention->m_line_capacity, sizeof(uint64_t)) != 0)
+    {
+        // an untracked line only widens the window, it never loses data
+        return;
+    }
+    size_t slot = (retention->m_line_head + retention->m_line_count) % retention->m_line_capacity;
+    retention->m_line_ends[slot] = end;
+    retention->m_line_count++;
+}
+
+static void _push_stamp(Retention* retention, uint64_t end, time_t when)
+{
+    if (retention->m_stamp_count == retention->m_stamp_capacity &&
+        _grow((void**)&retention->m_stamps, &retention->m_stamp_head, retention->m_stamp_count,
+              &retention->m_stamp_capacity, sizeof(RetentionStamp)) != 0)
+    {
+        return;
+    }
+    size_t slot = (retention->m_stamp_head + retention->m_stamp_count) % retention->m_stamp_capacity;
+    retention->m_stamps[slot].m_end = end;
+    retention->m_stamps[slot].m_time = when;
+    retention->m_stamp_count++;
+}
+
+/* _parse_stamp()
+ *   Read the time of a timestamp record from the start of a line
+ * out: 0 success, -1 not a timestamp record
+ */
+static int _parse_stamp(const char* line, size_t length, time_t* when)
+{
+    size_t prefix = strlen(RETENTION_TIMESTAMP_PREFIX);
+    if (length <= prefix || memcmp(line, RETENTION_TIMESTAMP_PREFIX, prefix) != 0)
+    {
+        return -1;
+    }
+    char text[RETENTION_PREFIX_MAX + 1];
+    memcpy(text, line, length);
+    text[length] = '\0';
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(text + prefix, RETENTION_TIMESTAMP_FORMAT, &tm) == NULL)
+    {
+        return -1;
+    }
+    tm.tm_isdst = -1;
+    *when = mktime(&tm);
+    return *when == (time_t)-1 ? -1 : 0;
+}
+
+/* _advance()
+ *   Move the window start past every line that breaks a limit. A line
+ *   written between two timestamp records is only known to be older than
+ *   the later one, so age retention keeps lines until the timestamp record
+ *   after them has expired.
+ */
+static void _advance(Retention* retention, time_t now)
+{
+    const RetentionPolicy* policy = &retention->m_policy;
+    if (policy->m_max_age > 0)
+    {
+        time_t cutoff = now - policy->m_max_age;
+        while (retention->m_stamp_count > 0 && retention->m_stamps[retention->m_stamp_head].m_time < cutoff)
+        {
+            retention->m_age_floor = retention->m_stamps[retention->m_stamp_head].m_end;
+            retention->m_stamp_head = (retention->m_stamp_head + 1) % retention->m_stamp_capacity;
+            retention->m_stamp_count--;
+        }
+    }
+
+    while (retention->m_line_count > 0)
+    {
+        uint64_t first_end = retention->m_line_ends[retention->m_line_head];
+        int over_lines = policy->m_max_lines > 0 && retention->m_line_count > policy->m_max_lines;
+        int over_bytes = policy->m_max_bytes > 0 && retention->m_size - retention->m_start > policy->m_max_bytes;
+        int expired = first_end <= retention->m_age_floor;
+        if (!over_lines && !over_bytes && !expired)
+        {
+            break;
+        }
+        retention->m_start = first_end;
+        retention->m_line_head = (retention->m_line_head + 1) % retention->m_line_capacity;
+        retention->m_line_count--;
+    }
+
+    while (retention->m_stamp_count > 0 && retention->m_stamps[retention->m_stamp_head].m_end <= retention->m_start)
+    {
+        retention->m_stamp_head = (retention->m_stamp_head + 1) % retention->m_stamp_capacity;
+        retention->m_stamp_count--;
+    }
+}
+
+int retention_enabled(const RetentionPolicy* policy)
+{
+    return policy->m_max_bytes > 0 || policy->m_max_lines > 0 || policy->m_max_age > 0;
+}
+
+int retention_init(Retention* retention, const RetentionPolicy* policy)
+{
+    if (retention == NULL || policy == NULL)
+    {
+        RET_ERR("unexpected NULL");
+    }
+    memset(retention, 0, sizeof(Retention));
+    retention->m_policy = *policy;
+    if (pthread_mutex_init(&retention->m_pins_lock, NULL) != 0)
+    {
+        RET_ERR("retention failed to initialize its lock");
+    }
+    return 0;
+}
+
+/* retention_load()
+ *   Rebuild the window from an existing history file. Released segments
+ *   read back as a hole, so the window resumes at the first line that
+ *   starts after the data does.
+ * out: 0 success, -1 error
+ */
+int retention_load(Retention* retention, const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+    off_t data = lseek(fd, 0, SEEK_DATA);
+    if (data == -1)
+    {
+        // no data at all, or SEEK_DATA unsupported and the whole file is kept
+        data = errno == ENXIO ? lseek(fd, 0, SEEK_END) : 0;
+    }
+    if (data > 0)
+    {
+        retention->m_size = data;
+        retention->m_start = data;
+        retention->m_released = data - data % RETENTION_SEGMENT_SIZE;
+        retention->m_skip_line = 1;
+    }
+
+    char* buffer = (char*)malloc(RETENTION_READ_SIZE);
+    if (buffer == NULL)
+    {
+        close(fd);
+        RET_ERR("retention failed to allocate");
+    }
+    time_t now = time(NULL);
+    ssize_t bytes;
+    while ((bytes = pread(fd, buffer, RETENTION_READ_SIZE, retention->m_size)) > 0)
+    {
+        retention_observe(retention, buffer, bytes, now);
+    }
+    free(buffer);
+    close(fd);
+    return bytes == 0 ? 0 : -1;
+}
+
+void retention_free(Retention* retention)
+{
+    free(retention->m_line_ends);
+    free(retention->m_stamps);
+    pthread_mutex_destroy(&retention->m_pins_lock);
+    memset(retention, 0, sizeof(Retention));
+}
+
+/* retention_observe()
+ *   Account for bytes appended to the history and advance the window.
+ *   Caller serialises this with the appends.
+ */
+void retention_observe(Retention* retention, const char* data, size_t size, time_t now)
+{
+    const char* end = data + size;
+    while (data < end)
+    {
+        const char* newline = memchr(data, '\n', end - data);
+        size_t length = newline ? (size_t)(newline - data) + 1 : (size_t)(end - data);
+
+        size_t keep = RETENTION_PREFIX_MAX - retention->m_prefix_len;
+        keep = length < keep ? length : keep;
+        memcpy(retention->m_prefix + retention->m_prefix_len, data, keep);
+        retention->m_prefix_len += keep;
+        retention->m_size += length;
+
+        if (newline != NULL)
+        {
+            if (retention->m_skip_line)
+            {
+                // the tail of a line whose head was released
+                retention->m_skip_line = 0;
+                retention->m_start = retention->m_size;
+            }
+            else
+            {
+                _push_line(retention, retention->m_size);
+                time_t when;
+                if (_parse_stamp(retention->m_prefix, retention->m_prefix_len - 1, &when) == 0)
+                {
+                    _push_stamp(retention, retention->m_size, when);
+                }
+            }
+            retention->m_prefix_len = 0;
+        }
+        data += length;
+    }
+    _advance(retention, now);
+}
+
+uint64_t retention_start(const Retention* retention)
+{
+    return __atomic_load_n(&retention->m_start, __ATOMIC_RELAXED);
+}
+
+static void _link_pin(Retention* retention, RetentionPin* pin, uint64_t from)
+{
+    pin->m_from = from;
+    pin->m_prev = NULL;
+    pin->m_next = retention->m_pins;
+    if (retention->m_pins != NULL)
+    {
+        retention->m_pins->m_prev = pin;
+    }
+    retention->m_pins = pin;
+}
+
+/* retention_pin_start()
+ *   Pin the history from the current window start
+ * out: the pinned offset
+ */
+uint64_t retention_pin_start(Retention* retention, RetentionPin* pin)
+{
+    pthread_mutex_lock(&retention->m_pins_lock);
+    uint64_t from = retention_start(retention);
+    _link_pin(retention, pin, from);
+    pthread_mutex_unlock(&retention->m_pins_lock);
+    return from;
+}
+
+/* retention_pin()
+ *   Pin the history from offset from
+ * out: 0 success, -1 from has left the window
+ */
+int retention_pin(Retention* retention, RetentionPin* pin, uint64_t from)
+{
+    pthread_mutex_lock(&retention->m_pins_lock);
+    int status = from >= retention_start(retention) ? 0 : -1;
+    if (status == 0)
+    {
+        _link_pin(retention, pin, from);
+    }
+    pthread_mutex_unlock(&retention->m_pins_lock);
+    return status;
+}
+
+void retention_unpin(Retention* retention, RetentionPin* pin)
+{
+    pthread_mutex_lock(&retention->m_pins_lock);
+    if (pin->m_prev != NULL)
+    {
+        pin->m_prev->m_next = pin->m_next;
+    }
+    else
+    {
+        retention->m_pins = pin->m_next;
+    }
+    if (pin->m_next != NULL)
+    {
+        pin->m_next->m_prev = pin->m_prev;
+    }
+    pthread_mutex_unlock(&retention->m_pins_lock);
+}
+
+/* retention_release()
+ *   Punch every whole segment before upto and before every pinned reader
+ *   out of the history file, so the space is freed without rewriting or
+ *   renaming it. upto must not pass the window start; a reader pinned after
+ *   the limit is taken starts at or past the window start, so past upto too.
+ *   Only one thread may release a given history.
+ * out: 0 success, -1 error
+ */
+int retention_release(Retention* retention, const char* path, uint64_t upto)
+{
+    pthread_mutex_lock(&retention->m_pins_lock);
+    for (RetentionPin* pin = retention->m_pins; pin != NULL; pin = pin->m_next)
+    {
+        upto = pin->m_from < upto ? pin->m_from : upto;
+    }
+    pthread_mutex_unlock(&retention->m_pins_lock);
+
+    uint64_t end = upto - upto % RETENTION_SEGMENT_SIZE;
+    if (end <= retention->m_released || retention->m_punch_failed)
+    {
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("open()");
+        return -1;
+    }
+    int status = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, retention->m_released,
+                           end - retention->m_released);
+    if (status == 0)
+    {
+        syslog(LOG_DEBUG, "released %llu history bytes from %s",
+               (unsigned long long)(end - retention->m_released), path);
+        retention->m_released = end;
+    }
+    else if (errno == EOPNOTSUPP)
+    {
+        // replays still honour the window, only the disk space stays in use
+        syslog(LOG_WARNING, "%s does not support hole punching, retained history is not freed", path);
+        retention->m_punch_failed = 1;
+    }
+    else
+    {
+        perror("fallocate()");
+    }
+    close(fd);
+    return status;
+}
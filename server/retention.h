@@ -0,0 +1,87 @@
+#ifndef RETENTION_H
+#define RETENTION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// history is released in whole segments of this many bytes
+#ifndef RETENTION_SEGMENT_SIZE
+#define RETENTION_SEGMENT_SIZE (1024 * 1024)
+#endif
+
+// a line starting with this is a timestamp record, used for age retention
+#define RETENTION_TIMESTAMP_PREFIX "timestamp:"
+#define RETENTION_TIMESTAMP_FORMAT "%Y:%m:%d:%H:%M:%S"
+
+// bytes of each line kept to recognise timestamp records
+#define RETENTION_PREFIX_MAX 32
+
+/*
+ * Limits on the retained history; zero disables a limit. The oldest lines
+ * leave the window as soon as any limit is exceeded.
+ */
+typedef struct RetentionPolicy {
+    uint64_t m_max_bytes;
+    uint64_t m_max_lines;
+    time_t m_max_age;
+} RetentionPolicy;
+
+typedef struct RetentionStamp {
+    uint64_t m_end;
+    time_t m_time;
+} RetentionStamp;
+
+/*
+ * A reader of history from m_from on. Pinned bytes are never released, so
+ * a slow replay cannot read holes.
+ */
+typedef struct RetentionPin {
+    uint64_t m_from;
+    struct RetentionPin* m_prev;
+    struct RetentionPin* m_next;
+} RetentionPin;
+
+/*
+ * The retained window [m_start, m_size) of one history file. Line ends and
+ * timestamp records inside the window are kept in rings so the window moves
+ * in O(1) per dropped line. Bytes before m_start are never replayed, and
+ * whole segments before it and before every pinned reader are punched out
+ * of the file in the background, so the file is never rewritten and
+ * offsets stay stable.
+ */
+typedef struct Retention {
+    RetentionPolicy m_policy;
+    uint64_t* m_line_ends;
+    size_t m_line_head;
+    size_t m_line_count;
+    size_t m_line_capacity;
+    RetentionStamp* m_stamps;
+    size_t m_stamp_head;
+    size_t m_stamp_count;
+    size_t m_stamp_capacity;
+    char m_prefix[RETENTION_PREFIX_MAX];
+    size_t m_prefix_len;
+    int m_skip_line;
+    uint64_t m_size;
+    uint64_t m_start;
+    uint64_t m_age_floor;
+    pthread_mutex_t m_pins_lock;
+    RetentionPin* m_pins;
+    uint64_t m_released;
+    int m_punch_failed;
+} Retention;
+
+int retention_enabled(const RetentionPolicy* policy);
+int retention_init(Retention* retention, const RetentionPolicy* policy);
+int retention_load(Retention* retention, const char* path);
+void retention_free(Retention* retention);
+void retention_observe(Retention* retention, const char* data, size_t size, time_t now);
+uint64_t retention_start(const Retention* retention);
+uint64_t retention_pin_start(Retention* retention, RetentionPin* pin);
+int retention_pin(Retention* retention, RetentionPin* pin, uint64_t from);
+void retention_unpin(Retention* retention, RetentionPin* pin);
+int retention_release(Retention* retention, const char* path, uint64_t upto);
+
+#endif // RETENTION_H
@@ -0,0 +1,380 @@
+#include "subscribers.h"
+#include "error_handling.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+// m_evicted reasons
+#define SUBSCRIBER_SLOW 1
+#define SUBSCRIBER_GONE 2
+
+static void _wake(SubscriberHub* hub)
+{
+    uint64_t one = 1;
+    if (write(hub->m_wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    {
+        perror("write(eventfd)");
+    }
+}
+
+/* _reap()
+ *   Close and free evicted subscribers. Caller holds m_lock. A subscriber
+ *   still being replayed to is only marked: its client thread is writing to
+ *   the fd and will call start or cancel, which hands it over to be reaped.
+ */
+static void _reap(SubscriberHub* hub)
+{
+    Subscriber** link = &hub->m_list;
+    while (*link != NULL)
+    {
+        Subscriber* subscriber = *link;
+        if (!subscriber->m_evicted || !subscriber->m_handed_over)
+        {
+            link = &subscriber->m_next;
+            continue;
+        }
+        if (subscriber->m_evicted == SUBSCRIBER_SLOW)
+        {
+            syslog(LOG_WARNING, "evicted slow subscriber, %zu bytes queued", subscriber->m_used);
+        }
+        *link = subscriber->m_next;
+        __atomic_sub_fetch(&hub->m_count, 1, __ATOMIC_RELAXED);
+        close(subscriber->m_fd);
+        free(subscriber->m_queue);
+        free(subscriber);
+    }
+}
+
+/* _drain()
+ *   Send as much of the queue head as the socket takes without blocking.
+ *   The publisher only writes past m_used, so the bytes are sent unlocked.
+ */
+static void _drain(SubscriberHub* hub, Subscriber* subscriber)
+{
+    pthread_mutex_lock(&hub->m_lock);
+    size_t head = subscriber->m_head;
+    size_t used = subscriber->m_used;
+    pthread_mutex_unlock(&hub->m_lock);
+
+    size_t contiguous = hub->m_queue_limit - head;
+    ssize_t sent = send(subscriber->m_fd, subscriber->m_queue + head, used < contiguous ? used : contiguous,
+                        MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    pthread_mutex_lock(&hub->m_lock);
+    if (sent > 0)
+    {
+        subscriber->m_head = (head + sent) % hub->m_queue_limit;
+        subscriber->m_used -= sent;
+    }
+    else if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        subscriber->m_evicted = SUBSCRIBER_GONE;
+    }
+    pthread_mutex_unlock(&hub->m_lock);
+}
+
+/* _sender()
+ *   Single thread writing every subscriber queue to its socket, woken by
+ *   m_wake_fd whenever a queue gains data or the subscriber set changes
+ */
+static void* _sender(void* arg)
+{
+    SubscriberHub* hub = (SubscriberHub*)arg;
+    struct pollfd* fds = NULL;
+    Subscriber** subscribers = NULL;
+    size_t capacity = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&hub->m_lock);
+        if (!hub->m_running)
+        {
+            pthread_mutex_unlock(&hub->m_lock);
+            break;
+        }
+        _reap(hub);
+        if (hub->m_count + 1 > capacity)
+        {
+            size_t grown = (hub->m_count + 1) * 2;
+            struct pollfd* new_fds = realloc(fds, grown * sizeof(*fds));
+            if (new_fds != NULL)
+            {
+                fds = new_fds;
+            }
+            Subscriber** new_subscribers = realloc(subscribers, grown * sizeof(*subscribers));
+            if (new_subscribers != NULL)
+            {
+                subscribers = new_subscribers;
+            }
+            if (new_fds != NULL && new_subscribers != NULL)
+            {
+                capacity = grown;
+            }
+        }
+        nfds_t count = 0;
+        if (capacity > 0)
+        {
+            fds[count].fd = hub->m_wake_fd;
+            fds[count].events = POLLIN;
+            count++;
+            for (Subscriber* s = hub->m_list; s != NULL && count < capacity; s = s->m_next)
+            {
+                if (!s->m_active)
+                {
+                    continue;
+                }
+                // POLLERR and POLLHUP are reported even when nothing is queued
+                fds[count].fd = s->m_fd;
+                fds[count].events = s->m_used > 0 ? POLLOUT : 0;
+                subscribers[count] = s;
+                count++;
+            }
+        }
+        pthread_mutex_unlock(&hub->m_lock);
+
+        if (count == 0)
+        {
+            // out of memory for the poll set, retry shortly
+            usleep(10000);
+            continue;
+        }
+        if (poll(fds, count, -1) == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("poll()");
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            uint64_t value;
+            if (read(hub->m_wake_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+            {
+                perror("read(eventfd)");
+            }
+        }
+        for (nfds_t i = 1; i < count; i++)
+        {
+            if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+            {
+                pthread_mutex_lock(&hub->m_lock);
+                subscribers[i]->m_evicted = SUBSCRIBER_GONE;
+                pthread_mutex_unlock(&hub->m_lock);
+            }
+            else if (fds[i].revents & POLLOUT)
+            {
+                _drain(hub, subscribers[i]);
+            }
+        }
+    }
+    free(fds);
+    free(subscribers);
+    return NULL;
+}
+
+/* _start_sender()
+ *   Start the sender thread for the first subscriber, so hubs that never
+ *   have one cost no thread or eventfd. Caller holds m_lock.
+ * out: 0 success, -1 error
+ */
+static int _start_sender(SubscriberHub* hub)
+{
+    if (hub->m_started)
+    {
+        return 0;
+    }
+    hub->m_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (hub->m_wake_fd == -1)
+    {
+        perror("eventfd()");
+        return -1;
+    }
+    hub->m_running = 1;
+    if (pthread_create(&hub->m_thread, NULL, _sender, hub) != 0)
+    {
+        hub->m_running = 0;
+        close(hub->m_wake_fd);
+        hub->m_wake_fd = -1;
+        RET_ERR("subscriber hub failed to start its sender");
+    }
+    hub->m_started = 1;
+    return 0;
+}
+
+/* subscriber_hub_init()
+ *   Prepare an empty hub; its sender thread starts with the first subscriber
+ * in: queue_limit: bytes buffered per subscriber before it is evicted
+ * out: 0 success, -1 error
+ */
+int subscriber_hub_init(SubscriberHub* hub, size_t queue_limit)
+{
+    memset(hub, 0, sizeof(*hub));
+    hub->m_queue_limit = queue_limit;
+    hub->m_wake_fd = -1;
+    if (pthread_mutex_init(&hub->m_lock, NULL) != 0)
+    {
+        RET_ERR("subscriber hub failed to initialize its lock");
+    }
+    return 0;
+}
+
+/* subscriber_hub_destroy()
+ *   Stop the sender thread and disconnect every subscriber
+ */
+void subscriber_hub_destroy(SubscriberHub* hub)
+{
+    if (hub->m_started)
+    {
+        pthread_mutex_lock(&hub->m_lock);
+        hub->m_running = 0;
+        pthread_mutex_unlock(&hub->m_lock);
+        _wake(hub);
+        pthread_join(hub->m_thread, NULL);
+        close(hub->m_wake_fd);
+    }
+
+    // no client thread is left replaying, so every subscriber can go
+    for (Subscriber* s = hub->m_list; s != NULL; s = s->m_next)
+    {
+        s->m_evicted = SUBSCRIBER_GONE;
+        s->m_handed_over = 1;
+    }
+    _reap(hub);
+    if (hub->m_evictions > 0)
+    {
+        syslog(LOG_INFO, "evicted %llu slow subscribers", (unsigned long long)hub->m_evictions);
+    }
+    pthread_mutex_destroy(&hub->m_lock);
+}
+
+/* subscriber_hub_add()
+ *   Register a subscriber that queues appends but is not sent to until
+ *   subscriber_hub_start(). Call it under the same lock as the appends, right
+ *   after capturing the history the subscriber is replayed first, so the
+ *   replay and the queue neither overlap nor leave a gap.
+ * in: fd: client socket, owned by the hub from now on
+ * out: subscriber, NULL error
+ */
+Subscriber* subscriber_hub_add(SubscriberHub* hub, int fd)
+{
+    Subscriber* subscriber = (Subscriber*)calloc(1, sizeof(Subscriber));
+    if (subscriber == NULL)
+    {
+        return NULL;
+    }
+    subscriber->m_queue = (char*)malloc(hub->m_queue_limit);
+    if (subscriber->m_queue == NULL)
+    {
+        free(subscriber);
+        return NULL;
+    }
+    subscriber->m_fd = fd;
+
+    pthread_mutex_lock(&hub->m_lock);
+    if (_start_sender(hub) != 0)
+    {
+        pthread_mutex_unlock(&hub->m_lock);
+        free(subscriber->m_queue);
+        free(subscriber);
+        return NULL;
+    }
+    subscriber->m_next = hub->m_list;
+    hub->m_list = subscriber;
+    __atomic_add_fetch(&hub->m_count, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&hub->m_lock);
+    return subscriber;
+}
+
+/* subscriber_hub_start()
+ *   Begin sending queued appends once the replay has been sent
+ */
+void subscriber_hub_start(SubscriberHub* hub, Subscriber* subscriber)
+{
+    int flags = fcntl(subscriber->m_fd, F_GETFL);
+    if (flags == -1 || fcntl(subscriber->m_fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("fcntl(O_NONBLOCK)");
+    }
+    pthread_mutex_lock(&hub->m_lock);
+    // evicted during the replay, it is only reaped from here on
+    subscriber->m_active = 1;
+    subscriber->m_handed_over = 1;
+    pthread_mutex_unlock(&hub->m_lock);
+    _wake(hub);
+}
+
+/* subscriber_hub_cancel()
+ *   Drop a subscriber whose replay failed; the sender thread closes it
+ */
+void subscriber_hub_cancel(SubscriberHub* hub, Subscriber* subscriber)
+{
+    pthread_mutex_lock(&hub->m_lock);
+    if (!subscriber->m_evicted)
+    {
+        subscriber->m_evicted = SUBSCRIBER_GONE;
+    }
+    subscriber->m_handed_over = 1;
+    pthread_mutex_unlock(&hub->m_lock);
+    _wake(hub);
+}
+
+/* subscriber_hub_publish()
+ *   Queue a committed append for every subscriber. A subscriber without room
+ *   for it is evicted rather than allowed to hold up the writer.
+ */
+void subscriber_hub_publish(SubscriberHub* hub, const struct iovec* iov, int iovcnt, size_t size)
+{
+    if (__atomic_load_n(&hub->m_count, __ATOMIC_RELAXED) == 0 || size == 0)
+    {
+        return;
+    }
+
+    int queued = 0;
+    pthread_mutex_lock(&hub->m_lock);
+    for (Subscriber* s = hub->m_list; s != NULL; s = s->m_next)
+    {
+        if (s->m_evicted)
+        {
+            continue;
+        }
+        if (hub->m_queue_limit - s->m_used < size)
+        {
+            s->m_evicted = SUBSCRIBER_SLOW;
+            hub->m_evictions++;
+            queued = 1;
+            continue;
+        }
+        size_t tail = (s->m_head + s->m_used) % hub->m_queue_limit;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            const char* data = (const char*)iov[i].iov_base;
+            size_t remaining = iov[i].iov_len;
+            while (remaining > 0)
+            {
+                size_t contiguous = hub->m_queue_limit - tail;
+                size_t chunk = remaining < contiguous ? remaining : contiguous;
+                memcpy(s->m_queue + tail, data, chunk);
+                tail = (tail + chunk) % hub->m_queue_limit;
+                data += chunk;
+                remaining -= chunk;
+            }
+        }
+        s->m_used += size;
+        queued = 1;
+    }
+    pthread_mutex_unlock(&hub->m_lock);
+
+    if (queued)
+    {
+        _wake(hub);
+    }
+}
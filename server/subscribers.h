@@ -0,0 +1,44 @@
+#ifndef SUBSCRIBERS_H
+#define SUBSCRIBERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * A connection receiving every append as it is committed. Appends are copied
+ * into a bounded byte queue; the publisher only fills free space and the
+ * sender thread only drains the head, so neither waits on the other's I/O.
+ */
+typedef struct Subscriber {
+    int m_fd;
+    char* m_queue;
+    size_t m_head;
+    size_t m_used;
+    int m_active;
+    int m_handed_over;
+    int m_evicted;
+    struct Subscriber* m_next;
+} Subscriber;
+
+typedef struct SubscriberHub {
+    pthread_mutex_t m_lock;
+    pthread_t m_thread;
+    Subscriber* m_list;
+    size_t m_count;
+    size_t m_queue_limit;
+    int m_wake_fd;
+    int m_started;
+    int m_running;
+    uint64_t m_evictions;
+} SubscriberHub;
+
+int subscriber_hub_init(SubscriberHub* hub, size_t queue_limit);
+void subscriber_hub_destroy(SubscriberHub* hub);
+Subscriber* subscriber_hub_add(SubscriberHub* hub, int fd);
+void subscriber_hub_start(SubscriberHub* hub, Subscriber* subscriber);
+void subscriber_hub_cancel(SubscriberHub* hub, Subscriber* subscriber);
+void subscriber_hub_publish(SubscriberHub* hub, const struct iovec* iov, int iovcnt, size_t size);
+
+#endif // SUBSCRIBERS_H
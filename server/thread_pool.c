@@ -1,4 +1,5 @@
 #include "thread_pool.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -6,6 +7,7 @@ typedef struct Task
 {
     void (*task)(void*);
     void* arg;
+    uint64_t queued_ns;
 } Task;
 
 void* task_poll(void* arg)
@@ -43,7 +45,8 @@ void* task_poll(void* arg)
 
         if (task != NULL)
         {
-            task->task(task->arg);
+            TRACE_END("pool queue", task->queued_ns);
+            TRACE_SPAN("pool task", task->task(task->arg));
             free(task);
         }
     }
@@ -163,6 +166,7 @@ int dispatch(ThreadPool* thread_pool, void (*task)(void*), void* arg)
 
     new_task->task = task;
     new_task->arg = arg;
+    new_task->queued_ns = TRACE_NOW();
 
     pthread_mutex_lock(&thread_pool->m_lock);
     if (queue_push_back(thread_pool->m_tasks, new_task) != 0)
@@ -1,5 +1,6 @@
 #include "thread_pool_dynamic.h"
 #include "error_handling.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -9,6 +10,7 @@ typedef struct Task
     void* arg;
     ThreadPool* thread_pool;
     QueueNode* self;
+    uint64_t queued_ns;
 } Task;
 
 void* _run_task(void* arg)
@@ -23,11 +25,13 @@ void* _run_task(void* arg)
 
     { // cleanup scope
         pthread_cleanup_push(free, task);
-        task->task(task->arg);
+        // every task gets a fresh thread, so the wait is thread startup
+        TRACE_END("pool queue", task->queued_ns);
+        TRACE_SPAN("pool task", task->task(task->arg));
         pthread_cleanup_pop(0);
     }
 
-    pthread_mutex_lock(&task->thread_pool->m_lock);
+    profiled_mutex_lock(&task->thread_pool->m_lock);
     if (task->thread_pool->m_kill == 0)
     {
         if (task->self && task->self->m_data)
@@ -35,14 +39,14 @@ void* _run_task(void* arg)
             pthread_t* thread_id = (pthread_t*)task->self->m_data;
             if (queue_delete(task->thread_pool->m_threads, task->self))
             {
-                pthread_mutex_unlock(&task->thread_pool->m_lock);
+                profiled_mutex_unlock(&task->thread_pool->m_lock);
                 free(task);
                 fprintf(stderr, "task thread failed to delete from thread queue\n");
                 pthread_exit(NULL);
             }
             if (queue_push_back(task->thread_pool->m_cleanup, thread_id) != 0)
             {
-                pthread_mutex_unlock(&task->thread_pool->m_lock);
+                profiled_mutex_unlock(&task->thread_pool->m_lock);
                 free(task);
                 fprintf(stderr, "task thread failed to add to cleanup queue\n");
                 pthread_exit(NULL);
@@ -50,13 +54,13 @@ void* _run_task(void* arg)
         }
         else
         {
-            pthread_mutex_unlock(&task->thread_pool->m_lock);
+            profiled_mutex_unlock(&task->thread_pool->m_lock);
             free(task);
             fprintf(stderr, "task thread failed to cleanup\n");
             pthread_exit(NULL);
         }
     }
-    pthread_mutex_unlock(&task->thread_pool->m_lock);
+    profiled_mutex_unlock(&task->thread_pool->m_lock);
     free(task);
     return NULL;
 }
@@ -69,21 +73,21 @@ int pool_make_thread_pool(ThreadPool** thread_pool)
         RET_ERR("thread_pool failed to allocate");
     }
 
-    if (pthread_mutex_init(&(*thread_pool)->m_lock, NULL) != 0)
+    if (profiled_mutex_init(&(*thread_pool)->m_lock, "thread_pool", 0) != 0)
     {
         RET_ERR("lock failed to init");
     }
 
     if (queue_make_queue(&(*thread_pool)->m_threads) != 0)
     {
-        pthread_mutex_destroy(&(*thread_pool)->m_lock);
+        profiled_mutex_destroy(&(*thread_pool)->m_lock);
         free(*thread_pool);
         RET_ERR("thread queue failed to init");
     }
 
     if (queue_make_queue(&(*thread_pool)->m_cleanup) != 0)
     {
-        pthread_mutex_destroy(&(*thread_pool)->m_lock);
+        profiled_mutex_destroy(&(*thread_pool)->m_lock);
         queue_destroy_queue((*thread_pool)->m_threads);
         free(*thread_pool);
         RET_ERR("cleanup queue failed to init");
@@ -101,9 +105,9 @@ int pool_destroy_thread_pool(ThreadPool* thread_pool)
         RET_ERR("unexpected NULL");
     }
 
-    pthread_mutex_lock(&thread_pool->m_lock);
+    profiled_mutex_lock(&thread_pool->m_lock);
     thread_pool->m_kill = 1; // with this set, threads will no longer access the queues
-    pthread_mutex_unlock(&thread_pool->m_lock);
+    profiled_mutex_unlock(&thread_pool->m_lock);
 
     if (thread_pool->m_threads != NULL)
     {
@@ -117,7 +121,7 @@ int pool_destroy_thread_pool(ThreadPool* thread_pool)
         queue_destroy_queue(thread_pool->m_cleanup);
     }
 
-    pthread_mutex_destroy(&thread_pool->m_lock);
+    profiled_mutex_destroy(&thread_pool->m_lock);
     free(thread_pool);
     return 0;
 }
@@ -137,6 +141,7 @@ int pool_dispatch(ThreadPool* thread_pool, void (*task)(void*), void* arg)
     task_obj->task = task;
     task_obj->arg = arg;
     task_obj->thread_pool = thread_pool;
+    task_obj->queued_ns = TRACE_NOW();
 
     pthread_t* thread_id = (pthread_t*)malloc(sizeof(pthread_t));
     if (thread_id == NULL)
@@ -145,12 +150,20 @@ int pool_dispatch(ThreadPool* thread_pool, void (*task)(void*), void* arg)
         RET_ERR("thread_id failed to allocate");
     }
 
-    pthread_mutex_lock(&thread_pool->m_lock);
+    profiled_mutex_lock(&thread_pool->m_lock);
+    if (thread_pool->m_kill)
+    {
+        // the destroying thread is joining m_threads without the lock
+        free(task_obj);
+        free(thread_id);
+        profiled_mutex_unlock(&thread_pool->m_lock);
+        RET_ERR("thread pool is shutting down");
+    }
     if (queue_push_back(thread_pool->m_threads, thread_id) != 0)
     {
         free(task_obj);
         free(thread_id);
-        pthread_mutex_unlock(&thread_pool->m_lock);
+        profiled_mutex_unlock(&thread_pool->m_lock);
         RET_ERR("thread queue failed to push");
     }
     task_obj->self = thread_pool->m_threads->m_tail;
@@ -163,14 +176,14 @@ int pool_dispatch(ThreadPool* thread_pool, void (*task)(void*), void* arg)
         }
         free(task_obj);
         free(thread_id);
-        pthread_mutex_unlock(&thread_pool->m_lock);
+        profiled_mutex_unlock(&thread_pool->m_lock);
         RET_ERR("pthread failed to create");
     }
 
     // clean up completed threads
     pool_cleanup(thread_pool->m_cleanup);
     
-    pthread_mutex_unlock(&thread_pool->m_lock);
+    profiled_mutex_unlock(&thread_pool->m_lock);
     return 0;
 }
 
@@ -2,13 +2,13 @@
 #define THREAD_POOL_H
 
 #include "queue.h"
-#include <pthread.h>
+#include "lock_profile.h"
 
 typedef struct ThreadPool
 {
     Queue* m_threads;
     Queue* m_cleanup;
-    pthread_mutex_t m_lock;
+    ProfiledMutex m_lock;
     int m_kill;
 } ThreadPool;
 
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+typedef struct TraceSpan {
+    const char* m_name;
+    uint64_t m_start_ns;
+    uint64_t m_end_ns;
+    pid_t m_tid;
+} TraceSpan;
+
+/*
+ * Spans of the threads that held this buffer. m_count only grows; span n
+ * lives in slot n % TRACE_BUFFER_SPANS. Like the log rings, a buffer is
+ * handed to the next thread once its thread exits.
+ */
+typedef struct TraceBuffer {
+    TraceSpan* m_spans;
+    uint64_t m_count;
+    int m_owned;
+} TraceBuffer;
+
+int trace_enabled = 0;
+
+static TraceBuffer buffers[TRACE_MAX_BUFFERS];
+static __thread TraceBuffer* thread_buffer;
+static __thread pid_t thread_tid;
+static pthread_key_t buffer_key;
+static pthread_once_t buffer_key_once = PTHREAD_ONCE_INIT;
+static uint64_t dropped;
+static const char* trace_path;
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t trace_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void _release_buffer(void* arg)
+{
+    TraceBuffer* buffer = (TraceBuffer*)arg;
+    __atomic_store_n(&buffer->m_owned, 0, __ATOMIC_RELEASE);
+}
+
+static void _create_key(void)
+{
+    pthread_key_create(&buffer_key, _release_buffer);
+}
+
+/* _claim()
+ *   Give the calling thread a buffer of its own until it exits
+ * out: buffer, NULL if all are claimed or allocation failed
+ */
+static TraceBuffer* _claim(void)
+{
+    pthread_once(&buffer_key_once, _create_key);
+    for (int i = 0; i < TRACE_MAX_BUFFERS; i++)
+    {
+        TraceBuffer* buffer = &buffers[i];
+        int free_buffer = 0;
+        if (__atomic_load_n(&buffer->m_owned, __ATOMIC_RELAXED) ||
+            !__atomic_compare_exchange_n(&buffer->m_owned, &free_buffer, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+        if (buffer->m_spans == NULL)
+        {
+            TraceSpan* spans = (TraceSpan*)malloc(TRACE_BUFFER_SPANS * sizeof(TraceSpan));
+            if (spans == NULL)
+            {
+                __atomic_store_n(&buffer->m_owned, 0, __ATOMIC_RELEASE);
+                return NULL;
+            }
+            __atomic_store_n(&buffer->m_spans, spans, __ATOMIC_RELEASE);
+        }
+        pthread_setspecific(buffer_key, buffer);
+        thread_buffer = buffer;
+        thread_tid = (pid_t)syscall(SYS_gettid);
+        return buffer;
+    }
+    return NULL;
+}
+
+void trace_record(const char* name, uint64_t start_ns, uint64_t end_ns)
+{
+    TraceBuffer* buffer = thread_buffer != NULL ? thread_buffer : _claim();
+    if (buffer == NULL)
+    {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    uint64_t count = buffer->m_count;
+    TraceSpan* span = &buffer->m_spans[count % TRACE_BUFFER_SPANS];
+    span->m_name = name;
+    span->m_start_ns = start_ns;
+    span->m_end_ns = end_ns;
+    span->m_tid = thread_tid;
+    __atomic_store_n(&buffer->m_count, count + 1, __ATOMIC_RELEASE);
+}
+
+/* trace_start()
+ *   Switch tracing on; trace_dump() writes to path
+ * out: 0 success, -1 tracing was not compiled in
+ */
+int trace_start(const char* path)
+{
+#ifdef TRACE
+    trace_path = path;
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+#else
+    (void)path;
+    fprintf(stderr, "tracing is not compiled in, build with TRACE=1\n");
+    return -1;
+#endif
+}
+
+/* _dump_buffer()
+ *   Write the spans of one buffer that survive the copy. Writers keep
+ *   going, so spans they may have overwritten meanwhile are skipped.
+ * out: spans written
+ */
+static size_t _dump_buffer(TraceBuffer* buffer, TraceSpan* copy, FILE* stream, pid_t pid, size_t written)
+{
+    TraceSpan* spans = __atomic_load_n(&buffer->m_spans, __ATOMIC_ACQUIRE);
+    if (spans == NULL)
+    {
+        return 0;
+    }
+    uint64_t end = __atomic_load_n(&buffer->m_count, __ATOMIC_ACQUIRE);
+    uint64_t begin = end > TRACE_BUFFER_SPANS ? end - TRACE_BUFFER_SPANS : 0;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        copy[i - begin] = spans[i % TRACE_BUFFER_SPANS];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now = __atomic_load_n(&buffer->m_count, __ATOMIC_RELAXED);
+    // a writer at now may already be filling the slot of span now - TRACE_BUFFER_SPANS
+    uint64_t valid = now >= TRACE_BUFFER_SPANS ? now + 1 - TRACE_BUFFER_SPANS : 0;
+
+    size_t count = 0;
+    for (uint64_t i = begin > valid ? begin : valid; i < end; i++)
+    {
+        const TraceSpan* span = &copy[i - begin];
+        fprintf(stream, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+                written + count ? ",\n" : "", span->m_name, (int)pid, (int)span->m_tid,
+                (unsigned long long)(span->m_start_ns / 1000), (unsigned long long)(span->m_start_ns % 1000),
+                (unsigned long long)((span->m_end_ns - span->m_start_ns) / 1000),
+                (unsigned long long)((span->m_end_ns - span->m_start_ns) % 1000));
+        count++;
+    }
+    return count;
+}
+
+/* trace_dump()
+ *   Write every buffered span to the trace path as Chrome trace JSON. The
+ *   file is written beside the path and renamed over it, so a reader never
+ *   sees half a trace. Tracing carries on while the dump runs.
+ * out: 0 success, -1 error or tracing off
+ */
+int trace_dump(void)
+{
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE) || trace_path == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&dump_lock);
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", trace_path);
+    FILE* stream = fopen(temp_path, "w");
+    TraceSpan* copy = (TraceSpan*)malloc(TRACE_BUFFER_SPANS * sizeof(TraceSpan));
+    if (stream == NULL || copy == NULL)
+    {
+        perror("trace_dump()");
+        if (stream != NULL)
+        {
+            fclose(stream);
+        }
+        free(copy);
+        pthread_mutex_unlock(&dump_lock);
+        return -1;
+    }
+
+    pid_t pid = getpid();
+    size_t written = 0;
+    fprintf(stream, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (int i = 0; i < TRACE_MAX_BUFFERS; i++)
+    {
+        written += _dump_buffer(&buffers[i], copy, stream, pid, written);
+    }
+    fprintf(stream, "\n],\"otherData\":{\"dropped_spans\":\"%llu\"}}\n",
+            (unsigned long long)__atomic_load_n(&dropped, __ATOMIC_RELAXED));
+    free(copy);
+
+    int status = fclose(stream) == 0 && rename(temp_path, trace_path) == 0 ? 0 : -1;
+    if (status != 0)
+    {
+        perror("trace_dump()");
+    }
+    pthread_mutex_unlock(&dump_lock);
+    return status;
+}
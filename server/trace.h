@@ -0,0 +1,67 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// spans kept per thread buffer; a full buffer overwrites its oldest spans
+#ifndef TRACE_BUFFER_SPANS
+#define TRACE_BUFFER_SPANS 16384
+#endif
+
+// threads tracing at once; further threads drop their spans
+#ifndef TRACE_MAX_BUFFERS
+#define TRACE_MAX_BUFFERS 256
+#endif
+
+/*
+ * Span tracing, compiled in with -DTRACE (make TRACE=1) and switched on at
+ * runtime by trace_start(). Spans go to per-thread buffers without locks
+ * and trace_dump() writes them out as Chrome trace JSON, which
+ * chrome://tracing and Perfetto load. Compiled in but switched off, a span
+ * costs one predictable branch; compiled out it costs nothing.
+ *
+ * TRACE_SPAN(name, statement) times a statement. Spans that start and end
+ * in different places take TRACE_NOW() at the start and TRACE_END() at the
+ * end, which records nothing when the start was taken with tracing off.
+ * name must be a string literal or otherwise outlive the trace.
+ */
+#ifdef TRACE
+extern int trace_enabled;
+
+#define TRACE_SPAN(name, statement)                                           \
+    do                                                                        \
+    {                                                                         \
+        if (__builtin_expect(trace_enabled, 0))                               \
+        {                                                                     \
+            uint64_t trace_start_ns = trace_now_ns();                         \
+            statement;                                                        \
+            trace_record((name), trace_start_ns, trace_now_ns());             \
+        }                                                                     \
+        else                                                                  \
+        {                                                                     \
+            statement;                                                        \
+        }                                                                     \
+    } while (0)
+
+#define TRACE_NOW() (__builtin_expect(trace_enabled, 0) ? trace_now_ns() : 0)
+
+#define TRACE_END(name, start_ns)                                             \
+    do                                                                        \
+    {                                                                         \
+        if (__builtin_expect((start_ns) != 0, 0))                             \
+        {                                                                     \
+            trace_record((name), (start_ns), trace_now_ns());                 \
+        }                                                                     \
+    } while (0)
+#else
+#define TRACE_SPAN(name, statement) do { statement; } while (0)
+#define TRACE_NOW() ((uint64_t)0)
+#define TRACE_END(name, start_ns) do { (void)(start_ns); } while (0)
+#endif
+
+uint64_t trace_now_ns(void);
+void trace_record(const char* name, uint64_t start_ns, uint64_t end_ns);
+int trace_start(const char* path);
+int trace_dump(void);
+
+#endif // TRACE_H
@@ -0,0 +1,98 @@
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+static void free_buffers(runner_buffer *buffers)
+{
+    free(buffers[0].data);
+    free(buffers[1].data);
+}
+
+void test_run_commands_pipeline()
+{
+    char *const echo[] = { "/bin/echo", "hello world", NULL };
+    char *const read_line[] = { "/bin/sh", "-c", "read line; echo \"got $line\"", NULL };
+    runner_buffer buffers[2] = { { 0 } };
+    runner_command commands[] = {
+        { echo, 1, runner_capture, buffers, 0 },
+        { read_line, -1, runner_capture, buffers, 0 },
+    };
+
+    TEST_ASSERT_TRUE(run_commands(commands, 2, 2));
+    TEST_ASSERT_EQUAL_STRING("got hello world\n", buffers[0].data);
+    TEST_ASSERT_EQUAL_INT(0, commands[0].exit_status);
+    TEST_ASSERT_EQUAL_INT(0, commands[1].exit_status);
+    free_buffers(buffers);
+}
+
+/**
+ * Every command registers itself in a shared directory, reports how many
+ * commands are registered and stays long enough for the others to overlap.
+ * The largest count reported is the most commands that ran at once.
+ */
+void test_run_commands_parallelism_bound()
+{
+    char dir[] = "/tmp/run_commands.XXXXXX";
+    TEST_ASSERT_TRUE(mkdtemp(dir) != NULL);
+    char script[256];
+    snprintf(script, sizeof(script),
+             "touch %s/$$; ls %s | wc -l; sleep 0.5; rm %s/$$", dir, dir, dir);
+    char *const count[] = { "/bin/sh", "-c", script, NULL };
+
+    runner_buffer buffers[6][2];
+    runner_command commands[6];
+    memset(buffers, 0, sizeof(buffers));
+    for (int i = 0; i < 6; i++)
+    {
+        runner_command command = { count, -1, runner_capture, buffers[i], 0 };
+        commands[i] = command;
+    }
+
+    TEST_ASSERT_TRUE(run_commands(commands, 6, 2));
+    int most = 0;
+    for (int i = 0; i < 6; i++)
+    {
+        TEST_ASSERT_TRUE(buffers[i][0].data != NULL);
+        int running = atoi(buffers[i][0].data);
+        most = running > most ? running : most;
+        free_buffers(buffers[i]);
+    }
+    TEST_ASSERT_EQUAL_INT(2, most);
+    rmdir(dir);
+}
+
+void test_run_commands_stderr_capture()
+{
+    char *const both[] = { "/bin/sh", "-c", "echo out; echo err >&2", NULL };
+    runner_buffer buffers[2] = { { 0 } };
+    runner_command commands[] = {
+        { both, -1, runner_capture, buffers, 0 },
+    };
+
+    TEST_ASSERT_TRUE(run_commands(commands, 1, 1));
+    TEST_ASSERT_EQUAL_STRING("out\n", buffers[0].data);
+    TEST_ASSERT_EQUAL_STRING("err\n", buffers[1].data);
+    free_buffers(buffers);
+}
+
+void test_run_commands_exit_status()
+{
+    char *const succeed[] = { "/bin/sh", "-c", "exit 0", NULL };
+    char *const fail[] = { "/bin/sh", "-c", "exit 3", NULL };
+    char *const missing[] = { "/nonexistent/command", NULL };
+    runner_command commands[] = {
+        { succeed, -1, NULL, NULL, 0 },
+        { fail, -1, NULL, NULL, 0 },
+        { missing, -1, NULL, NULL, 0 },
+        { succeed, -1, NULL, NULL, 0 },
+    };
+
+    TEST_ASSERT_FALSE(run_commands(commands, 4, 2));
+    TEST_ASSERT_EQUAL_INT(0, commands[0].exit_status);
+    TEST_ASSERT_EQUAL_INT(3, commands[1].exit_status);
+    TEST_ASSERT_EQUAL_INT(-1, commands[2].exit_status);
+    TEST_ASSERT_EQUAL_INT(0, commands[3].exit_status);
+}
@@ -0,0 +1,42 @@
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/channel_path.h"
+#include "../../server/block_store.h"
+#include "../../server/journal.h"
+#include "../../server/line_index.h"
+
+void test_channel_path_default()
+{
+    char* path = channel_path("/var/tmp/aesdsocketdata", NULL);
+    TEST_ASSERT_EQUAL_STRING("/var/tmp/aesdsocketdata", path);
+    free(path);
+}
+
+void test_channel_path_named()
+{
+    char* path = channel_path("/var/tmp/aesdsocketdata", "sensors");
+    TEST_ASSERT_EQUAL_STRING("/var/tmp/aesdsocketdata.ch-sensors", path);
+    free(path);
+}
+
+/**
+ * A channel named after a sidecar suffix must not land on the default
+ * channel's sidecar file
+ */
+void test_channel_path_avoids_sidecars()
+{
+    static const char *suffixes[] = {
+        LINE_INDEX_SUFFIX, JOURNAL_SUFFIX, JOURNAL_CHECKPOINT_SUFFIX,
+        BLOCK_STORE_INDEX_SUFFIX, BLOCK_STORE_TAIL_SUFFIX,
+    };
+    char sidecar[64];
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+        char* path = channel_path("h", suffixes[i] + 1);
+        snprintf(sidecar, sizeof(sidecar), "h%s", suffixes[i]);
+        TEST_ASSERT_TRUE(strcmp(sidecar, path) != 0);
+        free(path);
+    }
+}
@@ -0,0 +1,130 @@
+#include "unity.h"
+#include <stdio.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char *writes[] = {
+    "write1\n", "write2\n", "write3\n", "write4\n", "write5\n", "write6\n",
+    "write7\n", "write8\n", "write9\n", "write10\n", "write11\n", "write12\n",
+};
+
+static void fill_buffer(struct aesd_circular_buffer *buffer, size_t count)
+{
+    aesd_circular_buffer_init(buffer);
+    for (size_t i = 0; i < count; i++)
+    {
+        struct aesd_buffer_entry entry = { writes[i], strlen(writes[i]) };
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * Concatenate the slices so a test can compare them against the expected text
+ */
+static size_t gather(const struct iovec *iov, size_t count, char *out)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(out + total, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    out[total] = '\0';
+    return total;
+}
+
+void test_fill_iovec_whole_buffer()
+{
+    struct aesd_circular_buffer buffer;
+    struct iovec iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    char out[256];
+    size_t count;
+    fill_buffer(&buffer, 3);
+
+    size_t bytes = aesd_circular_buffer_fill_iovec(&buffer, 0, 1000, iov, 10, &count);
+    TEST_ASSERT_EQUAL_UINT(21, bytes);
+    TEST_ASSERT_EQUAL_UINT(3, count);
+    gather(iov, count, out);
+    TEST_ASSERT_EQUAL_STRING("write1\nwrite2\nwrite3\n", out);
+    TEST_ASSERT_EQUAL_PTR(writes[0], iov[0].iov_base);
+}
+
+void test_fill_iovec_partial_entries()
+{
+    struct aesd_circular_buffer buffer;
+    struct iovec iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    char out[256];
+    size_t count;
+    fill_buffer(&buffer, 3);
+
+    // starts inside the first entry and stops inside the third
+    size_t bytes = aesd_circular_buffer_fill_iovec(&buffer, 5, 12, iov, 10, &count);
+    TEST_ASSERT_EQUAL_UINT(12, bytes);
+    TEST_ASSERT_EQUAL_UINT(3, count);
+    gather(iov, count, out);
+    TEST_ASSERT_EQUAL_STRING("1\nwrite2\nwri", out);
+    TEST_ASSERT_EQUAL_PTR(writes[0] + 5, iov[0].iov_base);
+}
+
+void test_fill_iovec_wraps_around()
+{
+    struct aesd_circular_buffer buffer;
+    struct iovec iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    char out[256];
+    size_t count;
+    // twelve writes into ten entries: write3 is the oldest, stored at index 2
+    fill_buffer(&buffer, 12);
+
+    size_t bytes = aesd_circular_buffer_fill_iovec(&buffer, 0, 1000, iov, 10, &count);
+    TEST_ASSERT_EQUAL_UINT(10, count);
+    TEST_ASSERT_EQUAL_UINT(73, bytes);
+    gather(iov, count, out);
+    TEST_ASSERT_EQUAL_STRING("write3\nwrite4\nwrite5\nwrite6\nwrite7\nwrite8\nwrite9\n"
+                             "write10\nwrite11\nwrite12\n", out);
+
+    // a range that crosses the end of the entry array
+    bytes = aesd_circular_buffer_fill_iovec(&buffer, 50, 12, iov, 10, &count);
+    TEST_ASSERT_EQUAL_UINT(12, bytes);
+    TEST_ASSERT_EQUAL_UINT(2, count);
+    gather(iov, count, out);
+    TEST_ASSERT_EQUAL_STRING("rite10\nwrite", out);
+    TEST_ASSERT_EQUAL_PTR(buffer.entry[0].buffptr, iov[1].iov_base);
+}
+
+void test_fill_iovec_limits()
+{
+    struct aesd_circular_buffer buffer;
+    struct iovec iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    char out[256];
+    size_t count;
+    fill_buffer(&buffer, 5);
+
+    // iov_max bounds the slices, and the return value says how far they reach
+    size_t bytes = aesd_circular_buffer_fill_iovec(&buffer, 0, 1000, iov, 2, &count);
+    TEST_ASSERT_EQUAL_UINT(2, count);
+    TEST_ASSERT_EQUAL_UINT(14, bytes);
+    gather(iov, count, out);
+    TEST_ASSERT_EQUAL_STRING("write1\nwrite2\n", out);
+
+    // past the end of the data
+    bytes = aesd_circular_buffer_fill_iovec(&buffer, 35, 10, iov, 10, &count);
+    TEST_ASSERT_EQUAL_UINT(0, bytes);
+    TEST_ASSERT_EQUAL_UINT(0, count);
+
+    // zero length
+    bytes = aesd_circular_buffer_fill_iovec(&buffer, 3, 0, iov, 10, &count);
+    TEST_ASSERT_EQUAL_UINT(0, bytes);
+    TEST_ASSERT_EQUAL_UINT(0, count);
+}
+
+void test_fill_iovec_empty_buffer()
+{
+    struct aesd_circular_buffer buffer;
+    struct iovec iov[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t count = 99;
+    aesd_circular_buffer_init(&buffer);
+
+    size_t bytes = aesd_circular_buffer_fill_iovec(&buffer, 0, 10, iov, 10, &count);
+    TEST_ASSERT_EQUAL_UINT(0, bytes);
+    TEST_ASSERT_EQUAL_UINT(0, count);
+}